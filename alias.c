@@ -0,0 +1,69 @@
+#include "alias.h"
+
+/*
+ * builds an alias table over n weights, which don't need to be normalized.
+ * the pdf of each slot is its normalized weight; if every weight is zero the
+ * table is uniform. scratch must hold n indices
+ */
+void
+alias_build(alias_entry *out, const float *weights, uint32_t n,
+    uint32_t *scratch)
+{
+	double total;
+	float inv;
+	uint32_t i, s, l, n_small, n_large, small;
+
+	total = 0.0;
+	for (i = 0; i < n; i++)
+		total += weights[i];
+
+	if (total > 0.0) {
+		inv = 1.0 / total;
+		for (i = 0; i < n; i++) {
+			out[i].pdf = weights[i] * inv;
+			out[i].q = out[i].pdf * n;
+			out[i].alias = i;
+			out[i].alias_pdf = out[i].pdf;
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			out[i].pdf = 1.0f / n;
+			out[i].q = 1.0f;
+			out[i].alias = i;
+			out[i].alias_pdf = out[i].pdf;
+		}
+	}
+
+	/*
+	 * small slots grow up from the start of scratch, large down from the
+	 * end. the classification is branch free as it's a coin flip for noisy
+	 * images
+	 */
+	n_small = 0;
+	n_large = 0;
+	for (i = 0; i < n; i++) {
+		small = out[i].q < 1.0f;
+		scratch[small ? n_small : n - 1 - n_large] = i;
+		n_small += small;
+		n_large += !small;
+	}
+
+	/* a large slot keeps donating until it becomes small itself */
+	while (n_small > 0 && n_large > 0) {
+		s = scratch[--n_small];
+		l = scratch[n - n_large];
+		out[s].alias = l;
+		out[s].alias_pdf = out[l].pdf;
+		out[l].q -= 1.0f - out[s].q;
+		if (out[l].q < 1.0f) {
+			n_large--;
+			scratch[n_small++] = l;
+		}
+	}
+
+	/* whatever is left over is only off from 1 by rounding */
+	while (n_small > 0)
+		out[scratch[--n_small]].q = 1.0f;
+	while (n_large > 0)
+		out[scratch[n - n_large--]].q = 1.0f;
+}
@@ -0,0 +1,40 @@
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * one slot of a Vose alias table. a slot is kept with probability q and
+ * otherwise replaced by its alias. the probabilities of both outcomes are
+ * stored alongside so a sample and its pdf come from the same cache line
+ */
+typedef struct {
+	float q;
+	uint32_t alias;
+	float pdf, alias_pdf;
+} alias_entry;
+
+void alias_build(alias_entry *, const float *, uint32_t, uint32_t *);
+
+/* draws an index from the table using u in [0, 1), and writes its pdf */
+static inline uint32_t
+alias_sample(const alias_entry *table, uint32_t n, float u, float *pdf)
+{
+	const alias_entry *e;
+	uint32_t i;
+	float f;
+
+	f = u * n;
+	i = f;
+	i = i < n ? i : n - 1;
+	e = &table[i];
+	if (f - i < e->q) {
+		*pdf = e->pdf;
+		return i;
+	}
+	*pdf = e->alias_pdf;
+	return e->alias;
+}
+
+#endif /* ALIAS_H */
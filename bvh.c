@@ -0,0 +1,749 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "pool.h"
+
+/*
+ * leaves are intersected a whole vector of primitives at a time, so testing
+ * one costs well under a box test and small leaves aren't worth splitting
+ */
+#define BVH_BINS	      16
+#define BVH_MAX_LEAF	      8
+#define BVH_SMALL_LEAF	      8
+#define BVH_MAX_SAH_DEPTH     64
+#define BVH_TASK_SIZE	      4096
+#define BVH_BIN_CHUNK	      16384
+#define BVH_TOP_SIZE	      (4 * BVH_BIN_CHUNK)
+#define BVH_LAZY_SIZE	      4096
+#define BVH_TRAVERSAL_COST    1.0f
+#define BVH_INTERSECTION_COST 0.3f
+
+/*
+ * the binary tree the SAH build makes before it's collapsed into wide nodes.
+ * an interior node has count 0 and its children at offset and offset + 1. a
+ * deferred node is a range of count primitives left for bvh_expand
+ */
+struct bnode {
+	aabb box;
+	uint32_t offset;
+	uint32_t count;
+	int deferred;
+};
+
+struct ref {
+	aabb box;
+	uint32_t index;
+};
+
+/*
+ * while top is set the main thread is still splitting the nodes of at least
+ * BVH_TOP_SIZE refs, binning them in chunks on the pool, and subtree tasks
+ * wait in pending until it's done
+ */
+struct build {
+	struct bnode *nodes;
+	struct ref *refs;
+	atomic_uint n_nodes, n_deferred;
+	int lazy, parallel, top;
+	struct build_task *pending;
+};
+
+struct build_task {
+	struct build *b;
+	uint32_t node, begin, end;
+	int depth;
+	struct build_task *next;
+};
+
+struct bin {
+	aabb box;
+	uint32_t count;
+};
+
+/* BVH_BIN_CHUNK refs of a node split on the main thread */
+struct chunk {
+	const struct ref *refs;
+	uint32_t begin, end;
+	const aabb *cbox;
+	const float *scale;
+	aabb box, centroids;
+	struct bin bins[3][BVH_BINS];
+};
+
+extern char *prog_name;
+
+static void build_node(struct build *, uint32_t, uint32_t, uint32_t, int);
+
+static float
+centroid(const struct ref *ref, int axis)
+{
+	return 0.5f * (ref->box.min[axis] + ref->box.max[axis]);
+}
+
+static void
+make_leaf(struct bnode *node, uint32_t begin, uint32_t end)
+{
+	node->offset = begin;
+	node->count = end - begin;
+	node->deferred = 0;
+}
+
+/* partial quickselect, leaves the median of refs on axis at mid */
+static void
+select_median(struct ref *refs, uint32_t begin, uint32_t end, uint32_t mid,
+    int axis)
+{
+	struct ref tmp;
+	uint32_t i, j;
+	float pivot;
+
+	while (end - begin > 1) {
+		pivot = centroid(&refs[begin + (end - begin) / 2], axis);
+		i = begin;
+		j = end - 1;
+		while (i <= j) {
+			while (centroid(&refs[i], axis) < pivot)
+				i++;
+			while (centroid(&refs[j], axis) > pivot)
+				j--;
+			if (i <= j) {
+				tmp = refs[i];
+				refs[i] = refs[j];
+				refs[j] = tmp;
+				i++;
+				if (j == 0)
+					break;
+				j--;
+			}
+		}
+		if (mid <= j)
+			end = j + 1;
+		else if (mid >= i)
+			begin = i;
+		else
+			return;
+	}
+}
+
+static void
+build_task_run(void *arg, int worker)
+{
+	struct build_task *t;
+
+	(void)worker;
+
+	t = arg;
+	build_node(t->b, t->node, t->begin, t->end, t->depth);
+	free(t);
+}
+
+/*
+ * subtrees big enough to be worth a task are built on the pool, but not
+ * before the main thread is done with the nodes it bins in chunks, since
+ * waiting for those would wait for every task
+ */
+static void
+build_child(struct build *b, uint32_t node, uint32_t begin, uint32_t end,
+    int depth)
+{
+	struct build_task *t;
+
+	if (b->top && end - begin >= BVH_TOP_SIZE) {
+		build_node(b, node, begin, end, depth);
+		return;
+	}
+	if (b->parallel && end - begin >= BVH_TASK_SIZE &&
+	    (t = malloc(sizeof(*t)))) {
+		*t = (struct build_task) { b, node, begin, end, depth, NULL };
+		if (b->top) {
+			t->next = b->pending;
+			b->pending = t;
+		} else {
+			pool_submit(build_task_run, t);
+		}
+		return;
+	}
+	build_node(b, node, begin, end, depth);
+}
+
+/* grows box by the refs in [begin, end) and cbox by their centroids */
+static void
+bound_refs(const struct ref *refs, uint32_t begin, uint32_t end, aabb *box,
+    aabb *cbox)
+{
+	aabb c;
+	uint32_t i;
+	int k;
+
+	for (i = begin; i < end; i++) {
+		aabb_grow(box, &refs[i].box);
+		for (k = 0; k < 3; k++)
+			c.min[k] = c.max[k] = centroid(&refs[i], k);
+		aabb_grow(cbox, &c);
+	}
+}
+
+static void
+empty_bins(struct bin bins[3][BVH_BINS])
+{
+	int axis, k;
+
+	for (axis = 0; axis < 3; axis++) {
+		for (k = 0; k < BVH_BINS; k++) {
+			aabb_empty(&bins[axis][k].box);
+			bins[axis][k].count = 0;
+		}
+	}
+}
+
+/* adds the refs in [begin, end) to the bins of all three axes */
+static void
+bin_refs(const struct ref *refs, uint32_t begin, uint32_t end,
+    const aabb *cbox, const float *scale, struct bin bins[3][BVH_BINS])
+{
+	uint32_t i;
+	int axis, k;
+
+	for (i = begin; i < end; i++) {
+		for (axis = 0; axis < 3; axis++) {
+			k = (centroid(&refs[i], axis) - cbox->min[axis]) *
+			    scale[axis];
+			k = k < BVH_BINS - 1 ? k : BVH_BINS - 1;
+			bins[axis][k].count++;
+			aabb_grow(&bins[axis][k].box, &refs[i].box);
+		}
+	}
+}
+
+static void
+bound_task(void *arg, int worker)
+{
+	struct chunk *c;
+
+	(void)worker;
+
+	c = arg;
+	aabb_empty(&c->box);
+	aabb_empty(&c->centroids);
+	bound_refs(c->refs, c->begin, c->end, &c->box, &c->centroids);
+}
+
+static void
+bin_task(void *arg, int worker)
+{
+	struct chunk *c;
+
+	(void)worker;
+
+	c = arg;
+	empty_bins(c->bins);
+	bin_refs(c->refs, c->begin, c->end, c->cbox, c->scale, c->bins);
+}
+
+/*
+ * splits [begin, end) into chunks of BVH_BIN_CHUNK refs. returns NULL if
+ * they can't be allocated, and the node is then binned serially
+ */
+static struct chunk *
+make_chunks(const struct ref *refs, uint32_t begin, uint32_t end,
+    size_t *n_out)
+{
+	struct chunk *chunks;
+	size_t n, i;
+
+	n = (end - begin + BVH_BIN_CHUNK - 1) / BVH_BIN_CHUNK;
+	if (!(chunks = malloc(sizeof(*chunks) * n)))
+		return NULL;
+	for (i = 0; i < n; i++) {
+		chunks[i].refs = refs;
+		chunks[i].begin = begin + i * BVH_BIN_CHUNK;
+		chunks[i].end = end - chunks[i].begin > BVH_BIN_CHUNK ?
+		    chunks[i].begin + BVH_BIN_CHUNK :
+		    end;
+	}
+	*n_out = n;
+	return chunks;
+}
+
+/*
+ * finds the cheapest split by the surface area heuristic over BVH_BINS
+ * equally sized bins of centroids on each axis. all three axes are binned in
+ * one pass over the primitives, or over each of the chunks on the pool if
+ * there are any. returns the cost, or INFINITY if the centroids can't be
+ * separated
+ */
+static float
+find_split(const struct ref *refs, uint32_t begin, uint32_t end,
+    const aabb *cbox, struct chunk *chunks, size_t n_chunks, int *axis_out,
+    int *bin_out)
+{
+	struct bin bins[3][BVH_BINS];
+	aabb left;
+	float scale[3], best, cost, right_area[BVH_BINS];
+	uint32_t right_count[BVH_BINS], left_count;
+	size_t i;
+	int axis, k;
+
+	for (axis = 0; axis < 3; axis++) {
+		scale[axis] = 0.0f;
+		if (cbox->max[axis] > cbox->min[axis])
+			scale[axis] = BVH_BINS /
+			    (cbox->max[axis] - cbox->min[axis]);
+	}
+
+	empty_bins(bins);
+	if (!chunks) {
+		bin_refs(refs, begin, end, cbox, scale, bins);
+	} else {
+		for (i = 0; i < n_chunks; i++) {
+			chunks[i].cbox = cbox;
+			chunks[i].scale = scale;
+			pool_submit(bin_task, &chunks[i]);
+		}
+		pool_wait();
+		for (i = 0; i < n_chunks; i++) {
+			for (axis = 0; axis < 3; axis++) {
+				for (k = 0; k < BVH_BINS; k++) {
+					bins[axis][k].count +=
+					    chunks[i].bins[axis][k].count;
+					aabb_grow(&bins[axis][k].box,
+					    &chunks[i].bins[axis][k].box);
+				}
+			}
+		}
+	}
+
+	best = INFINITY;
+	for (axis = 0; axis < 3; axis++) {
+		if (scale[axis] == 0.0f)
+			continue;
+
+		aabb_empty(&left);
+		left_count = 0;
+		for (k = BVH_BINS - 1; k > 0; k--) {
+			aabb_grow(&left, &bins[axis][k].box);
+			left_count += bins[axis][k].count;
+			right_area[k] = aabb_area(&left);
+			right_count[k] = left_count;
+		}
+
+		aabb_empty(&left);
+		left_count = 0;
+		for (k = 0; k < BVH_BINS - 1; k++) {
+			aabb_grow(&left, &bins[axis][k].box);
+			left_count += bins[axis][k].count;
+			if (left_count == 0 || right_count[k + 1] == 0)
+				continue;
+			cost = aabb_area(&left) * left_count +
+			    right_area[k + 1] * right_count[k + 1];
+			if (cost < best) {
+				best = cost;
+				*axis_out = axis;
+				*bin_out = k;
+			}
+		}
+	}
+
+	return best;
+}
+
+static void
+build_node(struct build *b, uint32_t index, uint32_t begin, uint32_t end,
+    int depth)
+{
+	struct bnode *node;
+	struct chunk *chunks;
+	aabb box, cbox;
+	float cost, scale, area;
+	uint32_t i, j, mid, child;
+	size_t n_chunks, c;
+	int axis, bin, k;
+	struct ref tmp;
+
+	node = &b->nodes[index];
+
+	/* only the main thread can wait on the pool */
+	chunks = NULL;
+	n_chunks = 0;
+	if (b->top && end - begin >= BVH_TOP_SIZE)
+		chunks = make_chunks(b->refs, begin, end, &n_chunks);
+
+	aabb_empty(&box);
+	aabb_empty(&cbox);
+	if (!chunks) {
+		bound_refs(b->refs, begin, end, &box, &cbox);
+	} else {
+		for (c = 0; c < n_chunks; c++)
+			pool_submit(bound_task, &chunks[c]);
+		pool_wait();
+		for (c = 0; c < n_chunks; c++) {
+			aabb_grow(&box, &chunks[c].box);
+			aabb_grow(&cbox, &chunks[c].centroids);
+		}
+	}
+	node->box = box;
+
+	if (end - begin <= BVH_SMALL_LEAF) {
+		free(chunks);
+		make_leaf(node, begin, end);
+		return;
+	}
+	if (b->lazy && end - begin <= BVH_LAZY_SIZE) {
+		free(chunks);
+		make_leaf(node, begin, end);
+		node->deferred = 1;
+		atomic_fetch_add(&b->n_deferred, 1);
+		return;
+	}
+
+	axis = 0;
+	bin = 0;
+	cost = INFINITY;
+	if (depth < BVH_MAX_SAH_DEPTH)
+		cost = find_split(b->refs, begin, end, &cbox, chunks, n_chunks,
+		    &axis, &bin);
+	free(chunks);
+
+	area = aabb_area(&box);
+	if (cost != INFINITY && area > 0) {
+		cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * cost / area;
+		if (cost >= BVH_INTERSECTION_COST * (end - begin) &&
+		    end - begin <= BVH_MAX_LEAF) {
+			make_leaf(node, begin, end);
+			return;
+		}
+	}
+
+	if (cost != INFINITY) {
+		scale = BVH_BINS / (cbox.max[axis] - cbox.min[axis]);
+		i = begin;
+		j = end;
+		while (i < j) {
+			k = (centroid(&b->refs[i], axis) - cbox.min[axis]) *
+			    scale;
+			k = k < BVH_BINS - 1 ? k : BVH_BINS - 1;
+			if (k <= bin) {
+				i++;
+				continue;
+			}
+			tmp = b->refs[i];
+			b->refs[i] = b->refs[--j];
+			b->refs[j] = tmp;
+		}
+		mid = i;
+	} else if (end - begin <= BVH_MAX_LEAF) {
+		make_leaf(node, begin, end);
+		return;
+	} else {
+		/*
+		 * either every centroid coincides or the tree is already
+		 * deep, fall back to an object median split on the widest
+		 * axis, which keeps the depth logarithmic
+		 */
+		axis = 0;
+		for (k = 1; k < 3; k++) {
+			if (cbox.max[k] - cbox.min[k] >
+			    cbox.max[axis] - cbox.min[axis])
+				axis = k;
+		}
+		mid = begin + (end - begin) / 2;
+		select_median(b->refs, begin, end, mid, axis);
+	}
+
+	child = atomic_fetch_add(&b->n_nodes, 2);
+	node->offset = child;
+	node->count = 0;
+	node->deferred = 0;
+
+	build_child(b, child, begin, mid, depth + 1);
+	build_child(b, child + 1, mid, end, depth + 1);
+}
+
+/*
+ * sets the frame children of node are quantized in, the scale is rounded up
+ * until the top of the range covers box
+ */
+static void
+set_frame(bvh_node *node, const aabb *box)
+{
+	float scale;
+	int k;
+
+	for (k = 0; k < 3; k++) {
+		scale = (box->max[k] - box->min[k]) / 255.0f;
+		while (box->min[k] + 255.0f * scale < box->max[k])
+			scale = nextafterf(scale, INFINITY);
+		node->origin[k] = box->min[k];
+		node->scale[k] = scale;
+	}
+}
+
+/* stores box as child c of node, rounded outwards to the next steps */
+static void
+quantize_child(bvh_node *node, int c, const aabb *box)
+{
+	float o, s, f;
+	int k, lo, hi;
+
+	for (k = 0; k < 3; k++) {
+		o = node->origin[k];
+		s = node->scale[k];
+		lo = 0;
+		hi = 0;
+		if (s > 0.0f) {
+			f = floorf((box->min[k] - o) / s);
+			lo = f < 0.0f ? 0 : f > 255.0f ? 255 : f;
+			while (lo > 0 && o + lo * s > box->min[k])
+				lo--;
+			f = ceilf((box->max[k] - o) / s);
+			hi = f < 0.0f ? 0 : f > 255.0f ? 255 : f;
+			while (hi < 255 && o + hi * s < box->max[k])
+				hi++;
+		}
+		node->qmin[k][c] = lo;
+		node->qmax[k][c] = hi;
+	}
+}
+
+/*
+ * turns the binary subtree at index into a wide node. its children start as
+ * the two binary ones, and the interior child with the largest area is
+ * replaced by its own children until BVH_WIDTH are found or only leaves are
+ * left. deferred ranges are added to out->lazy. returns the index of the new
+ * node
+ */
+static uint32_t
+collapse(const struct bnode *in, bvh *out, uint32_t index)
+{
+	const struct bnode *b, *kids[BVH_WIDTH];
+	bvh_lazy *l;
+	uint32_t node, child;
+	float area, best_area;
+	int n, i, best;
+
+	node = out->n_nodes++;
+	b = &in[index];
+	n = 0;
+	if (b->count != 0) {
+		kids[n++] = b;
+	} else {
+		kids[n++] = &in[b->offset];
+		kids[n++] = &in[b->offset + 1];
+	}
+
+	while (n < BVH_WIDTH) {
+		best = -1;
+		best_area = -1.0f;
+		for (i = 0; i < n; i++) {
+			if (kids[i]->count != 0)
+				continue;
+			area = aabb_area(&kids[i]->box);
+			if (area > best_area) {
+				best_area = area;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		child = kids[best]->offset;
+		kids[best] = &in[child];
+		kids[n++] = &in[child + 1];
+	}
+
+	set_frame(&out->nodes[node], &b->box);
+	out->nodes[node].n_children = n;
+	for (i = n; i < BVH_WIDTH; i++) {
+		out->nodes[node].child[i] = 0;
+		out->nodes[node].count[i] = 0;
+		out->nodes[node].qmin[0][i] = out->nodes[node].qmin[1][i] =
+		    out->nodes[node].qmin[2][i] = 0;
+		out->nodes[node].qmax[0][i] = out->nodes[node].qmax[1][i] =
+		    out->nodes[node].qmax[2][i] = 0;
+	}
+	for (i = 0; i < n; i++) {
+		quantize_child(&out->nodes[node], i, &kids[i]->box);
+		if (kids[i]->deferred) {
+			l = &out->lazy[out->n_lazy];
+			l->begin = kids[i]->offset;
+			l->end = kids[i]->offset + kids[i]->count;
+			atomic_init(&l->built, 0);
+			pthread_mutex_init(&l->lock, NULL);
+			memset(&l->sub, 0, sizeof(l->sub));
+			out->nodes[node].child[i] = out->n_lazy++;
+			out->nodes[node].count[i] = BVH_DEFERRED;
+		} else if (kids[i]->count != 0) {
+			out->nodes[node].child[i] = kids[i]->offset;
+			out->nodes[node].count[i] = kids[i]->count;
+		} else {
+			child = collapse(in, out, kids[i] - in);
+			out->nodes[node].child[i] = child;
+			out->nodes[node].count[i] = 0;
+		}
+	}
+
+	return node;
+}
+
+static int
+build(bvh *out, const aabb *boxes, uint32_t *order, size_t n, int lazy,
+    int parallel)
+{
+	struct build b;
+	struct build_task *t, *next;
+	uint32_t n_nodes, n_deferred;
+	bvh_node *shrunk;
+	size_t i;
+
+	memset(out, 0, sizeof(*out));
+	if (n == 0)
+		return 0;
+
+	b.nodes = malloc(sizeof(*b.nodes) * (2 * n - 1));
+	b.refs = malloc(sizeof(*b.refs) * n);
+	if (!b.nodes || !b.refs)
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		b.refs[i].box = boxes[i];
+		b.refs[i].index = i;
+	}
+	atomic_init(&b.n_nodes, 1);
+	atomic_init(&b.n_deferred, 0);
+	b.lazy = lazy;
+	b.parallel = parallel;
+	b.top = parallel;
+	b.pending = NULL;
+
+	build_node(&b, 0, 0, n, 0);
+	b.top = 0;
+	for (t = b.pending; t; t = next) {
+		next = t->next;
+		pool_submit(build_task_run, t);
+	}
+	if (parallel)
+		pool_wait();
+
+	for (i = 0; i < n; i++)
+		order[i] = b.refs[i].index;
+	free(b.refs);
+	b.refs = NULL;
+
+	n_nodes = atomic_load(&b.n_nodes);
+	n_deferred = atomic_load(&b.n_deferred);
+	out->nodes = malloc(sizeof(*out->nodes) * (n_nodes / 2 + 1));
+	out->lazy = malloc(sizeof(*out->lazy) * (n_deferred ? n_deferred : 1));
+	if (!out->nodes || !out->lazy)
+		goto fail;
+	collapse(b.nodes, out, 0);
+	free(b.nodes);
+
+	if ((shrunk = realloc(out->nodes, sizeof(*shrunk) * out->n_nodes)))
+		out->nodes = shrunk;
+	return 0;
+fail:
+	fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+	free(b.nodes);
+	free(b.refs);
+	free(out->nodes);
+	free(out->lazy);
+	memset(out, 0, sizeof(*out));
+	return 1;
+}
+
+/*
+ * builds a BVH over n boxes. order receives the primitive indices in leaf
+ * order, leaves refer to positions in it. nodes of at least BVH_TOP_SIZE
+ * primitives are binned in parallel chunks and subtrees with at least
+ * BVH_TASK_SIZE are built in parallel on the thread pool, then the binary
+ * tree is collapsed into wide nodes. every wide node uses up at least one
+ * binary interior node, so there are at most as many. if lazy is set, ranges
+ * of up to BVH_LAZY_SIZE primitives are left as deferred children and only
+ * ordered among each other
+ */
+int
+bvh_build(bvh *out, const aabb *boxes, uint32_t *order, size_t n, int lazy)
+{
+	return build(out, boxes, order, n, lazy, 1);
+}
+
+/*
+ * builds a deferred subtree, once however many threads get here at the same
+ * time. this runs on render workers, which can't wait on the pool, so the
+ * build is serial; BVH_LAZY_SIZE keeps it under the parallel threshold
+ * anyway. there's no way to report failure to the ray, so it's fatal
+ */
+const bvh *
+bvh_expand(bvh_lazy *l, const bvh_source *src, void *ctx)
+{
+	bvh_node *node;
+	aabb *boxes;
+	uint32_t *order, n;
+	size_t i;
+	int c;
+
+	pthread_mutex_lock(&l->lock);
+	if (atomic_load_explicit(&l->built, memory_order_relaxed)) {
+		pthread_mutex_unlock(&l->lock);
+		return &l->sub;
+	}
+
+	n = l->end - l->begin;
+	boxes = malloc(sizeof(*boxes) * n);
+	order = malloc(sizeof(*order) * n);
+	if (!boxes || !order) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		exit(1);
+	}
+	src->boxes(ctx, l->begin, l->end, boxes);
+	if (build(&l->sub, boxes, order, n, 0, 0) != 0 ||
+	    src->reorder(ctx, l->begin, order, n) != 0)
+		exit(1);
+	free(boxes);
+	free(order);
+
+	for (i = 0; i < l->sub.n_nodes; i++) {
+		node = &l->sub.nodes[i];
+		for (c = 0; c < node->n_children; c++)
+			if (node->count[c] != 0)
+				node->child[c] += l->begin;
+	}
+
+	atomic_store_explicit(&l->built, 1, memory_order_release);
+	pthread_mutex_unlock(&l->lock);
+	return &l->sub;
+}
+
+/* the box of everything in the BVH, as the root's quantization frame */
+void
+bvh_bounds(const bvh *bvh, aabb *out)
+{
+	const bvh_node *root;
+	int k;
+
+	aabb_empty(out);
+	if (bvh->n_nodes == 0)
+		return;
+	root = &bvh->nodes[0];
+	for (k = 0; k < 3; k++) {
+		out->min[k] = root->origin[k];
+		out->max[k] = root->origin[k] + 255.0f * root->scale[k];
+	}
+}
+
+void
+bvh_free(bvh *bvh)
+{
+	size_t i;
+
+	for (i = 0; i < bvh->n_lazy; i++) {
+		bvh_free(&bvh->lazy[i].sub);
+		pthread_mutex_destroy(&bvh->lazy[i].lock);
+	}
+	free(bvh->lazy);
+	free(bvh->nodes);
+	memset(bvh, 0, sizeof(*bvh));
+}
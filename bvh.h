@@ -0,0 +1,233 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "simd.h"
+
+/*
+ * a node has up to BVH_WIDTH children and a traversal can leave all but one
+ * of them on the stack at every level
+ */
+#define BVH_WIDTH      8
+#define BVH_STACK_SIZE (BVH_WIDTH * 128)
+
+typedef struct {
+	float min[3], max[3];
+} aabb;
+
+/*
+ * nodes are stored in one flat array with the root at index 0. each node
+ * holds the boxes of its children, quantized to 8 bits over its own box:
+ * child c spans origin + qmin[.][c] * scale to origin + qmax[.][c] * scale,
+ * rounded outwards. a child with count 0 is the node at index child, one
+ * with count BVH_DEFERRED is lazy[child], any other is a leaf of count
+ * primitives starting at child. only the first n_children slots are used
+ */
+typedef struct {
+	float origin[3], scale[3];
+	uint32_t child[BVH_WIDTH];
+	uint8_t qmin[3][BVH_WIDTH], qmax[3][BVH_WIDTH];
+	uint8_t count[BVH_WIDTH];
+	uint8_t n_children;
+} bvh_node;
+
+/* the count of a child whose subtree is built on first use, see bvh_lazy */
+#define BVH_DEFERRED UINT8_MAX
+
+typedef struct bvh_lazy bvh_lazy;
+
+typedef struct {
+	bvh_node *nodes;
+	size_t n_nodes;
+	bvh_lazy *lazy;
+	size_t n_lazy;
+} bvh;
+
+/*
+ * a subtree over the primitives in [begin, end) that isn't built until a ray
+ * first reaches it. the coarse build only puts them in the right range. built
+ * is set once sub and the primitive order are final, after which neither
+ * changes
+ */
+struct bvh_lazy {
+	uint32_t begin, end;
+	atomic_int built;
+	pthread_mutex_t lock;
+	bvh sub;
+};
+
+/*
+ * how a deferred subtree gets at its primitives. boxes fills in the boxes of
+ * [begin, end), and reorder puts the n primitives from begin in the given
+ * order, relative to begin
+ */
+typedef struct {
+	void (*boxes)(void *, uint32_t, uint32_t, aabb *);
+	int (*reorder)(void *, uint32_t, const uint32_t *, uint32_t);
+} bvh_source;
+
+/* per ray constants for the box tests */
+typedef struct {
+	float origin[3], inv_d[3];
+} bvh_ray;
+
+/* a node or leaf waiting on the traversal stack, t is its entry distance */
+typedef struct {
+	uint32_t index, count;
+	float t;
+} bvh_entry;
+
+int bvh_build(bvh *, const aabb *, uint32_t *, size_t, int);
+const bvh *bvh_expand(bvh_lazy *, const bvh_source *, void *);
+void bvh_bounds(const bvh *, aabb *);
+void bvh_free(bvh *);
+
+/* the built subtree for a deferred child, building it if this is first */
+static inline const bvh *
+bvh_subtree(bvh_lazy *l, const bvh_source *src, void *ctx)
+{
+	if (atomic_load_explicit(&l->built, memory_order_acquire))
+		return &l->sub;
+	return bvh_expand(l, src, ctx);
+}
+
+static inline void
+aabb_empty(aabb *box)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		box->min[i] = INFINITY;
+		box->max[i] = -INFINITY;
+	}
+}
+
+static inline void
+aabb_grow(aabb *box, const aabb *other)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (other->min[i] < box->min[i])
+			box->min[i] = other->min[i];
+		if (other->max[i] > box->max[i])
+			box->max[i] = other->max[i];
+	}
+}
+
+static inline float
+aabb_area(const aabb *box)
+{
+	float dx, dy, dz;
+
+	dx = box->max[0] - box->min[0];
+	dy = box->max[1] - box->min[1];
+	dz = box->max[2] - box->min[2];
+	if (dx < 0 || dy < 0 || dz < 0)
+		return 0.0f;
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static inline void
+bvh_ray_init(bvh_ray *r, const float *origin, const float *d)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		r->origin[i] = origin[i];
+		r->inv_d[i] = 1.0f / d[i];
+	}
+}
+
+/*
+ * slab tests the children of a node against [0, t_max), all of them at once
+ * where vectors are available. returns a mask of the children hit and their
+ * entry distances in t_near. min and max are ordered so an axis the ray is
+ * parallel to inside a flat box, which gives NaN, doesn't cull
+ */
+static inline int
+bvh_hit_children(const bvh_node *node, const bvh_ray *r, float t_max,
+    float *t_near)
+{
+	float a[3], b[3];
+	int i, c, mask;
+#if VWIDTH > 1
+	vfloat t0, t1, near, far;
+#else
+	float t0, t1, near, far;
+#endif
+
+	for (i = 0; i < 3; i++) {
+		a[i] = node->scale[i] * r->inv_d[i];
+		b[i] = (node->origin[i] - r->origin[i]) * r->inv_d[i];
+	}
+
+	mask = 0;
+#if VWIDTH > 1
+	for (c = 0; c < BVH_WIDTH; c += VWIDTH) {
+		near = vset1(0.0f);
+		far = vset1(t_max);
+		for (i = 0; i < 3; i++) {
+			t0 = vadd(vmul(vload_u8(&node->qmin[i][c]), vset1(a[i])),
+			    vset1(b[i]));
+			t1 = vadd(vmul(vload_u8(&node->qmax[i][c]), vset1(a[i])),
+			    vset1(b[i]));
+			near = vmax(vmin(t0, t1), near);
+			far = vmin(vmax(t0, t1), far);
+		}
+		vstore(t_near + c, near);
+		mask |= vmask(vle(near, far)) << c;
+	}
+#else
+	for (c = 0; c < node->n_children; c++) {
+		near = 0.0f;
+		far = t_max;
+		for (i = 0; i < 3; i++) {
+			t0 = node->qmin[i][c] * a[i] + b[i];
+			t1 = node->qmax[i][c] * a[i] + b[i];
+			if (t0 > t1) {
+				far = t0 < far ? t0 : far;
+				near = t1 > near ? t1 : near;
+			} else {
+				far = t1 < far ? t1 : far;
+				near = t0 > near ? t0 : near;
+			}
+		}
+		t_near[c] = near;
+		mask |= (near <= far) << c;
+	}
+#endif
+
+	return mask & ((1 << node->n_children) - 1);
+}
+
+/*
+ * pushes the children of node in mask, sorted so the nearest is popped
+ * first
+ */
+static inline void
+bvh_push_children(const bvh_node *node, int mask, const float *t_near,
+    bvh_entry *stack, size_t *sp)
+{
+	bvh_entry e;
+	size_t base, j;
+	int c;
+
+	base = *sp;
+	for (; mask; mask &= mask - 1) {
+		c = __builtin_ctz(mask);
+		e.index = node->child[c];
+		e.count = node->count[c];
+		e.t = t_near[c];
+		for (j = (*sp)++; j > base && stack[j - 1].t < e.t; j--)
+			stack[j] = stack[j - 1];
+		stack[j] = e;
+	}
+}
+
+#endif /* BVH_H */
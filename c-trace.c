@@ -7,6 +7,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "pool.h"
+#include "render.h"
 #include "scene.h"
 
 #define VERSION "0.2"
@@ -16,6 +18,12 @@
 #define DEFAULT_SAMPLES	    64
 #define DEFAULT_MAX_BOUNCES 2
 
+enum {
+	OPT_SNAPSHOT = 256,
+	OPT_SNAPSHOT_EVERY,
+	OPT_NOISE_THRESHOLD,
+};
+
 typedef struct {
 	unsigned char r, g, b;
 } pixel;
@@ -23,20 +31,29 @@ typedef struct {
 void usage(FILE *);
 void png_error_handler(png_structp, png_const_charp);
 int write_png_init(long, long);
-static float rad_inverse(unsigned int);
-static color ray_color(ray *, int);
+static void write_row(color *, long);
+static void write_snapshot(color *, unsigned int);
 static void color_2_pixel(color *, pixel *);
 static void color_2_pixel_linear(color *, pixel *);
-static float rand_float(void);
-static void rand_unit_vector(vec);
 
 char *prog_name;
 
 static int help_flag;
 static int version_flag;
+static int progressive_flag;
+static int no_cache_flag;
+static int compile_flag;
+static int stats_flag;
+static int no_lazy_flag;
+static int raster_flag;
+static int wavefront_flag;
+static char *output_path;
+static char *snapshot_path;
 static png_structp png_ptr;
 static png_infop info_ptr;
 static jmp_buf jb;
+static pixel *row;
+static long width, height;
 
 static struct option long_opts[] = {
 	{ "help", no_argument, &help_flag, 'h' },
@@ -44,32 +61,45 @@ static struct option long_opts[] = {
 	{ "samples", required_argument, NULL, 's' },
 	{ "geometry", required_argument, NULL, 'g' },
 	{ "bounces", required_argument, NULL, 'b' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "progressive", no_argument, &progressive_flag, 'p' },
+	{ "time-limit", required_argument, NULL, 'T' },
+	{ "snapshot", required_argument, NULL, OPT_SNAPSHOT },
+	{ "snapshot-every", required_argument, NULL, OPT_SNAPSHOT_EVERY },
+	{ "noise-threshold", required_argument, NULL, OPT_NOISE_THRESHOLD },
+	{ "no-cache", no_argument, &no_cache_flag, 1 },
+	{ "compile", no_argument, &compile_flag, 1 },
+	{ "stats", no_argument, &stats_flag, 1 },
+	{ "no-lazy", no_argument, &no_lazy_flag, 1 },
+	{ "raster", no_argument, &raster_flag, 1 },
+	{ "wavefront", no_argument, &wavefront_flag, 1 },
+	{ "output", required_argument, NULL, 'o' },
 	{ NULL, 0, NULL, 0 },
 };
 
 int
 main(int argc, char **argv)
 {
-	char *cur, *end, *geom_str, *samples_str, *bounce_str;
-	int c, opt_idx, samples, max_bounces;
-	unsigned int i;
-	long x, y, width, height;
-	float u, v, u2, v2;
-	ray ray;
-	color pc;
-	pixel *row;
-	material *cur_mat, *next_mat;
+	char *cur, *end, *geom_str, *samples_str, *bounce_str, *threads_str;
+	char *time_str, *every_str, *noise_str;
+	int c, opt_idx, samples, max_bounces, threads, every_passes, ret;
+	double time_limit, every_secs;
+	float noise_threshold;
+	render_opts opts;
 	FILE *input;
 
 	prog_name = argv[0];
 	samples_str = NULL;
 	geom_str = NULL;
 	bounce_str = NULL;
-	samples_str = NULL;
+	threads_str = NULL;
+	time_str = NULL;
+	every_str = NULL;
+	noise_str = NULL;
 	opt_idx = 0;
 
-	while ((c = getopt_long(argc, argv, "hvs:g:b:", long_opts, &opt_idx)) !=
-	    -1) {
+	while ((c = getopt_long(argc, argv, "hvs:g:b:t:pT:o:", long_opts,
+		    &opt_idx)) != -1) {
 		if (c == 0) {
 			if (long_opts[opt_idx].flag)
 				continue;
@@ -85,6 +115,30 @@ main(int argc, char **argv)
 		case 'b':
 			bounce_str = optarg;
 			break;
+		case 't':
+			threads_str = optarg;
+			break;
+		case 'p':
+			progressive_flag = 1;
+			break;
+		case 'T':
+			time_str = optarg;
+			progressive_flag = 1;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case OPT_SNAPSHOT:
+			snapshot_path = optarg;
+			progressive_flag = 1;
+			break;
+		case OPT_SNAPSHOT_EVERY:
+			every_str = optarg;
+			break;
+		case OPT_NOISE_THRESHOLD:
+			noise_str = optarg;
+			progressive_flag = 1;
+			break;
 		case 'h':
 			help_flag = 1;
 			break;
@@ -165,7 +219,7 @@ parse_samples:
 parse_bounces:
 	if (!bounce_str) {
 		max_bounces = DEFAULT_MAX_BOUNCES;
-		goto done;
+		goto parse_threads;
 	}
 	errno = 0;
 	max_bounces = (int)strtol(bounce_str, &end, 10);
@@ -182,7 +236,107 @@ parse_bounces:
 		    argv[0]);
 		goto fail;
 	}
+parse_threads:
+	if (!threads_str) {
+		threads = pool_default_size();
+		goto parse_time_limit;
+	}
+	errno = 0;
+	threads = (int)strtol(threads_str, &end, 10);
+	if (*end || end == threads_str) {
+		fprintf(stderr, "%s: threads must be a number\n", argv[0]);
+		goto fail;
+	}
+	if (errno == ERANGE) {
+		fprintf(stderr, "%s: threads out of range\n", argv[0]);
+		goto fail;
+	}
+	if (threads <= 0) {
+		fprintf(stderr, "%s: threads must be greater than 0\n",
+		    argv[0]);
+		goto fail;
+	}
+parse_time_limit:
+	if (!time_str) {
+		time_limit = 0.0;
+		goto parse_snapshot_every;
+	}
+	errno = 0;
+	time_limit = strtod(time_str, &end);
+	if (*end || end == time_str) {
+		fprintf(stderr, "%s: time limit must be a number\n", argv[0]);
+		goto fail;
+	}
+	if (errno == ERANGE) {
+		fprintf(stderr, "%s: time limit out of range\n", argv[0]);
+		goto fail;
+	}
+	if (time_limit <= 0.0) {
+		fprintf(stderr, "%s: time limit must be greater than 0\n",
+		    argv[0]);
+		goto fail;
+	}
+parse_snapshot_every:
+	every_passes = 0;
+	every_secs = 0.0;
+	if (!every_str) {
+		every_passes = 1;
+		goto parse_noise_threshold;
+	}
+	errno = 0;
+	every_secs = strtod(every_str, &end);
+	if (end == every_str || (*end && strcmp(end, "s") != 0)) {
+		fprintf(stderr,
+		    "%s: snapshot interval must be a number of passes or"
+		    " seconds\n",
+		    argv[0]);
+		goto fail;
+	}
+	if (errno == ERANGE) {
+		fprintf(stderr, "%s: snapshot interval out of range\n",
+		    argv[0]);
+		goto fail;
+	}
+	if (every_secs <= 0.0) {
+		fprintf(stderr,
+		    "%s: snapshot interval must be greater than 0\n", argv[0]);
+		goto fail;
+	}
+	if (!*end) {
+		every_passes = (int)every_secs;
+		every_secs = 0.0;
+		if (every_passes <= 0) {
+			fprintf(stderr, "%s: snapshot interval must be at least"
+					" one pass\n",
+			    argv[0]);
+			goto fail;
+		}
+	}
+parse_noise_threshold:
+	if (!noise_str) {
+		noise_threshold = 0.0;
+		goto done;
+	}
+	errno = 0;
+	noise_threshold = strtof(noise_str, &end);
+	if (*end || end == noise_str) {
+		fprintf(stderr, "%s: noise threshold must be a number\n",
+		    argv[0]);
+		goto fail;
+	}
+	if (errno == ERANGE) {
+		fprintf(stderr, "%s: noise threshold out of range\n", argv[0]);
+		goto fail;
+	}
+	if (noise_threshold <= 0.0) {
+		fprintf(stderr, "%s: noise threshold must be greater than 0\n",
+		    argv[0]);
+		goto fail;
+	}
 done:
+	if (pool_init(threads) != 0)
+		return 1;
+
 	errno = 0;
 	if (optind == argc || strcmp(argv[optind], "-") == 0) {
 		input = stdin;
@@ -191,14 +345,42 @@ done:
 		return 1;
 	}
 
-	if (load_scene(input, (float)width / (float)height) != 0) {
+	envmap_cache = !no_cache_flag;
+	scene_stats = stats_flag;
+	/* a compiled scene holds every BVH in full */
+	scene_lazy = !no_lazy_flag && !compile_flag;
+	if (compile_flag) {
+		if (!output_path) {
+			fprintf(stderr, "%s: --compile needs an output file\n",
+			    argv[0]);
+			goto fail;
+		}
+		ret = load_scene(input, 1.0f) != 0 ||
+		    compile_scene(output_path) != 0;
 		if (input != stdin)
 			fclose(input);
-		return 1;
+		free_scene();
+		pool_destroy();
+		return ret;
 	}
 
-	if (input != stdin)
+	if (input != stdin && scene_is_compiled(input)) {
+		fclose(input);
+		if (load_compiled(argv[optind], (float)width / (float)height) !=
+		    0)
+			return 1;
+	} else if (load_scene(input, (float)width / (float)height) != 0) {
+		if (input != stdin)
+			fclose(input);
+		return 1;
+	} else if (input != stdin) {
 		fclose(input);
+	}
+
+	if (output_path && !freopen(output_path, "wb", stdout)) {
+		perror(argv[0]);
+		return 1;
+	}
 
 	if ((row = malloc(sizeof(*row) * width)) == NULL)
 		return 1; // oh nooooo
@@ -210,14 +392,12 @@ done:
 		return 1;
 	}
 
-	write_png_init(width, height);
-
 	// for (y = 0; y < height; y++) {
 	// 	for (x = 0; x < width; x++) {
 	// 		pc = (color) {
-	// 			scene.bg.cdf_m[y],
-	// 			scene.bg.cdf_c[y * width + x],
-	// 			scene.bg.pdf[y * width + x],
+	// 			scene.bg.map.marginal[y].q,
+	// 			scene.bg.map.rows[y * width + x].q,
+	// 			scene.bg.map.rows[y * width + x].pdf,
 	// 		};
 	// 		color_2_pixel_linear(&pc, &row[x]);
 	// 	}
@@ -226,72 +406,50 @@ done:
 	//
 	// goto cleanup;
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			pc = (color) { 0.0, 0.0, 0.0 };
-			for (i = 0; i < (unsigned int)samples; i++) {
-				u = (float)x;
-				u += (float)(i + 1) / (float)(samples + 1);
-				v = (float)y;
-				v += rad_inverse(i + 1);
-
-				u /= (float)width;
-				v /= (float)height;
-
-				u2 = (rand_float() - 0.5) * 0.02;
-				v2 = (rand_float() - 0.5) * 0.02;
-
-				(void)u2;
-				(void)v2;
-
-				glm_vec4_copy(scene.camera.eye, ray.origin);
-				glm_vec4_muladds(scene.camera.right, u2,
-				    ray.origin);
-				glm_vec4_muladds(scene.camera.down, v2,
-				    ray.origin);
-
-				glm_vec4_copy(scene.camera.upper_left, ray.d);
-				glm_vec4_muladds(scene.camera.right, u, ray.d);
-				glm_vec4_muladds(scene.camera.down, v, ray.d);
-				glm_vec4_sub(ray.d, ray.origin, ray.d);
-
-				color_add(&pc, ray_color(&ray, max_bounces));
-			}
-			glm_vec4_divs((float *)&pc, (float)samples,
-			    (float *)&pc);
-			color_2_pixel(&pc, &row[x]);
-		}
-		png_write_row(png_ptr, (unsigned char *)row);
+	opts = (render_opts) {
+		.width = width,
+		.height = height,
+		.samples = samples,
+		.max_bounces = max_bounces,
+		.progressive = progressive_flag,
+		.time_limit = time_limit,
+		.snapshot_passes = every_passes,
+		.snapshot_secs = every_secs,
+		.noise_threshold = noise_threshold,
+		.raster = raster_flag,
+		.wavefront = wavefront_flag,
+	};
+	/* nothing is written unless the whole frame could be set up */
+	ret = render_init(&opts) != 0;
+	if (!ret && write_png_init(width, height) != 0) {
+		render_free();
+		ret = 1;
+	}
+	if (ret) {
+		pool_destroy();
+		free(row);
+		free_scene();
+		return 1;
 	}
+
+	if (progressive_flag)
+		render_progressive(write_row,
+		    snapshot_path ? write_snapshot : NULL);
+	else
+		render(write_row);
+	render_free();
+	pool_destroy();
 cleanup:
 	png_write_end(png_ptr, NULL);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 	free(row);
-	cur_mat = scene.materials->next;
-	while (cur_mat) {
-		next_mat = cur_mat->next;
-		free(cur_mat);
-		cur_mat = next_mat;
-	}
+	free_scene();
 	return 0;
 fail:
 	usage(stderr);
 	return 1;
 }
 
-static float
-rad_inverse(unsigned int n)
-{
-	unsigned int rev;
-	n = (((n & 0xaaaaaaaa) >> 1) | ((n & 0x55555555) << 1));
-	n = (((n & 0xcccccccc) >> 2) | ((n & 0x33333333) << 2));
-	n = (((n & 0xf0f0f0f0) >> 4) | ((n & 0x0f0f0f0f) << 4));
-	n = (((n & 0xff00ff00) >> 8) | ((n & 0x00ff00ff) << 8));
-	rev = (n >> 16) | (n << 16);
-
-	return (float)rev / (float)UINT_MAX;
-}
-
 static void
 color_2_pixel(color *color, pixel *out)
 {
@@ -310,134 +468,6 @@ color_2_pixel_linear(color *color, pixel *out)
 	out->b = color->b * 255;
 }
 
-static float
-rand_float(void)
-{
-	return rand() / (RAND_MAX + 1.0);
-}
-
-static void
-rand_unit_vector(vec out)
-{
-	float x, y, z, d;
-	x = 1;
-	y = 1;
-	z = 1;
-	while ((d = x * x + y * y + z * z) > 1) {
-		x = rand_float() * 2 - 1;
-		y = rand_float() * 2 - 1;
-		z = rand_float() * 2 - 1;
-	}
-	out[0] = x;
-	out[1] = y;
-	out[2] = z;
-	glm_vec4_normalize(out);
-}
-
-static long
-find(float f, float *list, long l)
-{
-	long i, j, p, n;
-
-	n = 0;
-	i = 0;
-	j = l;
-
-	(void)n;
-
-	while (i < j - 1) {
-		p = i + (j - i) / 2;
-		n++;
-		if (list[p - 1] > f) {
-			j = p;
-		} else {
-			i = p;
-		}
-	}
-
-	return i;
-}
-
-static float
-importance_sample_diffuse(vec d)
-{
-	float u, v, phi, theta;
-	long x, y, w, h;
-
-	w = scene.bg.w;
-	h = scene.bg.h;
-
-	u = rand_float();
-	v = rand_float();
-
-	y = find(v, scene.bg.cdf_m, h);
-	x = find(u, scene.bg.cdf_c + y * w, w);
-
-	phi = (x + rand_float()) / w * 2 * GLM_PI;
-	theta = -(y + rand_float()) / h * GLM_PI;
-
-	d[0] = sinf(theta) * cosf(phi);
-	d[2] = sinf(theta) * sinf(phi);
-	d[1] = cosf(theta);
-
-	return scene.bg.pdf[y * w + x] * (w * h);
-}
-
-static color
-ray_color(ray *ray, int bounces)
-{
-	hit_info best;
-	color ret;
-	material *mat;
-	float c, u, v, n_dot_d, weight;
-
-	ret = (color) { 1.0, 1.0, 1.0 };
-	for (; bounces > 0; bounces--) {
-		if (!(hit_scene(ray, &best))) {
-			u = atan2f(ray->d[0], ray->d[2]) / (2 * GLM_PI);
-			v = acosf(ray->d[1] / glm_vec4_norm(ray->d)) / GLM_PI;
-			u += 0.5;
-
-			color_mul(&ret, sample_texture(&scene.bg.tex, u, v));
-			return ret;
-		}
-
-		mat = best.material;
-
-		color_mul(&ret, sample_texture(&mat->texture, best.u, best.v));
-
-		switch (mat->type) {
-		case DIFFUSE:
-			(void)weight;
-			/* rand_unit_vector(ray->d);
-			n_dot_d = glm_vec4_dot(ray->d, best.normal);
-			if (n_dot_d < 0.0) {
-				glm_vec4_negate(ray->d);
-				n_dot_d = -n_dot_d;
-			}
-			color_muls(&ret, n_dot_d); */
-
-			weight = importance_sample_diffuse(ray->d);
-			n_dot_d = glm_vec4_dot(ray->d, best.normal);
-			if (n_dot_d < 0.0) {
-				return (color) { 0.0, 0.0, 0.0 };
-			}
-			color_muls(&ret, n_dot_d * weight);
-			break;
-		case SPECULAR:
-			c = 2 * glm_vec4_dot(ray->d, best.normal);
-			glm_vec4_mulsubs(best.normal, c, ray->d);
-			break;
-		case EMISSIVE:
-			return ret;
-		}
-
-		glm_vec4_copy(best.p, ray->origin);
-	}
-
-	return (color) { 0.0, 0.0, 0.0 };
-}
-
 int
 write_png_init(long width, long height)
 {
@@ -465,6 +495,71 @@ write_png_init(long width, long height)
 	return 0;
 }
 
+static void
+write_row(color *colors, long y)
+{
+	long x;
+
+	(void)y;
+
+	for (x = 0; x < width; x++)
+		color_2_pixel(&colors[x], &row[x]);
+	png_write_row(png_ptr, (unsigned char *)row);
+}
+
+/*
+ * snapshots go to a temporary file first and are renamed into place, so a
+ * viewer watching snapshot_path never sees a half written image
+ */
+static void
+write_snapshot(color *fb, unsigned int spp)
+{
+	png_structp snap_ptr;
+	png_infop snap_info;
+	char *tmp_path;
+	FILE *f;
+	long x, y;
+
+	(void)spp;
+
+	if ((tmp_path = malloc(strlen(snapshot_path) + 5)) == NULL)
+		return;
+	sprintf(tmp_path, "%s.tmp", snapshot_path);
+	if ((f = fopen(tmp_path, "wb")) == NULL) {
+		perror(prog_name);
+		free(tmp_path);
+		return;
+	}
+
+	snap_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+	    png_error_handler, NULL);
+	snap_info = snap_ptr ? png_create_info_struct(snap_ptr) : NULL;
+	if (!snap_info || setjmp(jb)) {
+		png_destroy_write_struct(&snap_ptr, &snap_info);
+		fclose(f);
+		remove(tmp_path);
+		free(tmp_path);
+		return;
+	}
+
+	png_init_io(snap_ptr, f);
+	png_set_IHDR(snap_ptr, snap_info, width, height, 8, PNG_COLOR_TYPE_RGB,
+	    PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+	    PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(snap_ptr, snap_info);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++)
+			color_2_pixel(&fb[y * width + x], &row[x]);
+		png_write_row(snap_ptr, (unsigned char *)row);
+	}
+	png_write_end(snap_ptr, NULL);
+	png_destroy_write_struct(&snap_ptr, &snap_info);
+
+	if (fclose(f) != 0 || rename(tmp_path, snapshot_path) != 0)
+		perror(prog_name);
+	free(tmp_path);
+}
+
 void
 png_error_handler(png_structp png_ptr, png_const_charp msg)
 {
@@ -487,6 +582,31 @@ fprintf(out,
 "  -g, --geometry WIDTHxHEIGHT\toutput dimensions; default %dx%d\n"
 "  -s, --samples SAMPLES\t\tnumber of samples per pixel; default %d\n"
 "  -b, --bounces BOUNCES\t\tmaximum bounces to calculate; default %d\n"
+"  -t, --threads THREADS\t\tnumber of render threads; default is the\n"
+"\t\t\t\tnumber of online processors\n"
+"  -p, --progressive\t\trender in passes of increasing samples\n"
+"  -T, --time-limit SECONDS\tstop progressive rendering after SECONDS\n"
+"      --snapshot FILE\t\twrite progressive snapshots to FILE\n"
+"      --snapshot-every N[s]\twrite a snapshot every N passes or N seconds;\n"
+"\t\t\t\tdefault 1\n"
+"      --noise-threshold NOISE\tstop sampling regions once their estimated\n"
+"\t\t\t\terror drops below NOISE; --samples becomes the\n"
+"\t\t\t\tmaximum per pixel\n"
+"      --no-cache\t\tdon't read or write cached background sampling\n"
+"\t\t\t\ttables\n"
+"  -o, --output FILE\t\twrite to FILE instead of standard output\n"
+"      --compile\t\t\twrite the loaded scene as a binary image to the\n"
+"\t\t\t\t--output file instead of rendering; it can be\n"
+"\t\t\t\tgiven in place of a scene file later\n"
+"      --stats\t\t\treport scene parse and build times\n"
+"      --no-lazy\t\t\tbuild every BVH in full before rendering instead\n"
+"\t\t\t\tof leaving subtrees until a ray first reaches\n"
+"\t\t\t\tthem\n"
+"      --raster\t\t\tfind where camera rays first hit spheres and\n"
+"\t\t\t\tplanes by rasterizing them, with a pinhole camera\n"
+"\t\t\t\tin place of depth of field\n"
+"      --wavefront\t\ttrace a tile's paths together a bounce at a\n"
+"\t\t\t\ttime, shading hits grouped by material\n"
 "\n"
 "if no file is provided or if file is '-', reads from standard input\n",
 DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_SAMPLES, DEFAULT_MAX_BOUNCES);
@@ -33,3 +33,9 @@ color_lerp(color a, color b, float f)
 		a.b * (1 - f) + b.b * f,
 	};
 }
+
+float
+color_luminance(color c)
+{
+	return 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b;
+}
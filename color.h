@@ -9,5 +9,6 @@ void color_add(color *, color);
 void color_mul(color *, color);
 void color_muls(color *, float);
 color color_lerp(color, color, float);
+float color_luminance(color);
 
 #endif /* COLOR_H */
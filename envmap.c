@@ -0,0 +1,417 @@
+#include <cglm/cglm.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "envmap.h"
+#include "pool.h"
+
+/* rows are handed to the pool in tasks of roughly this many texels */
+#define ENV_TASK_TEXELS 65536
+
+/* bump whenever the weights or the table layout change */
+#define ENV_CACHE_VERSION 1
+#define ENV_CACHE_MAGIC	  "c-trace\x01"
+
+struct cache_header {
+	char magic[8];
+	uint64_t key;
+	int64_t w, h;
+};
+
+struct env_task {
+	envmap *map;
+	texture *tex;
+	float *row_weights;
+	long y0, y1;
+};
+
+extern char *prog_name;
+
+int envmap_cache = 1;
+
+/*
+ * intensity of each texel in row y, weighted by the solid angle the row
+ * covers. images are read directly with the channel count fixed per loop so
+ * the compiler can vectorize them
+ */
+static void
+texel_weights(texture *tex, long y, long w, long h, float *out)
+{
+	const float *px;
+	float s;
+	long x;
+
+	s = sinf(GLM_PI * (y + 0.5f) / h);
+
+	if (tex->type != IMAGE) {
+		for (x = 0; x < w; x++)
+			out[x] = sample_intensity(tex, (x + 0.5f) / w,
+			    (y + 0.5f) / h) * s;
+		return;
+	}
+
+	px = tex->image.data + y * w * tex->image.n_channels;
+	switch (tex->image.n_channels) {
+	case 1:
+		for (x = 0; x < w; x++)
+			out[x] = 3 * px[x] * s;
+		break;
+	case 2:
+		for (x = 0; x < w; x++)
+			out[x] = 3 * px[x * 2] * s;
+		break;
+	case 3:
+		for (x = 0; x < w; x++)
+			out[x] = (px[x * 3] + px[x * 3 + 1] + px[x * 3 + 2]) * s;
+		break;
+	default:
+		for (x = 0; x < w; x++)
+			out[x] = (px[x * 4] + px[x * 4 + 1] + px[x * 4 + 2]) * s;
+		break;
+	}
+}
+
+static void
+row_task(void *arg, int worker)
+{
+	struct env_task *t;
+	envmap *map;
+	float *weights;
+	uint32_t *scratch;
+	double total;
+	long x, y;
+
+	(void)worker;
+
+	t = arg;
+	map = t->map;
+	weights = malloc(sizeof(*weights) * map->w);
+	scratch = malloc(sizeof(*scratch) * map->w);
+	if (!weights || !scratch) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		exit(1);
+	}
+
+	for (y = t->y0; y < t->y1; y++) {
+		texel_weights(t->tex, y, map->w, map->h, weights);
+		total = 0.0;
+		for (x = 0; x < map->w; x++)
+			total += weights[x];
+		t->row_weights[y] = total;
+		alias_build(map->rows + y * map->w, weights, map->w, scratch);
+	}
+
+	free(weights);
+	free(scratch);
+}
+
+/* folds the probability of picking each row into its table */
+static void
+scale_task(void *arg, int worker)
+{
+	struct env_task *t;
+	envmap *map;
+	alias_entry *e, *end;
+	float scale;
+	long y;
+
+	(void)worker;
+
+	t = arg;
+	map = t->map;
+	for (y = t->y0; y < t->y1; y++) {
+		scale = map->marginal[y].pdf * map->w * map->h;
+		e = map->rows + y * map->w;
+		for (end = e + map->w; e < end; e++) {
+			e->pdf *= scale;
+			e->alias_pdf *= scale;
+		}
+	}
+}
+
+static void
+run_rows(envmap *map, texture *tex, float *row_weights, task_fn fn,
+    struct env_task *tasks)
+{
+	long y, step;
+	size_t i;
+
+	step = (ENV_TASK_TEXELS + map->w - 1) / map->w;
+	for (i = 0, y = 0; y < map->h; i++, y += step) {
+		tasks[i] = (struct env_task) { map, tex, row_weights, y,
+			y + step < map->h ? y + step : map->h };
+		pool_submit(fn, &tasks[i]);
+	}
+	pool_wait();
+}
+
+/*
+ * 64 bit hash of the decoded image along with everything else the tables
+ * depend on, 8 bytes at a time with a murmur style finalizer
+ */
+static uint64_t
+image_key(const texture *tex)
+{
+	const unsigned char *p, *end;
+	uint64_t h, k;
+	size_t len;
+
+	h = ENV_CACHE_VERSION;
+	h = h * 0x100000001b3u ^ (uint64_t)tex->image.width;
+	h = h * 0x100000001b3u ^ (uint64_t)tex->image.height;
+	h = h * 0x100000001b3u ^ (uint64_t)tex->image.n_channels;
+	h = h * 0x100000001b3u ^ sizeof(alias_entry);
+
+	len = sizeof(float) * tex->image.width * tex->image.height *
+	    tex->image.n_channels;
+	p = (const unsigned char *)tex->image.data;
+	for (end = p + (len & ~(size_t)7); p < end; p += 8) {
+		memcpy(&k, p, 8);
+		k *= 0x87c37b91114253d5u;
+		k = k << 31 | k >> 33;
+		h ^= k * 0x4cf5ad432745937fu;
+		h = (h << 27 | h >> 37) * 5 + 0x52dce729;
+	}
+	for (k = 0; p < (const unsigned char *)tex->image.data + len; p++)
+		k = k << 8 | *p;
+	h ^= k ^ len;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdu;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53u;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * $XDG_CACHE_HOME/c-trace, falling back to ~/.cache/c-trace. with create set
+ * the directories are made if missing. returns a malloced path to the cache
+ * file for key, or NULL if there's nowhere to put it
+ */
+static char *
+cache_path(uint64_t key, int create)
+{
+	const char *base, *suffix;
+	char *path;
+	size_t len;
+
+	suffix = "";
+	if (!(base = getenv("XDG_CACHE_HOME")) || !*base) {
+		if (!(base = getenv("HOME")) || !*base)
+			return NULL;
+		suffix = "/.cache";
+	}
+
+	len = strlen(base) + strlen(suffix) + sizeof("/c-trace/") + 16 +
+	    sizeof(".env");
+	if (!(path = malloc(len)))
+		return NULL;
+
+	if (create) {
+		snprintf(path, len, "%s%s", base, suffix);
+		if (mkdir(path, 0700) != 0 && errno != EEXIST)
+			goto fail;
+		snprintf(path, len, "%s%s/c-trace", base, suffix);
+		if (mkdir(path, 0700) != 0 && errno != EEXIST)
+			goto fail;
+	}
+	snprintf(path, len, "%s%s/c-trace/%016" PRIx64 ".env", base, suffix,
+	    key);
+	return path;
+fail:
+	fprintf(stderr, "%s: couldn't create cache directory %s: %s\n",
+	    prog_name, path, strerror(errno));
+	free(path);
+	return NULL;
+}
+
+/* maps the cached tables for key read only, returns 0 on success */
+static int
+cache_load(envmap *map, uint64_t key)
+{
+	const struct cache_header *hdr;
+	struct stat st;
+	size_t size;
+	char *path;
+	void *base;
+	int fd;
+
+	if (!(path = cache_path(key, 0)))
+		return 1;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return 1;
+
+	size = sizeof(*hdr) + sizeof(alias_entry) * (map->w * map->h + map->h);
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+		close(fd);
+		return 1;
+	}
+	base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 1;
+
+	hdr = base;
+	if (memcmp(hdr->magic, ENV_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->key != key || hdr->w != map->w || hdr->h != map->h) {
+		munmap(base, size);
+		return 1;
+	}
+
+	map->mapping = base;
+	map->mapping_size = size;
+	map->rows = (alias_entry *)(hdr + 1);
+	map->marginal = map->rows + map->w * map->h;
+	return 0;
+}
+
+static int
+write_all(int fd, const void *data, size_t len)
+{
+	const char *p;
+	ssize_t n;
+
+	for (p = data; len > 0; p += n, len -= n) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * writes the tables to a temporary file next to the cache entry and renames
+ * it into place, so concurrent renders never see a partial file. failing to
+ * cache isn't fatal
+ */
+static void
+cache_store(const envmap *map, uint64_t key)
+{
+	struct cache_header hdr;
+	char *path, *tmp;
+	int fd, err;
+
+	if (!(path = cache_path(key, 1)))
+		return;
+	if (!(tmp = malloc(strlen(path) + sizeof(".XXXXXX")))) {
+		free(path);
+		return;
+	}
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	memcpy(hdr.magic, ENV_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.key = key;
+	hdr.w = map->w;
+	hdr.h = map->h;
+
+	err = (fd = mkstemp(tmp)) < 0;
+	if (!err) {
+		err = write_all(fd, &hdr, sizeof(hdr)) ||
+		    write_all(fd, map->rows,
+			sizeof(*map->rows) * map->w * map->h) ||
+		    write_all(fd, map->marginal,
+			sizeof(*map->marginal) * map->h);
+		err = close(fd) != 0 || err;
+		err = err || rename(tmp, path) != 0;
+		if (err)
+			unlink(tmp);
+	}
+	if (err)
+		fprintf(stderr, "%s: couldn't write environment cache %s: %s\n",
+		    prog_name, path, strerror(errno));
+
+	free(tmp);
+	free(path);
+}
+
+int
+envmap_build(envmap *map, texture *tex)
+{
+	struct env_task *tasks;
+	float *row_weights;
+	uint32_t *scratch;
+	uint64_t key;
+	long step;
+
+	switch (tex->type) {
+	case CHECKS:
+		map->w = tex->checks.scale;
+		map->h = tex->checks.scale;
+		break;
+	case SOLID:
+		map->w = 1;
+		map->h = 1;
+		break;
+	case IMAGE:
+		map->w = tex->image.width;
+		map->h = tex->image.height;
+		break;
+	}
+
+	map->mapping = NULL;
+	map->mapping_size = 0;
+	key = 0;
+	if (envmap_cache && tex->type == IMAGE) {
+		key = image_key(tex);
+		if (cache_load(map, key) == 0)
+			return 0;
+	}
+
+	step = (ENV_TASK_TEXELS + map->w - 1) / map->w;
+	map->rows = malloc(sizeof(*map->rows) * map->w * map->h);
+	map->marginal = malloc(sizeof(*map->marginal) * map->h);
+	row_weights = malloc(sizeof(*row_weights) * map->h);
+	scratch = malloc(sizeof(*scratch) * map->h);
+	tasks = malloc(sizeof(*tasks) * ((map->h + step - 1) / step));
+	if (!map->rows || !map->marginal || !row_weights || !scratch ||
+	    !tasks) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		free(row_weights);
+		free(scratch);
+		free(tasks);
+		envmap_free(map);
+		return 1;
+	}
+
+	run_rows(map, tex, row_weights, row_task, tasks);
+	alias_build(map->marginal, row_weights, map->h, scratch);
+	run_rows(map, tex, row_weights, scale_task, tasks);
+
+	free(row_weights);
+	free(scratch);
+	free(tasks);
+
+	if (envmap_cache && tex->type == IMAGE)
+		cache_store(map, key);
+	return 0;
+}
+
+void
+envmap_free(envmap *map)
+{
+	if (map->mapping) {
+		munmap(map->mapping, map->mapping_size);
+	} else {
+		free(map->rows);
+		free(map->marginal);
+	}
+	map->mapping = NULL;
+	map->mapping_size = 0;
+	map->rows = NULL;
+	map->marginal = NULL;
+	map->w = map->h = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef ENVMAP_H
+#define ENVMAP_H
+
+#include "alias.h"
+#include "texture.h"
+
+/*
+ * importance sampling tables for the background: an alias table per row of
+ * texels and one over the rows. the row tables store the joint pdf relative
+ * to picking a texel uniformly
+ */
+typedef struct {
+	long w, h;
+	alias_entry *rows;
+	alias_entry *marginal;
+	void *mapping;
+	size_t mapping_size;
+} envmap;
+
+/* whether image tables are loaded from and saved to the on-disk cache */
+extern int envmap_cache;
+
+int envmap_build(envmap *, texture *);
+void envmap_free(envmap *);
+
+#endif /* ENVMAP_H */
@@ -0,0 +1,548 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scene.h"
+
+/*
+ * compiled scenes are a header followed by sections holding the raw arrays of
+ * a loaded scene. sections are referred to by file offset, so the file can be
+ * mapped anywhere and used in place. the layout is that of the build that
+ * wrote it and the header records enough sizes to refuse anything else
+ */
+#define ESCB_MAGIC   "ESCB"
+#define ESCB_VERSION 5
+#define ESCB_ALIGN   64
+/* zeroed elements after every array, enough for the widest vector kernel */
+#define ESCB_SLACK 8
+
+struct section {
+	uint64_t offset, count;
+};
+
+/* one entry of the mesh table, the arrays of a mesh in leaf order */
+struct escb_mesh {
+	struct section verts, tris, nodes;
+	float origin[3], scale[3];
+};
+
+struct escb_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t material_size, texture_size, node_size, alias_size;
+	uint32_t has_emissive, instance_size;
+
+	camera_params camera;
+	texture background;
+	struct section bg_image;
+	int64_t env_w, env_h;
+	struct section env_rows, env_marginal;
+
+	/* materials plus a parallel table of image sections for their textures */
+	struct section materials, material_images;
+
+	struct section sphere_x, sphere_y, sphere_z, sphere_r, sphere_material;
+	struct section plane_x, plane_y, plane_z, plane_d, plane_u, plane_v;
+	struct section plane_material;
+	struct section nodes;
+	struct section meshes;
+	struct section instances, instance_nodes;
+};
+
+struct writer {
+	FILE *f;
+	uint64_t off;
+	int err;
+};
+
+struct reader {
+	const char *base;
+	size_t size;
+	int err;
+};
+
+extern char *prog_name;
+
+static void
+put_zeros(struct writer *w, size_t n)
+{
+	static const char zeros[ESCB_ALIGN];
+	size_t k;
+
+	for (; n > 0; n -= k) {
+		k = n < sizeof(zeros) ? n : sizeof(zeros);
+		if (fwrite(zeros, 1, k, w->f) != k)
+			w->err = 1;
+		w->off += k;
+	}
+}
+
+/* writes count elements of size bytes as a new section */
+static struct section
+put(struct writer *w, const void *data, size_t size, size_t count)
+{
+	struct section s;
+
+	put_zeros(w, (ESCB_ALIGN - w->off % ESCB_ALIGN) % ESCB_ALIGN);
+	s.offset = w->off;
+	s.count = count;
+	if (count && fwrite(data, size, count, w->f) != count)
+		w->err = 1;
+	w->off += size * count;
+	put_zeros(w, size * ESCB_SLACK);
+	return s;
+}
+
+static struct section
+put_image(struct writer *w, const texture *tex)
+{
+	if (tex->type != IMAGE)
+		return put(w, NULL, sizeof(float), 0);
+	return put(w, tex->image.data, sizeof(float),
+	    (size_t)tex->image.width * tex->image.height *
+		tex->image.n_channels);
+}
+
+/*
+ * writes the loaded scene to path. the camera is stored as written so the
+ * image plane can be rebuilt for whatever geometry the render uses
+ */
+int
+compile_scene(const char *path)
+{
+	struct escb_header hdr;
+	struct section *images;
+	struct escb_mesh *meshes;
+	struct writer w;
+	material *mats;
+	const mesh *m;
+	size_t i;
+
+	if (!(w.f = fopen(path, "wb"))) {
+		fprintf(stderr, "%s: couldn't open %s: %s\n", prog_name, path,
+		    strerror(errno));
+		return 1;
+	}
+	w.off = 0;
+	w.err = 0;
+
+	images = malloc(sizeof(*images) * scene.n_materials);
+	mats = malloc(sizeof(*mats) * scene.n_materials);
+	meshes = calloc(scene.n_meshes ? scene.n_meshes : 1, sizeof(*meshes));
+	if (!images || !mats || !meshes) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		free(images);
+		free(mats);
+		free(meshes);
+		fclose(w.f);
+		return 1;
+	}
+
+	/* the header is filled in as sections are written and goes in last */
+	memset(&hdr, 0, sizeof(hdr));
+	put_zeros(&w, sizeof(hdr));
+
+	memcpy(hdr.magic, ESCB_MAGIC, sizeof(hdr.magic));
+	hdr.version = ESCB_VERSION;
+	hdr.material_size = sizeof(material);
+	hdr.texture_size = sizeof(texture);
+	hdr.node_size = sizeof(bvh_node);
+	hdr.alias_size = sizeof(alias_entry);
+	hdr.instance_size = sizeof(instance);
+	hdr.has_emissive = scene.has_emissive;
+	hdr.camera = scene.camera_params;
+
+	hdr.background = scene.bg.tex;
+	if (hdr.background.type == IMAGE)
+		hdr.background.image.data = NULL;
+	hdr.bg_image = put_image(&w, &scene.bg.tex);
+	hdr.env_w = scene.bg.map.w;
+	hdr.env_h = scene.bg.map.h;
+	hdr.env_rows = put(&w, scene.bg.map.rows, sizeof(alias_entry),
+	    scene.bg.map.w * scene.bg.map.h);
+	hdr.env_marginal = put(&w, scene.bg.map.marginal, sizeof(alias_entry),
+	    scene.bg.map.h);
+
+	for (i = 0; i < scene.n_materials; i++) {
+		mats[i] = scene.materials[i];
+		images[i] = put_image(&w, &mats[i].texture);
+		if (mats[i].texture.type == IMAGE)
+			mats[i].texture.image.data = NULL;
+	}
+	hdr.materials = put(&w, mats, sizeof(*mats), scene.n_materials);
+	hdr.material_images = put(&w, images, sizeof(*images),
+	    scene.n_materials);
+
+	hdr.sphere_x = put(&w, scene.spheres.x, sizeof(float), scene.spheres.n);
+	hdr.sphere_y = put(&w, scene.spheres.y, sizeof(float), scene.spheres.n);
+	hdr.sphere_z = put(&w, scene.spheres.z, sizeof(float), scene.spheres.n);
+	hdr.sphere_r = put(&w, scene.spheres.r, sizeof(float), scene.spheres.n);
+	hdr.sphere_material = put(&w, scene.spheres.material,
+	    sizeof(uint16_t), scene.spheres.n);
+
+	hdr.plane_x = put(&w, scene.planes.x, sizeof(float), scene.planes.n);
+	hdr.plane_y = put(&w, scene.planes.y, sizeof(float), scene.planes.n);
+	hdr.plane_z = put(&w, scene.planes.z, sizeof(float), scene.planes.n);
+	hdr.plane_d = put(&w, scene.planes.d, sizeof(float), scene.planes.n);
+	hdr.plane_u = put(&w, scene.planes.u, sizeof(vec), scene.planes.n);
+	hdr.plane_v = put(&w, scene.planes.v, sizeof(vec), scene.planes.n);
+	hdr.plane_material = put(&w, scene.planes.material, sizeof(uint16_t),
+	    scene.planes.n);
+
+	hdr.nodes = put(&w, scene.bvh.nodes, sizeof(bvh_node),
+	    scene.bvh.n_nodes);
+
+	for (i = 0; i < scene.n_meshes; i++) {
+		m = &scene.meshes[i];
+		meshes[i].verts = put(&w, m->geom.verts,
+		    sizeof(*m->geom.verts), m->geom.n_verts);
+		meshes[i].tris = put(&w, m->geom.tris, sizeof(*m->geom.tris),
+		    m->geom.n_tris);
+		meshes[i].nodes = put(&w, m->bvh.nodes, sizeof(bvh_node),
+		    m->bvh.n_nodes);
+		memcpy(meshes[i].origin, m->geom.origin,
+		    sizeof(meshes[i].origin));
+		memcpy(meshes[i].scale, m->geom.scale,
+		    sizeof(meshes[i].scale));
+	}
+	hdr.meshes = put(&w, meshes, sizeof(*meshes), scene.n_meshes);
+	hdr.instances = put(&w, scene.instances, sizeof(instance),
+	    scene.n_instances);
+	hdr.instance_nodes = put(&w, scene.instance_bvh.nodes,
+	    sizeof(bvh_node), scene.instance_bvh.n_nodes);
+
+	free(images);
+	free(mats);
+	free(meshes);
+
+	if (fseek(w.f, 0, SEEK_SET) != 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, w.f) != 1)
+		w.err = 1;
+	if (fclose(w.f) != 0)
+		w.err = 1;
+	if (w.err) {
+		fprintf(stderr, "%s: error writing %s\n", prog_name, path);
+		return 1;
+	}
+	return 0;
+}
+
+int
+scene_is_compiled(FILE *f)
+{
+	char magic[sizeof(ESCB_MAGIC) - 1];
+	int ret;
+
+	ret = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+	    memcmp(magic, ESCB_MAGIC, sizeof(magic)) == 0;
+	rewind(f);
+	return ret;
+}
+
+/*
+ * returns a pointer to the section if it holds count elements of size bytes
+ * and lies inside the file, otherwise flags the reader
+ */
+static void *
+get(struct reader *r, const struct section *s, size_t size, uint64_t count)
+{
+	if (s->count != count || s->offset % ESCB_ALIGN != 0 ||
+	    s->offset > r->size ||
+	    (r->size - s->offset) / size < count + ESCB_SLACK) {
+		r->err = 1;
+		return NULL;
+	}
+	return (void *)(r->base + s->offset);
+}
+
+static void
+get_image(struct reader *r, texture *tex, const struct section *s)
+{
+	if (tex->type != IMAGE) {
+		if (tex->type != SOLID && tex->type != CHECKS)
+			r->err = 1;
+		get(r, s, sizeof(float), 0);
+		return;
+	}
+	if (tex->image.width <= 0 || tex->image.height <= 0 ||
+	    tex->image.n_channels <= 0) {
+		r->err = 1;
+		return;
+	}
+	tex->image.data = get(r, s, sizeof(float),
+	    (uint64_t)tex->image.width * tex->image.height *
+		tex->image.n_channels);
+}
+
+/* flags the reader unless every one of the n indices is below max */
+static void
+check_materials(struct reader *r, const uint16_t *material, size_t n,
+    size_t max)
+{
+	size_t i;
+
+	for (i = 0; !r->err && i < n; i++) {
+		if (material[i] >= max)
+			r->err = 1;
+	}
+}
+
+/*
+ * flags the reader unless every triangle's vertices are in the mesh. an
+ * offset that reaches below vertex 0 wraps around to far past the end
+ */
+static void
+check_tris(struct reader *r, const tri_list *m)
+{
+	uint32_t v[3];
+	size_t i;
+	int k;
+
+	for (i = 0; !r->err && i < m->n_tris; i++) {
+		tri_indices(m, i, v);
+		for (k = 0; k < 3; k++) {
+			if (v[k] >= m->n_verts)
+				r->err = 1;
+		}
+	}
+}
+
+/*
+ * flags the reader unless the nodes of b form a tree the traversals can walk:
+ * every child after its parent and inside the node array, every leaf inside
+ * the n primitives, nothing deferred, and no deeper than a traversal stack
+ * can hold. returns nonzero if there wasn't the memory to check
+ */
+static int
+check_bvh(struct reader *r, const bvh *b, size_t n)
+{
+	const bvh_node *node;
+	uint8_t *depth;
+	size_t i;
+	int c;
+
+	if (r->err || b->n_nodes == 0)
+		return 0;
+	if (!(depth = calloc(b->n_nodes, sizeof(*depth))))
+		return 1;
+
+	for (i = 0; !r->err && i < b->n_nodes; i++) {
+		node = &b->nodes[i];
+		if (node->n_children > BVH_WIDTH) {
+			r->err = 1;
+			break;
+		}
+		for (c = 0; c < node->n_children; c++) {
+			if (node->count[c] == BVH_DEFERRED) {
+				r->err = 1;
+			} else if (node->count[c] != 0) {
+				if (node->child[c] > n ||
+				    node->count[c] > n - node->child[c])
+					r->err = 1;
+			} else if (node->child[c] <= i ||
+			    node->child[c] >= b->n_nodes ||
+			    depth[i] + 1 >= BVH_STACK_SIZE / BVH_WIDTH) {
+				r->err = 1;
+			} else if (depth[node->child[c]] < depth[i] + 1) {
+				depth[node->child[c]] = depth[i] + 1;
+			}
+		}
+	}
+
+	free(depth);
+	return 0;
+}
+
+/* maps a scene written by compile_scene and uses its arrays in place */
+int
+load_compiled(const char *path, float aspect_ratio)
+{
+	const struct escb_header *hdr;
+	const struct section *images;
+	const struct escb_mesh *meshes;
+	const material *mats;
+	struct reader r;
+	mesh *m;
+	struct stat st;
+	void *base;
+	size_t i, n;
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "%s: couldn't open %s: %s\n", prog_name, path,
+		    strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s: %s is truncated or corrupt\n", prog_name,
+		    path);
+		close(fd);
+		return 1;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: couldn't map %s: %s\n", prog_name, path,
+		    strerror(errno));
+		return 1;
+	}
+
+	r.base = base;
+	r.size = st.st_size;
+	r.err = 0;
+	hdr = base;
+	if (memcmp(hdr->magic, ESCB_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != ESCB_VERSION ||
+	    hdr->material_size != sizeof(material) ||
+	    hdr->texture_size != sizeof(texture) ||
+	    hdr->node_size != sizeof(bvh_node) ||
+	    hdr->alias_size != sizeof(alias_entry) ||
+	    hdr->instance_size != sizeof(instance) ||
+	    hdr->materials.count == 0 ||
+	    hdr->materials.count > UINT16_MAX + 1) {
+		fprintf(stderr,
+		    "%s: %s was compiled by an incompatible version\n",
+		    prog_name, path);
+		munmap(base, st.st_size);
+		return 1;
+	}
+
+	memset(&scene, 0, sizeof(scene));
+	scene.mapping = base;
+	scene.mapping_size = st.st_size;
+	scene.has_emissive = hdr->has_emissive;
+	scene.camera_params = hdr->camera;
+	camera_setup(&scene.camera, &scene.camera_params, aspect_ratio);
+
+	scene.bg.tex = hdr->background;
+	get_image(&r, &scene.bg.tex, &hdr->bg_image);
+	scene.bg.map.w = hdr->env_w;
+	scene.bg.map.h = hdr->env_h;
+	scene.bg.map.rows = get(&r, &hdr->env_rows, sizeof(alias_entry),
+	    hdr->env_w * hdr->env_h);
+	scene.bg.map.marginal = get(&r, &hdr->env_marginal,
+	    sizeof(alias_entry), hdr->env_h);
+
+	/* materials are copied out so their image pointers can be set */
+	n = hdr->materials.count;
+	mats = get(&r, &hdr->materials, sizeof(material), n);
+	images = get(&r, &hdr->material_images, sizeof(*images), n);
+	if (!r.err) {
+		if (!(scene.materials = malloc(sizeof(material) * n))) {
+			fprintf(stderr, "%s: memory allocation failed\n",
+			    prog_name);
+			free_scene();
+			return 1;
+		}
+		memcpy(scene.materials, mats, sizeof(material) * n);
+		scene.n_materials = scene.cap_materials = n;
+		for (i = 0; i < n; i++) {
+			if (scene.materials[i].type != DIFFUSE &&
+			    scene.materials[i].type != SPECULAR &&
+			    scene.materials[i].type != EMISSIVE)
+				r.err = 1;
+			get_image(&r, &scene.materials[i].texture, &images[i]);
+		}
+	}
+
+	scene.spheres.n = scene.spheres.cap = hdr->sphere_x.count;
+	scene.spheres.x = get(&r, &hdr->sphere_x, sizeof(float),
+	    scene.spheres.n);
+	scene.spheres.y = get(&r, &hdr->sphere_y, sizeof(float),
+	    scene.spheres.n);
+	scene.spheres.z = get(&r, &hdr->sphere_z, sizeof(float),
+	    scene.spheres.n);
+	scene.spheres.r = get(&r, &hdr->sphere_r, sizeof(float),
+	    scene.spheres.n);
+	scene.spheres.material = get(&r, &hdr->sphere_material,
+	    sizeof(uint16_t), scene.spheres.n);
+
+	scene.planes.n = scene.planes.cap = hdr->plane_x.count;
+	scene.planes.x = get(&r, &hdr->plane_x, sizeof(float), scene.planes.n);
+	scene.planes.y = get(&r, &hdr->plane_y, sizeof(float), scene.planes.n);
+	scene.planes.z = get(&r, &hdr->plane_z, sizeof(float), scene.planes.n);
+	scene.planes.d = get(&r, &hdr->plane_d, sizeof(float), scene.planes.n);
+	scene.planes.u = get(&r, &hdr->plane_u, sizeof(vec), scene.planes.n);
+	scene.planes.v = get(&r, &hdr->plane_v, sizeof(vec), scene.planes.n);
+	scene.planes.material = get(&r, &hdr->plane_material,
+	    sizeof(uint16_t), scene.planes.n);
+
+	scene.bvh.n_nodes = hdr->nodes.count;
+	scene.bvh.nodes = get(&r, &hdr->nodes, sizeof(bvh_node),
+	    scene.bvh.n_nodes);
+
+	/* so are the meshes, whose arrays stay in the image */
+	n = hdr->meshes.count;
+	meshes = get(&r, &hdr->meshes, sizeof(*meshes), n);
+	if (!r.err && n > 0) {
+		if (!(scene.meshes = calloc(n, sizeof(mesh)))) {
+			fprintf(stderr, "%s: memory allocation failed\n",
+			    prog_name);
+			free_scene();
+			return 1;
+		}
+		scene.n_meshes = scene.cap_meshes = n;
+		for (i = 0; i < n; i++) {
+			m = &scene.meshes[i];
+			m->geom.n_verts = meshes[i].verts.count;
+			m->geom.verts = get(&r, &meshes[i].verts,
+			    sizeof(*m->geom.verts), m->geom.n_verts);
+			m->geom.n_tris = meshes[i].tris.count;
+			m->geom.tris = get(&r, &meshes[i].tris,
+			    sizeof(*m->geom.tris), m->geom.n_tris);
+			m->bvh.n_nodes = meshes[i].nodes.count;
+			m->bvh.nodes = get(&r, &meshes[i].nodes,
+			    sizeof(bvh_node), m->bvh.n_nodes);
+			memcpy(m->geom.origin, meshes[i].origin,
+			    sizeof(m->geom.origin));
+			memcpy(m->geom.scale, meshes[i].scale,
+			    sizeof(m->geom.scale));
+		}
+	}
+
+	/* instances and their BVH are used in place */
+	scene.n_instances = scene.cap_instances = hdr->instances.count;
+	scene.instances = get(&r, &hdr->instances, sizeof(instance),
+	    scene.n_instances);
+	scene.instance_bvh.n_nodes = hdr->instance_nodes.count;
+	scene.instance_bvh.nodes = get(&r, &hdr->instance_nodes,
+	    sizeof(bvh_node), scene.instance_bvh.n_nodes);
+	for (i = 0; !r.err && i < scene.n_instances; i++) {
+		if (scene.instances[i].mesh >= scene.n_meshes ||
+		    scene.instances[i].material >= scene.n_materials)
+			r.err = 1;
+	}
+
+	/* nothing in the image is used as an index until it's checked */
+	check_materials(&r, scene.spheres.material, scene.spheres.n,
+	    scene.n_materials);
+	check_materials(&r, scene.planes.material, scene.planes.n,
+	    scene.n_materials);
+	ret = check_bvh(&r, &scene.bvh, scene.spheres.n) ||
+	    check_bvh(&r, &scene.instance_bvh, scene.n_instances);
+	for (i = 0; !ret && i < scene.n_meshes; i++) {
+		check_tris(&r, &scene.meshes[i].geom);
+		ret = check_bvh(&r, &scene.meshes[i].bvh,
+		    scene.meshes[i].geom.n_tris);
+	}
+	if (ret) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		free_scene();
+		return 1;
+	}
+
+	if (r.err) {
+		fprintf(stderr, "%s: %s is truncated or corrupt\n", prog_name,
+		    path);
+		free_scene();
+		return 1;
+	}
+	return 0;
+}
@@ -1,53 +1,710 @@
 #include "geom.h"
+#include "simd.h"
 
 const float epsilon = 0.0001f;
 
+/*
+ * finds the closest sphere in [begin, end) hit at a distance in (epsilon, *t).
+ * on a hit *t and *index are updated and 1 is returned
+ */
 int
-hit_sphere(const sphere *sphere, const ray *ray, hit_info *out)
+hit_spheres(const sphere_list *s, size_t begin, size_t end, const ray *ray,
+    float *t, size_t *index)
 {
-	vec oc;
-	float a, half_b, c, discriminant;
+	float best;
+	size_t i, found;
+#if VWIDTH > 1
+	vfloat ox, oy, oz, dx, dy, dz, va, eps, zero, lanes;
+	vfloat cx, cy, cz, r, b, c, disc, vt, m;
+	float ts[VWIDTH];
+	int mask, lane;
+#else
+	float a, cx, cy, cz, b, c, disc, ti;
+#endif
 
-	glm_vec4_sub((float *)ray->origin, (float *)sphere->center, oc);
-	a = glm_vec4_norm2((float *)ray->d);
-	half_b = glm_vec4_dot(oc, (float *)ray->d);
-	c = glm_vec4_norm2(oc) - sphere->r * sphere->r;
-	discriminant = half_b * half_b - a * c;
+	best = *t;
+	found = end;
 
-	out->t = (-half_b - sqrtf(discriminant)) / a;
+#if VWIDTH > 1
+	ox = vset1(ray->origin[0]);
+	oy = vset1(ray->origin[1]);
+	oz = vset1(ray->origin[2]);
+	dx = vset1(ray->d[0]);
+	dy = vset1(ray->d[1]);
+	dz = vset1(ray->d[2]);
+	/* in vectors, as hit_spheres_packet does, so both round alike */
+	va = vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz));
+	eps = vset1(epsilon);
+	zero = vset1(0.0f);
+	lanes = vlanes();
+
+	for (i = begin; i < end; i += VWIDTH) {
+		cx = vsub(ox, vload_n(s->x + i, end - i));
+		cy = vsub(oy, vload_n(s->y + i, end - i));
+		cz = vsub(oz, vload_n(s->z + i, end - i));
+		r = vload_n(s->r + i, end - i);
+
+		b = vadd(vadd(vmul(cx, dx), vmul(cy, dy)), vmul(cz, dz));
+		c = vadd(vadd(vmul(cx, cx), vmul(cy, cy)), vmul(cz, cz));
+		c = vsub(c, vmul(r, r));
+		disc = vsub(vmul(b, b), vmul(va, c));
+		m = vand(vgt(disc, zero), vlt(lanes, vset1(end - i)));
+		if (!vmask(m))
+			continue;
+
+		/* only pay for the square root once some lane can hit */
+		vt = vdiv(vsub(vsub(zero, b), vsqrt(vmax(disc, zero))), va);
+		m = vand(m, vgt(vt, eps));
+		m = vand(m, vlt(vt, vset1(best)));
+		if (!(mask = vmask(m)))
+			continue;
+
+		vstore(ts, vt);
+		for (; mask; mask &= mask - 1) {
+			lane = __builtin_ctz(mask);
+			if (ts[lane] < best) {
+				best = ts[lane];
+				found = i + lane;
+			}
+		}
+	}
+#else
+	a = ray->d[0] * ray->d[0] + ray->d[1] * ray->d[1] +
+	    ray->d[2] * ray->d[2];
+	for (i = begin; i < end; i++) {
+		cx = ray->origin[0] - s->x[i];
+		cy = ray->origin[1] - s->y[i];
+		cz = ray->origin[2] - s->z[i];
+		b = cx * ray->d[0] + cy * ray->d[1] + cz * ray->d[2];
+		c = cx * cx + cy * cy + cz * cz - s->r[i] * s->r[i];
+		disc = b * b - a * c;
+		if (disc <= 0.0f)
+			continue;
+		ti = (-b - sqrtf(disc)) / a;
+		if (ti > epsilon && ti < best) {
+			best = ti;
+			found = i;
+		}
+	}
+#endif
+
+	if (found == end)
+		return 0;
+	*t = best;
+	*index = found;
+	return 1;
+}
+
+/* same as hit_spheres, over every plane */
+int
+hit_planes(const plane_list *p, const ray *ray, float *t, size_t *index)
+{
+	float best;
+	size_t i, found;
+#if VWIDTH > 1
+	vfloat ox, oy, oz, dx, dy, dz, eps, lanes;
+	vfloat nx, ny, nz, dn, num, vt, m;
+	float ts[VWIDTH];
+	int mask, lane;
+#else
+	float dn, ti;
+#endif
+
+	best = *t;
+	found = p->n;
+
+#if VWIDTH > 1
+	ox = vset1(ray->origin[0]);
+	oy = vset1(ray->origin[1]);
+	oz = vset1(ray->origin[2]);
+	dx = vset1(ray->d[0]);
+	dy = vset1(ray->d[1]);
+	dz = vset1(ray->d[2]);
+	eps = vset1(epsilon);
+	lanes = vlanes();
+
+	for (i = 0; i < p->n; i += VWIDTH) {
+		nx = vload(p->x + i);
+		ny = vload(p->y + i);
+		nz = vload(p->z + i);
+
+		dn = vadd(vadd(vmul(nx, dx), vmul(ny, dy)), vmul(nz, dz));
+		num = vadd(vadd(vmul(nx, ox), vmul(ny, oy)), vmul(nz, oz));
+		vt = vdiv(vsub(vload(p->d + i), num), dn);
+
+		m = vand(vgt(vabs(dn), eps), vgt(vt, eps));
+		m = vand(m, vlt(vt, vset1(best)));
+		m = vand(m, vlt(lanes, vset1(p->n - i)));
+		if (!(mask = vmask(m)))
+			continue;
+
+		vstore(ts, vt);
+		for (; mask; mask &= mask - 1) {
+			lane = __builtin_ctz(mask);
+			if (ts[lane] < best) {
+				best = ts[lane];
+				found = i + lane;
+			}
+		}
+	}
+#else
+	for (i = 0; i < p->n; i++) {
+		dn = p->x[i] * ray->d[0] + p->y[i] * ray->d[1] +
+		    p->z[i] * ray->d[2];
+		if (fabsf(dn) <= epsilon)
+			continue;
+		ti = (p->d[i] - p->x[i] * ray->origin[0] -
+			 p->y[i] * ray->origin[1] - p->z[i] * ray->origin[2]) /
+		    dn;
+		if (ti > epsilon && ti < best) {
+			best = ti;
+			found = i;
+		}
+	}
+#endif
+
+	if (found == p->n)
+		return 0;
+	*t = best;
+	*index = found;
+	return 1;
+}
+
+/*
+ * any-hit versions of the kernels above, return 1 as soon as some primitive is
+ * hit at a distance in (epsilon, t_max)
+ */
+int
+occluded_spheres(const sphere_list *s, size_t begin, size_t end,
+    const ray *ray, float t_max)
+{
+	size_t i;
+#if VWIDTH > 1
+	vfloat ox, oy, oz, dx, dy, dz, va, eps, zero, tm, lanes;
+	vfloat cx, cy, cz, r, b, c, disc, vt, m;
+#else
+	float a, cx, cy, cz, b, c, disc, ti;
+#endif
+
+#if VWIDTH > 1
+	ox = vset1(ray->origin[0]);
+	oy = vset1(ray->origin[1]);
+	oz = vset1(ray->origin[2]);
+	dx = vset1(ray->d[0]);
+	dy = vset1(ray->d[1]);
+	dz = vset1(ray->d[2]);
+	va = vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz));
+	eps = vset1(epsilon);
+	zero = vset1(0.0f);
+	tm = vset1(t_max);
+	lanes = vlanes();
+
+	for (i = begin; i < end; i += VWIDTH) {
+		cx = vsub(ox, vload_n(s->x + i, end - i));
+		cy = vsub(oy, vload_n(s->y + i, end - i));
+		cz = vsub(oz, vload_n(s->z + i, end - i));
+		r = vload_n(s->r + i, end - i);
+
+		b = vadd(vadd(vmul(cx, dx), vmul(cy, dy)), vmul(cz, dz));
+		c = vadd(vadd(vmul(cx, cx), vmul(cy, cy)), vmul(cz, cz));
+		c = vsub(c, vmul(r, r));
+		disc = vsub(vmul(b, b), vmul(va, c));
+		m = vand(vgt(disc, zero), vlt(lanes, vset1(end - i)));
+		if (!vmask(m))
+			continue;
+
+		vt = vdiv(vsub(vsub(zero, b), vsqrt(vmax(disc, zero))), va);
+		m = vand(m, vand(vgt(vt, eps), vlt(vt, tm)));
+		if (vmask(m))
+			return 1;
+	}
+#else
+	a = ray->d[0] * ray->d[0] + ray->d[1] * ray->d[1] +
+	    ray->d[2] * ray->d[2];
+	for (i = begin; i < end; i++) {
+		cx = ray->origin[0] - s->x[i];
+		cy = ray->origin[1] - s->y[i];
+		cz = ray->origin[2] - s->z[i];
+		b = cx * ray->d[0] + cy * ray->d[1] + cz * ray->d[2];
+		c = cx * cx + cy * cy + cz * cz - s->r[i] * s->r[i];
+		disc = b * b - a * c;
+		if (disc <= 0.0f)
+			continue;
+		ti = (-b - sqrtf(disc)) / a;
+		if (ti > epsilon && ti < t_max)
+			return 1;
+	}
+#endif
+
+	return 0;
+}
+
+int
+occluded_planes(const plane_list *p, const ray *ray, float t_max)
+{
+	size_t i;
+#if VWIDTH > 1
+	vfloat ox, oy, oz, dx, dy, dz, eps, tm, lanes;
+	vfloat nx, ny, nz, dn, num, vt, m;
+#else
+	float dn, ti;
+#endif
+
+#if VWIDTH > 1
+	ox = vset1(ray->origin[0]);
+	oy = vset1(ray->origin[1]);
+	oz = vset1(ray->origin[2]);
+	dx = vset1(ray->d[0]);
+	dy = vset1(ray->d[1]);
+	dz = vset1(ray->d[2]);
+	eps = vset1(epsilon);
+	tm = vset1(t_max);
+	lanes = vlanes();
+
+	for (i = 0; i < p->n; i += VWIDTH) {
+		nx = vload(p->x + i);
+		ny = vload(p->y + i);
+		nz = vload(p->z + i);
+
+		dn = vadd(vadd(vmul(nx, dx), vmul(ny, dy)), vmul(nz, dz));
+		num = vadd(vadd(vmul(nx, ox), vmul(ny, oy)), vmul(nz, oz));
+		vt = vdiv(vsub(vload(p->d + i), num), dn);
+
+		m = vand(vgt(vabs(dn), eps), vlt(lanes, vset1(p->n - i)));
+		m = vand(m, vand(vgt(vt, eps), vlt(vt, tm)));
+		if (vmask(m))
+			return 1;
+	}
+#else
+	for (i = 0; i < p->n; i++) {
+		dn = p->x[i] * ray->d[0] + p->y[i] * ray->d[1] +
+		    p->z[i] * ray->d[2];
+		if (fabsf(dn) <= epsilon)
+			continue;
+		ti = (p->d[i] - p->x[i] * ray->origin[0] -
+			 p->y[i] * ray->origin[1] - p->z[i] * ray->origin[2]) /
+		    dn;
+		if (ti > epsilon && ti < t_max)
+			return 1;
+	}
+#endif
+
+	return 0;
+}
+
+void
+ray_packet_init(ray_packet *out, const ray *rays, size_t n)
+{
+	size_t i, j;
+
+	out->n = n;
+	for (i = 0; i < PACKET_SIZE; i++) {
+		j = i < n ? i : n - 1;
+		out->ox[i] = rays[j].origin[0];
+		out->oy[i] = rays[j].origin[1];
+		out->oz[i] = rays[j].origin[2];
+		out->dx[i] = rays[j].d[0];
+		out->dy[i] = rays[j].d[1];
+		out->dz[i] = rays[j].d[2];
+	}
+}
+
+/*
+ * hit_spheres for the rays of a packet in the mask active. every ray is tested
+ * against one sphere at a time, with the rays in the lanes and the same
+ * arithmetic as the single ray kernel. t and index hold each ray's closest
+ * hit so far and are updated per lane. returns a mask of the rays whose
+ * closest hit is now in [begin, end)
+ */
+int
+hit_spheres_packet(const sphere_list *s, size_t begin, size_t end,
+    const ray_packet *p, int active, float *t, uint32_t *index)
+{
+	size_t i, j;
+	int mask, found;
+#if VWIDTH > 1
+	vfloat cx, cy, cz, dx, dy, dz, a, b, c, r, disc, vt, best, m, eps, zero;
+	int hits;
+
+	eps = vset1(epsilon);
+	zero = vset1(0.0f);
+	found = 0;
+	for (j = 0; j < PACKET_SIZE; j += VWIDTH) {
+		if (!(active >> j & ((1 << VWIDTH) - 1)))
+			continue;
+		dx = vload(p->dx + j);
+		dy = vload(p->dy + j);
+		dz = vload(p->dz + j);
+		a = vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz));
+		best = vload(t + j);
+		mask = 0;
+		for (i = begin; i < end; i++) {
+			cx = vsub(vload(p->ox + j), vset1(s->x[i]));
+			cy = vsub(vload(p->oy + j), vset1(s->y[i]));
+			cz = vsub(vload(p->oz + j), vset1(s->z[i]));
+			r = vset1(s->r[i]);
+
+			b = vadd(vadd(vmul(cx, dx), vmul(cy, dy)),
+			    vmul(cz, dz));
+			c = vadd(vadd(vmul(cx, cx), vmul(cy, cy)),
+			    vmul(cz, cz));
+			c = vsub(c, vmul(r, r));
+			disc = vsub(vmul(b, b), vmul(a, c));
+			m = vgt(disc, zero);
+			if (!vmask(m))
+				continue;
+
+			vt = vdiv(vsub(vsub(zero, b), vsqrt(vmax(disc, zero))),
+			    a);
+			m = vand(m, vand(vgt(vt, eps), vlt(vt, best)));
+			if (!vmask(m))
+				continue;
+
+			best = vselect(m, vt, best);
+			for (hits = vmask(m); hits; hits &= hits - 1)
+				index[j + __builtin_ctz(hits)] = i;
+			mask |= vmask(m);
+		}
+		if (!mask)
+			continue;
+		vstore(t + j, best);
+		found |= mask << j;
+	}
+#else
+	float cx, cy, cz, a, b, c, disc, ti;
+
+	found = 0;
+	for (j = 0; j < PACKET_SIZE; j++) {
+		if (!(active & 1 << j))
+			continue;
+		a = p->dx[j] * p->dx[j] + p->dy[j] * p->dy[j] +
+		    p->dz[j] * p->dz[j];
+		mask = 0;
+		for (i = begin; i < end; i++) {
+			cx = p->ox[j] - s->x[i];
+			cy = p->oy[j] - s->y[i];
+			cz = p->oz[j] - s->z[i];
+			b = cx * p->dx[j] + cy * p->dy[j] + cz * p->dz[j];
+			c = cx * cx + cy * cy + cz * cz - s->r[i] * s->r[i];
+			disc = b * b - a * c;
+			if (disc <= 0.0f)
+				continue;
+			ti = (-b - sqrtf(disc)) / a;
+			if (ti > epsilon && ti < t[j]) {
+				t[j] = ti;
+				index[j] = i;
+				mask = 1;
+			}
+		}
+		found |= mask << j;
+	}
+#endif
+
+	return found;
+}
+
+/* the same as hit_spheres_packet for every plane */
+int
+hit_planes_packet(const plane_list *pl, const ray_packet *p, float *t,
+    uint32_t *index)
+{
+	size_t i, j;
+	int mask, found;
+#if VWIDTH > 1
+	vfloat nx, ny, nz, dn, num, vt, best, m, eps;
+	int hits;
+
+	eps = vset1(epsilon);
+	found = 0;
+	for (j = 0; j < PACKET_SIZE; j += VWIDTH) {
+		best = vload(t + j);
+		mask = 0;
+		for (i = 0; i < pl->n; i++) {
+			nx = vset1(pl->x[i]);
+			ny = vset1(pl->y[i]);
+			nz = vset1(pl->z[i]);
+
+			dn = vadd(vadd(vmul(nx, vload(p->dx + j)),
+				      vmul(ny, vload(p->dy + j))),
+			    vmul(nz, vload(p->dz + j)));
+			num = vadd(vadd(vmul(nx, vload(p->ox + j)),
+				       vmul(ny, vload(p->oy + j))),
+			    vmul(nz, vload(p->oz + j)));
+			vt = vdiv(vsub(vset1(pl->d[i]), num), dn);
+
+			m = vand(vgt(vabs(dn), eps), vgt(vt, eps));
+			m = vand(m, vlt(vt, best));
+			if (!vmask(m))
+				continue;
+
+			best = vselect(m, vt, best);
+			for (hits = vmask(m); hits; hits &= hits - 1)
+				index[j + __builtin_ctz(hits)] = i;
+			mask |= vmask(m);
+		}
+		if (!mask)
+			continue;
+		vstore(t + j, best);
+		found |= mask << j;
+	}
+#else
+	float dn, ti;
+
+	found = 0;
+	for (j = 0; j < PACKET_SIZE; j++) {
+		mask = 0;
+		for (i = 0; i < pl->n; i++) {
+			dn = pl->x[i] * p->dx[j] + pl->y[i] * p->dy[j] +
+			    pl->z[i] * p->dz[j];
+			if (fabsf(dn) <= epsilon)
+				continue;
+			ti = (pl->d[i] - pl->x[i] * p->ox[j] -
+				 pl->y[i] * p->oy[j] - pl->z[i] * p->oz[j]) /
+			    dn;
+			if (ti > epsilon && ti < t[j]) {
+				t[j] = ti;
+				index[j] = i;
+				mask = 1;
+			}
+		}
+		found |= mask << j;
+	}
+#endif
+
+	return found;
+}
+
+void
+sphere_hit_info(const sphere_list *s, size_t i, const ray *ray, float t,
+    hit_info *out)
+{
+	vec center = { s->x[i], s->y[i], s->z[i], 0.0f };
+
+	out->t = t;
 	glm_vec4_copy((float *)ray->origin, out->p);
-	glm_vec4_muladds((float *)ray->d, out->t, out->p);
-	glm_vec4_sub(out->p, (float *)sphere->center, out->normal);
+	glm_vec4_muladds((float *)ray->d, t, out->p);
+	glm_vec4_sub(out->p, center, out->normal);
 	glm_vec4_normalize(out->normal);
+	out->u = 0.0f;
+	out->v = 0.0f;
+}
+
+void
+plane_hit_info(const plane_list *p, size_t i, const ray *ray, float t,
+    hit_info *out)
+{
+	vec pc;
+
+	out->t = t;
+	out->normal[0] = p->x[i];
+	out->normal[1] = p->y[i];
+	out->normal[2] = p->z[i];
+	out->normal[3] = 0.0f;
+	glm_vec4_copy((float *)ray->origin, out->p);
+	glm_vec4_muladds((float *)ray->d, t, out->p);
+
+	glm_vec4_copy(out->p, pc);
+	glm_vec4_mulsubs(out->normal, p->d[i], pc);
 
-	return discriminant > 0.0;
+	out->u = glm_vec4_dot(p->u[i], pc);
+	out->v = glm_vec4_dot(p->v[i], pc);
+
+	out->u = out->u - floorf(out->u);
+	out->v = out->v - floorf(out->v);
 }
 
-int
-hit_plane(const plane *plane, const ray *ray, hit_info *out)
+void
+ray_shear_init(const ray *ray, ray_shear *out)
+{
+	int k;
+
+	out->kz = 0;
+	for (k = 1; k < 3; k++)
+		if (fabsf(ray->d[k]) > fabsf(ray->d[out->kz]))
+			out->kz = k;
+	out->kx = (out->kz + 1) % 3;
+	out->ky = (out->kx + 1) % 3;
+	/* keep the winding of triangles as seen along the ray */
+	if (ray->d[out->kz] < 0.0f) {
+		k = out->kx;
+		out->kx = out->ky;
+		out->ky = k;
+	}
+	out->sx = ray->d[out->kx] / ray->d[out->kz];
+	out->sy = ray->d[out->ky] / ray->d[out->kz];
+	out->sz = 1.0f / ray->d[out->kz];
+}
+
+/*
+ * the watertight test of Woop, Benthin and Wald on up to VWIDTH triangles
+ * from i. vertices are decoded relative to the ray origin and sheared into
+ * the ray's space, where the edge functions u, v and w are 2D cross
+ * products. a point on a shared edge computes the same edge function with
+ * opposite signs in both triangles, so it's counted by at least one of them.
+ * returns a mask of the triangles hit in (epsilon, t_max) with their
+ * distances in ts
+ */
+static int
+triangle_batch(const tri_list *m, size_t i, size_t n, const ray *ray,
+    const ray_shear *sh, float t_max, float *ts)
 {
-	vec oc, pc;
-	float d;
+	const uint16_t *q;
+	uint32_t idx[3];
+	int j;
+#if VWIDTH > 1
+	float c[9][VWIDTH];
+	size_t k;
+	vfloat ax, ay, az, bx, by, bz, cx, cy, cz, sx, sy, zero;
+	vfloat ox, oy, oz, qx, qy, qz;
+	vfloat u, v, w, det, t, hit;
 
-	d = glm_vec4_dot((float *)plane->normal, (float *)ray->d);
+	for (k = 0; k < VWIDTH; k++) {
+		/* past n every vertex is the same point, which can't hit */
+		if (k >= n) {
+			for (j = 0; j < 9; j++)
+				c[j][k] = 0.0f;
+			continue;
+		}
+		tri_indices(m, i + k, idx);
+		for (j = 0; j < 3; j++) {
+			q = m->verts[idx[j]];
+			c[j * 3][k] = q[sh->kx];
+			c[j * 3 + 1][k] = q[sh->ky];
+			c[j * 3 + 2][k] = q[sh->kz];
+		}
+	}
 
-	if (fabsf(d) > epsilon) {
-		glm_vec4_sub((float *)plane->center, (float *)ray->origin, oc);
-		out->t = glm_vec4_dot(oc, (float *)plane->normal) / d;
-		glm_vec4_copy((float *)plane->normal, out->normal);
-		glm_vec4_copy((float *)ray->origin, out->p);
-		glm_vec4_muladds((float *)ray->d, out->t, out->p);
+	sx = vset1(sh->sx);
+	sy = vset1(sh->sy);
+	zero = vset1(0.0f);
+	ox = vset1(m->origin[sh->kx] - ray->origin[sh->kx]);
+	oy = vset1(m->origin[sh->ky] - ray->origin[sh->ky]);
+	oz = vset1(m->origin[sh->kz] - ray->origin[sh->kz]);
+	qx = vset1(m->scale[sh->kx]);
+	qy = vset1(m->scale[sh->ky]);
+	qz = vset1(m->scale[sh->kz]);
 
-		glm_vec4_sub(out->p, (float *)plane->center, pc);
+	az = vadd(vmul(vload(c[2]), qz), oz);
+	bz = vadd(vmul(vload(c[5]), qz), oz);
+	cz = vadd(vmul(vload(c[8]), qz), oz);
+	ax = vsub(vadd(vmul(vload(c[0]), qx), ox), vmul(sx, az));
+	ay = vsub(vadd(vmul(vload(c[1]), qy), oy), vmul(sy, az));
+	bx = vsub(vadd(vmul(vload(c[3]), qx), ox), vmul(sx, bz));
+	by = vsub(vadd(vmul(vload(c[4]), qy), oy), vmul(sy, bz));
+	cx = vsub(vadd(vmul(vload(c[6]), qx), ox), vmul(sx, cz));
+	cy = vsub(vadd(vmul(vload(c[7]), qy), oy), vmul(sy, cz));
 
-		out->u = glm_vec4_dot((float *)plane->u, pc);
-		out->v = glm_vec4_dot((float *)plane->v, pc);
+	u = vsub(vmul(cx, by), vmul(cy, bx));
+	v = vsub(vmul(ax, cy), vmul(ay, cx));
+	w = vsub(vmul(bx, ay), vmul(by, ax));
+	hit = vor(vand(vand(vge(u, zero), vge(v, zero)), vge(w, zero)),
+	    vand(vand(vle(u, zero), vle(v, zero)), vle(w, zero)));
+	det = vadd(vadd(u, v), w);
+	hit = vand(hit, vgt(vabs(det), zero));
+	if (!vmask(hit))
+		return 0;
 
-		out->u = out->u - floorf(out->u);
-		out->v = out->v - floorf(out->v);
+	t = vmul(vset1(sh->sz),
+	    vadd(vadd(vmul(u, az), vmul(v, bz)), vmul(w, cz)));
+	t = vdiv(t, det);
+	hit = vand(hit, vand(vgt(t, vset1(epsilon)), vlt(t, vset1(t_max))));
+	vstore(ts, t);
+	return vmask(hit);
+#else
+	float a[3], b[3], c[3], *p[3] = { a, b, c };
+	float u, v, w, det, t;
 
-		return out->t >= 0;
+	(void)n;
+	tri_indices(m, i, idx);
+	for (j = 0; j < 3; j++) {
+		q = m->verts[idx[j]];
+		p[j][2] = q[sh->kz] * m->scale[sh->kz] +
+		    (m->origin[sh->kz] - ray->origin[sh->kz]);
+		p[j][0] = q[sh->kx] * m->scale[sh->kx] +
+		    (m->origin[sh->kx] - ray->origin[sh->kx]) - sh->sx * p[j][2];
+		p[j][1] = q[sh->ky] * m->scale[sh->ky] +
+		    (m->origin[sh->ky] - ray->origin[sh->ky]) - sh->sy * p[j][2];
 	}
 
+	u = c[0] * b[1] - c[1] * b[0];
+	v = a[0] * c[1] - a[1] * c[0];
+	w = b[0] * a[1] - b[1] * a[0];
+	if ((u < 0.0f || v < 0.0f || w < 0.0f) &&
+	    (u > 0.0f || v > 0.0f || w > 0.0f))
+		return 0;
+	if ((det = u + v + w) == 0.0f)
+		return 0;
+	t = sh->sz * (u * a[2] + v * b[2] + w * c[2]) / det;
+	ts[0] = t;
+	return t > epsilon && t < t_max;
+#endif
+}
+
+/* same as hit_spheres, over the triangles in [begin, end) */
+int
+hit_triangles(const tri_list *m, size_t begin, size_t end, const ray *ray,
+    const ray_shear *sh, float *t, size_t *index)
+{
+	float ts[VWIDTH], best;
+	size_t i, found;
+	int mask, lane;
+
+	best = *t;
+	found = end;
+	for (i = begin; i < end; i += VWIDTH) {
+		mask = triangle_batch(m, i, end - i, ray, sh, best, ts);
+		for (; mask; mask &= mask - 1) {
+			lane = __builtin_ctz(mask);
+			if (ts[lane] < best) {
+				best = ts[lane];
+				found = i + lane;
+			}
+		}
+	}
+
+	if (found == end)
+		return 0;
+	*t = best;
+	*index = found;
+	return 1;
+}
+
+int
+occluded_triangles(const tri_list *m, size_t begin, size_t end,
+    const ray *ray, const ray_shear *sh, float t_max)
+{
+	float ts[VWIDTH];
+	size_t i;
+
+	for (i = begin; i < end; i += VWIDTH)
+		if (triangle_batch(m, i, end - i, ray, sh, t_max, ts))
+			return 1;
 	return 0;
 }
+
+/* triangles are two sided, the normal is flipped to face the ray */
+void
+triangle_hit_info(const tri_list *m, size_t i, const ray *ray, float t,
+    hit_info *out)
+{
+	uint32_t idx[3];
+	vec3 a, b, c, e1, e2;
+
+	tri_indices(m, i, idx);
+	tri_vertex(m, idx[0], a);
+	tri_vertex(m, idx[1], b);
+	tri_vertex(m, idx[2], c);
+	glm_vec3_sub(b, a, e1);
+	glm_vec3_sub(c, a, e2);
+	glm_vec3_cross(e1, e2, out->normal);
+	out->normal[3] = 0.0f;
+	glm_vec4_normalize(out->normal);
+	if (glm_vec4_dot(out->normal, (float *)ray->d) > 0.0f)
+		glm_vec4_negate(out->normal);
+
+	out->t = t;
+	glm_vec4_copy((float *)ray->origin, out->p);
+	glm_vec4_muladds((float *)ray->d, t, out->p);
+	out->u = 0.0f;
+	out->v = 0.0f;
+}
@@ -2,6 +2,7 @@
 #define GEOM_H
 
 #include <cglm/cglm.h>
+#include <stdint.h>
 
 #include "material.h"
 
@@ -10,6 +11,7 @@ typedef vec4 vec;
 typedef enum {
 	PLANE,
 	SPHERE,
+	TRIANGLE,
 } shape_type;
 
 typedef struct {
@@ -19,25 +21,66 @@ typedef struct {
 	float d;
 } plane;
 
+/*
+ * primitives are kept as structures of arrays so the intersection kernels can
+ * load VWIDTH of them at once. every array has VWIDTH - 1 slack entries past
+ * cap so a kernel may read a full vector from the last valid index. the
+ * sphere kernels still stop at the end of their range, which can be followed
+ * by a deferred subtree another thread is reordering. material is an index
+ * into scene.materials
+ */
 typedef struct {
-	vec center;
-	float r;
-} sphere;
+	float *x, *y, *z, *r;
+	uint16_t *material;
+	size_t n, cap;
+} sphere_list;
 
+/* x, y and z hold the unit normal, u and v are only read for the closest hit */
 typedef struct {
-	shape_type type;
-	material *material;
-	union {
-		plane p;
-		sphere s;
-	};
-} shape;
+	float *x, *y, *z, *d;
+	vec *u, *v;
+	uint16_t *material;
+	size_t n, cap;
+} plane_list;
+
+/*
+ * a triangle as its first vertex index plus the offsets of the other two.
+ * vertices are laid out so every offset fits, see mesh_build
+ */
+typedef struct {
+	uint32_t v0;
+	int16_t d1, d2;
+} packed_tri;
+
+#define TRI_DELTA_MAX INT16_MAX
+
+/*
+ * compressed indexed triangles. vertex positions are 16 bit fixed point
+ * over the mesh bounds, origin + q * scale, and are decoded inside the
+ * triangle test. a typical closed mesh takes around 11 bytes per triangle
+ * before its BVH
+ */
+typedef struct {
+	uint16_t (*verts)[3];
+	packed_tri *tris;
+	float origin[3], scale[3];
+	size_t n_verts, n_tris;
+} tri_list;
 
 typedef struct {
 	vec d;
 	vec origin;
 } ray;
 
+/*
+ * per ray setup for the watertight triangle test. kz is the axis the ray
+ * direction is largest along, and the shear maps the ray onto +z there
+ */
+typedef struct {
+	int kx, ky, kz;
+	float sx, sy, sz;
+} ray_shear;
+
 typedef struct {
 	vec normal;
 	vec p;
@@ -46,9 +89,58 @@ typedef struct {
 	float t;
 } hit_info;
 
+#define PACKET_SIZE 16
+
+/*
+ * up to PACKET_SIZE nearly parallel rays traced together, as structures of
+ * arrays so a vector holds the same component of several rays. lanes past n
+ * are filled with copies of the last ray
+ */
+typedef struct {
+	float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+	float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+	size_t n;
+} ray_packet;
+
 extern const float epsilon;
 
-int hit_sphere(const sphere *, const ray *, hit_info *);
-int hit_plane(const plane *, const ray *, hit_info *);
+static inline void
+tri_indices(const tri_list *m, size_t i, uint32_t *out)
+{
+	out[0] = m->tris[i].v0;
+	out[1] = m->tris[i].v0 + m->tris[i].d1;
+	out[2] = m->tris[i].v0 + m->tris[i].d2;
+}
+
+static inline void
+tri_vertex(const tri_list *m, uint32_t i, float *out)
+{
+	int k;
+
+	for (k = 0; k < 3; k++)
+		out[k] = m->origin[k] + m->verts[i][k] * m->scale[k];
+}
+
+int hit_spheres(const sphere_list *, size_t, size_t, const ray *, float *,
+    size_t *);
+int hit_planes(const plane_list *, const ray *, float *, size_t *);
+int occluded_spheres(const sphere_list *, size_t, size_t, const ray *, float);
+int occluded_planes(const plane_list *, const ray *, float);
+void ray_packet_init(ray_packet *, const ray *, size_t);
+int hit_spheres_packet(const sphere_list *, size_t, size_t,
+    const ray_packet *, int, float *, uint32_t *);
+int hit_planes_packet(const plane_list *, const ray_packet *, float *,
+    uint32_t *);
+void ray_shear_init(const ray *, ray_shear *);
+int hit_triangles(const tri_list *, size_t, size_t, const ray *,
+    const ray_shear *, float *, size_t *);
+int occluded_triangles(const tri_list *, size_t, size_t, const ray *,
+    const ray_shear *, float);
+void sphere_hit_info(const sphere_list *, size_t, const ray *, float,
+    hit_info *);
+void plane_hit_info(const plane_list *, size_t, const ray *, float,
+    hit_info *);
+void triangle_hit_info(const tri_list *, size_t, const ray *, float,
+    hit_info *);
 
 #endif /* GEOM_H */
@@ -9,8 +9,7 @@ typedef enum {
 	EMISSIVE,
 } material_type;
 
-typedef struct material_s {
-	struct material_s *next;
+typedef struct {
 	material_type type;
 	texture texture;
 } material;
@@ -0,0 +1,1061 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mesh.h"
+#include "pool.h"
+#include "scan.h"
+
+/* OBJ files are parsed in parallel in chunks of at least this many bytes */
+#define OBJ_CHUNK (1 << 20)
+/* most vertices accepted in one polygon, which is split into a fan */
+#define MAX_POLY 64
+/* longest number accepted in an OBJ or ASCII PLY file */
+#define MESH_NUM_MAX 63
+
+#define PLY_MAX_ELEMENTS 16
+#define PLY_MAX_PROPS	 32
+#define PLY_NAME_MAX	 32
+#define PLY_LINE_MAX	 256
+
+typedef enum {
+	PLY_NONE,
+	PLY_CHAR,
+	PLY_UCHAR,
+	PLY_SHORT,
+	PLY_USHORT,
+	PLY_INT,
+	PLY_UINT,
+	PLY_FLOAT,
+	PLY_DOUBLE,
+} ply_type;
+
+static const struct {
+	const char *name;
+	ply_type type;
+} ply_types[] = {
+	{ "char", PLY_CHAR },
+	{ "int8", PLY_CHAR },
+	{ "uchar", PLY_UCHAR },
+	{ "uint8", PLY_UCHAR },
+	{ "short", PLY_SHORT },
+	{ "int16", PLY_SHORT },
+	{ "ushort", PLY_USHORT },
+	{ "uint16", PLY_USHORT },
+	{ "int", PLY_INT },
+	{ "int32", PLY_INT },
+	{ "uint", PLY_UINT },
+	{ "uint32", PLY_UINT },
+	{ "float", PLY_FLOAT },
+	{ "float32", PLY_FLOAT },
+	{ "double", PLY_DOUBLE },
+	{ "float64", PLY_DOUBLE },
+};
+
+static const int ply_size[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+
+/* count is PLY_NONE unless the property is a list */
+struct ply_prop {
+	char name[PLY_NAME_MAX];
+	ply_type type, count;
+};
+
+struct ply_element {
+	char name[PLY_NAME_MAX];
+	size_t n;
+	struct ply_prop props[PLY_MAX_PROPS];
+	int n_props;
+};
+
+struct ply {
+	const char *path;
+	const unsigned char *p, *end;
+	int ascii, swap;
+	struct ply_element elements[PLY_MAX_ELEMENTS];
+	int n_elements;
+};
+
+struct tri_buf {
+	uint32_t (*tris)[3];
+	size_t n, cap;
+};
+
+/*
+ * one piece of an OBJ file. the first pass only counts vertices so each
+ * chunk knows where its vertices go in the shared array before the second
+ * pass parses them in place. triangles are collected per chunk and
+ * concatenated after
+ */
+struct obj_chunk {
+	const char *begin, *end;
+	vec3 *verts;
+	size_t n_verts, base;
+	struct tri_buf tris;
+	const char *error;
+	int nomem;
+};
+
+extern char *prog_name;
+
+static const char *
+map_file(const char *path, size_t *size)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "%s: couldn't open %s: %s\n", prog_name, path,
+		    strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s: %s is empty\n", prog_name, path);
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: couldn't map %s: %s\n", prog_name, path,
+		    strerror(errno));
+		return NULL;
+	}
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return p;
+}
+
+/* adds a polygon of n vertices as a fan of triangles */
+static int
+push_poly(struct tri_buf *b, const uint32_t *idx, int n)
+{
+	uint32_t (*grown)[3];
+	size_t cap;
+	int k;
+
+	if (b->n + n - 2 > b->cap) {
+		cap = b->cap ? b->cap * 2 : 1024;
+		if (cap < b->n + n - 2)
+			cap = b->n + n - 2;
+		if (!(grown = realloc(b->tris, sizeof(*grown) * cap)))
+			return 1;
+		b->tris = grown;
+		b->cap = cap;
+	}
+	for (k = 2; k < n; k++) {
+		b->tris[b->n][0] = idx[0];
+		b->tris[b->n][1] = idx[k - 1];
+		b->tris[b->n][2] = idx[k];
+		b->n++;
+	}
+	return 0;
+}
+
+/* parses a number ending at the next blank, as the scene lexer does */
+static int
+mesh_float(const char **p, const char *end, double *out)
+{
+	char num[MESH_NUM_MAX + 1], *e;
+	const char *q;
+	float f;
+	size_t len;
+
+	for (q = *p; q < end && *q != ' ' && *q != '\t' && *q != '\r' &&
+	     *q != '\n';
+	     q++)
+		;
+	len = q - *p;
+	if (len == 0)
+		return 1;
+	if (parse_float(*p, len, &f) == 0) {
+		*out = f;
+	} else {
+		if (len > MESH_NUM_MAX)
+			return 1;
+		memcpy(num, *p, len);
+		num[len] = 0;
+		*out = strtod(num, &e);
+		if (e != num + len)
+			return 1;
+	}
+	*p = q;
+	return 0;
+}
+
+static ply_type
+ply_type_named(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(ply_types) / sizeof(*ply_types); i++)
+		if (strcmp(ply_types[i].name, name) == 0)
+			return ply_types[i].type;
+	return PLY_NONE;
+}
+
+static int
+ply_header(struct ply *ply)
+{
+	char line[PLY_LINE_MAX], a[PLY_NAME_MAX], b[PLY_NAME_MAX],
+	    c[PLY_NAME_MAX], name[PLY_NAME_MAX];
+	const unsigned char *nl;
+	struct ply_element *e;
+	struct ply_prop *prop;
+	size_t len;
+	int format;
+
+	format = 0;
+	e = NULL;
+	for (;;) {
+		if (!(nl = memchr(ply->p, '\n', ply->end - ply->p)))
+			goto fail;
+		len = nl - ply->p;
+		if (len >= sizeof(line))
+			goto fail;
+		memcpy(line, ply->p, len);
+		line[len] = 0;
+		if (len > 0 && line[len - 1] == '\r')
+			line[len - 1] = 0;
+		ply->p = nl + 1;
+
+		if (sscanf(line, "%31s", a) != 1 || strcmp(a, "comment") == 0 ||
+		    strcmp(a, "obj_info") == 0 || strcmp(a, "ply") == 0)
+			continue;
+		if (strcmp(a, "end_header") == 0)
+			break;
+
+		if (strcmp(a, "format") == 0) {
+			if (sscanf(line, "%*s %31s", b) != 1)
+				goto fail;
+			if (strcmp(b, "ascii") == 0) {
+				ply->ascii = 1;
+			} else if (strcmp(b, "binary_little_endian") == 0) {
+				ply->swap = __BYTE_ORDER__ ==
+				    __ORDER_BIG_ENDIAN__;
+			} else if (strcmp(b, "binary_big_endian") == 0) {
+				ply->swap = __BYTE_ORDER__ ==
+				    __ORDER_LITTLE_ENDIAN__;
+			} else {
+				goto fail;
+			}
+			format = 1;
+		} else if (strcmp(a, "element") == 0) {
+			if (ply->n_elements == PLY_MAX_ELEMENTS)
+				goto fail;
+			e = &ply->elements[ply->n_elements++];
+			if (sscanf(line, "%*s %31s %zu", e->name, &e->n) != 2)
+				goto fail;
+		} else if (strcmp(a, "property") == 0) {
+			if (!e || e->n_props == PLY_MAX_PROPS)
+				goto fail;
+			prop = &e->props[e->n_props++];
+			if (sscanf(line, "%*s list %31s %31s %31s", b, c,
+				name) == 3) {
+				prop->count = ply_type_named(b);
+				prop->type = ply_type_named(c);
+				if (prop->count == PLY_NONE ||
+				    prop->count == PLY_FLOAT ||
+				    prop->count == PLY_DOUBLE)
+					goto fail;
+			} else if (sscanf(line, "%*s %31s %31s", b, name) == 2) {
+				prop->count = PLY_NONE;
+				prop->type = ply_type_named(b);
+			} else {
+				goto fail;
+			}
+			if (prop->type == PLY_NONE)
+				goto fail;
+			memcpy(prop->name, name, sizeof(name));
+		} else {
+			goto fail;
+		}
+	}
+	if (format)
+		return 0;
+fail:
+	fprintf(stderr, "%s: %s has an invalid or unsupported PLY header\n",
+	    prog_name, ply->path);
+	return 1;
+}
+
+/* reads one value of the given type, returns 1 past the end of the data */
+static int
+ply_value(struct ply *ply, ply_type type, double *out)
+{
+	unsigned char b[8], tmp;
+	int8_t i8;
+	int16_t i16;
+	uint16_t u16;
+	int32_t i32;
+	uint32_t u32;
+	float f;
+	int n, k;
+
+	if (ply->ascii) {
+		while (ply->p < ply->end &&
+		    (*ply->p == ' ' || *ply->p == '\t' || *ply->p == '\r' ||
+			*ply->p == '\n'))
+			ply->p++;
+		return mesh_float((const char **)&ply->p,
+		    (const char *)ply->end, out);
+	}
+
+	n = ply_size[type];
+	if (ply->end - ply->p < n)
+		return 1;
+	memcpy(b, ply->p, n);
+	ply->p += n;
+	if (ply->swap) {
+		for (k = 0; k < n / 2; k++) {
+			tmp = b[k];
+			b[k] = b[n - 1 - k];
+			b[n - 1 - k] = tmp;
+		}
+	}
+
+	switch (type) {
+	case PLY_CHAR:
+		memcpy(&i8, b, 1);
+		*out = i8;
+		break;
+	case PLY_UCHAR:
+		*out = b[0];
+		break;
+	case PLY_SHORT:
+		memcpy(&i16, b, 2);
+		*out = i16;
+		break;
+	case PLY_USHORT:
+		memcpy(&u16, b, 2);
+		*out = u16;
+		break;
+	case PLY_INT:
+		memcpy(&i32, b, 4);
+		*out = i32;
+		break;
+	case PLY_UINT:
+		memcpy(&u32, b, 4);
+		*out = u32;
+		break;
+	case PLY_FLOAT:
+		memcpy(&f, b, 4);
+		*out = f;
+		break;
+	case PLY_DOUBLE:
+	default:
+		memcpy(out, b, 8);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * reads every property of one item of e, keeping the scalar properties in
+ * vals and the list at list_prop, if any, in list. returns the list length,
+ * or -1 if the data ends early or the list is too long
+ */
+static int
+ply_item(struct ply *ply, const struct ply_element *e, int list_prop,
+    double *vals, uint32_t *list)
+{
+	double v, count;
+	int i, k, n;
+
+	n = 0;
+	for (i = 0; i < e->n_props; i++) {
+		if (e->props[i].count == PLY_NONE) {
+			if (ply_value(ply, e->props[i].type, &vals[i]) != 0)
+				return -1;
+			continue;
+		}
+		if (ply_value(ply, e->props[i].count, &count) != 0 ||
+		    count < 0 || (i == list_prop && count > MAX_POLY))
+			return -1;
+		for (k = 0; k < count; k++) {
+			if (ply_value(ply, e->props[i].type, &v) != 0)
+				return -1;
+			if (i != list_prop)
+				continue;
+			if (v < 0 || v > UINT32_MAX)
+				return -1;
+			list[k] = v;
+		}
+		if (i == list_prop)
+			n = count;
+	}
+	return n;
+}
+
+static int
+ply_find(const struct ply_element *e, const char *name, int list)
+{
+	int i;
+
+	for (i = 0; i < e->n_props; i++)
+		if (strcmp(e->props[i].name, name) == 0 &&
+		    (e->props[i].count != PLY_NONE) == list)
+			return i;
+	return -1;
+}
+
+static int
+ply_vertices(struct ply *ply, const struct ply_element *e, mesh_src *out)
+{
+	double vals[PLY_MAX_PROPS];
+	size_t i, stride, off[3];
+	int k, prop[3], fast;
+
+	prop[0] = ply_find(e, "x", 0);
+	prop[1] = ply_find(e, "y", 0);
+	prop[2] = ply_find(e, "z", 0);
+	if (prop[0] < 0 || prop[1] < 0 || prop[2] < 0) {
+		fprintf(stderr, "%s: %s has no vertex positions\n", prog_name,
+		    ply->path);
+		return 1;
+	}
+	/* every vertex takes at least a byte, which bounds the allocation */
+	if (e->n > (size_t)(ply->end - ply->p))
+		goto truncated;
+	if (!(out->verts = malloc(sizeof(*out->verts) * (e->n ? e->n : 1)))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		return 1;
+	}
+	out->n_verts = e->n;
+
+	/* native floats in fixed size records are copied straight out */
+	fast = !ply->ascii && !ply->swap;
+	stride = 0;
+	for (k = 0; k < e->n_props; k++) {
+		fast &= e->props[k].count == PLY_NONE;
+		stride += ply_size[e->props[k].type];
+	}
+	for (k = 0; k < 3; k++) {
+		fast &= e->props[prop[k]].type == PLY_FLOAT;
+		off[k] = 0;
+	}
+	if (fast) {
+		for (k = 0; k < 3; k++) {
+			for (i = 0; i < (size_t)prop[k]; i++)
+				off[k] += ply_size[e->props[i].type];
+		}
+		if ((size_t)(ply->end - ply->p) / stride < e->n)
+			goto truncated;
+		for (i = 0; i < e->n; i++, ply->p += stride) {
+			memcpy(&out->verts[i][0], ply->p + off[0], 4);
+			memcpy(&out->verts[i][1], ply->p + off[1], 4);
+			memcpy(&out->verts[i][2], ply->p + off[2], 4);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < e->n; i++) {
+		if (ply_item(ply, e, -1, vals, NULL) < 0)
+			goto truncated;
+		for (k = 0; k < 3; k++)
+			out->verts[i][k] = vals[prop[k]];
+	}
+	return 0;
+truncated:
+	fprintf(stderr, "%s: %s is truncated or corrupt\n", prog_name,
+	    ply->path);
+	return 1;
+}
+
+static int
+ply_faces(struct ply *ply, const struct ply_element *e, struct tri_buf *out)
+{
+	double vals[PLY_MAX_PROPS];
+	uint32_t idx[MAX_POLY];
+	size_t i;
+	int prop, n, k;
+
+	if ((prop = ply_find(e, "vertex_indices", 1)) < 0 &&
+	    (prop = ply_find(e, "vertex_index", 1)) < 0) {
+		fprintf(stderr, "%s: %s has no face vertex indices\n",
+		    prog_name, ply->path);
+		return 1;
+	}
+
+	for (i = 0; i < e->n; i++) {
+		/* the usual uchar count and 32 bit indices, read in place */
+		if (!ply->ascii && !ply->swap && e->n_props == 1 &&
+		    e->props[0].count == PLY_UCHAR &&
+		    (e->props[0].type == PLY_INT ||
+			e->props[0].type == PLY_UINT)) {
+			if (ply->p == ply->end)
+				goto truncated;
+			n = *ply->p;
+			if (n > MAX_POLY || ply->end - ply->p - 1 < n * 4)
+				goto truncated;
+			memcpy(idx, ply->p + 1, n * 4);
+			ply->p += 1 + n * 4;
+			if (e->props[0].type == PLY_INT) {
+				for (k = 0; k < n; k++)
+					if ((int32_t)idx[k] < 0)
+						goto truncated;
+			}
+		} else if ((n = ply_item(ply, e, prop, vals, idx)) < 0) {
+			goto truncated;
+		}
+		if (n < 3)
+			continue;
+		if (push_poly(out, idx, n) != 0) {
+			fprintf(stderr, "%s: memory allocation failed\n",
+			    prog_name);
+			return 1;
+		}
+	}
+	return 0;
+truncated:
+	fprintf(stderr, "%s: %s is truncated or corrupt\n", prog_name,
+	    ply->path);
+	return 1;
+}
+
+static int
+load_ply(mesh *out, const char *path, const char *data, size_t size)
+{
+	struct ply ply;
+	struct tri_buf tris;
+	struct ply_element *e;
+	double vals[PLY_MAX_PROPS];
+	uint32_t idx[MAX_POLY];
+	size_t i;
+	int k, have_verts;
+
+	memset(&ply, 0, sizeof(ply));
+	ply.path = path;
+	ply.p = (const unsigned char *)data;
+	ply.end = ply.p + size;
+	if (ply_header(&ply) != 0)
+		return 1;
+
+	memset(&tris, 0, sizeof(tris));
+	have_verts = 0;
+	for (k = 0; k < ply.n_elements; k++) {
+		e = &ply.elements[k];
+		if (strcmp(e->name, "vertex") == 0 && !have_verts) {
+			if (ply_vertices(&ply, e, &out->src) != 0)
+				goto fail;
+			have_verts = 1;
+		} else if (strcmp(e->name, "face") == 0) {
+			if (ply_faces(&ply, e, &tris) != 0)
+				goto fail;
+		} else {
+			for (i = 0; i < e->n; i++) {
+				if (ply_item(&ply, e, -1, vals, idx) < 0) {
+					fprintf(stderr,
+					    "%s: %s is truncated or corrupt\n",
+					    prog_name, path);
+					goto fail;
+				}
+			}
+		}
+	}
+	if (!have_verts) {
+		fprintf(stderr, "%s: %s has no vertices\n", prog_name, path);
+		goto fail;
+	}
+
+	out->src.tris = tris.tris;
+	out->src.n_tris = tris.n;
+	return 0;
+fail:
+	free(tris.tris);
+	return 1;
+}
+
+static int
+is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* whether the line at p, after any blanks, starts with the command c */
+static const char *
+obj_command(const char *p, const char *end, char c)
+{
+	while (p < end && is_blank(*p))
+		p++;
+	if (end - p < 2 || p[0] != c || !is_blank(p[1]))
+		return NULL;
+	return p + 2;
+}
+
+static void
+obj_count_task(void *arg, int worker)
+{
+	struct obj_chunk *c;
+	const char *p, *nl;
+
+	(void)worker;
+
+	c = arg;
+	for (p = c->begin; p < c->end; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', c->end - p)))
+			nl = c->end;
+		c->n_verts += obj_command(p, nl, 'v') != NULL;
+	}
+}
+
+/*
+ * one face index, ignoring any texture and normal indices after it. negative
+ * indices count back from the vertices read so far
+ */
+static int
+obj_index(const char **p, const char *end, long long seen, uint32_t *out)
+{
+	const char *q;
+	long long v;
+	int neg;
+
+	q = *p;
+	neg = q < end && *q == '-';
+	q += neg;
+	if (q == end || *q < '0' || *q > '9')
+		return 1;
+	for (v = 0; q < end && *q >= '0' && *q <= '9'; q++)
+		if ((v = v * 10 + (*q - '0')) > UINT32_MAX)
+			return 1;
+	while (q < end && !is_blank(*q))
+		q++;
+	*p = q;
+
+	if (v == 0)
+		return 1;
+	v = neg ? seen - v : v - 1;
+	if (v < 0 || v >= UINT32_MAX)
+		return 1;
+	*out = v;
+	return 0;
+}
+
+static void
+obj_parse_task(void *arg, int worker)
+{
+	struct obj_chunk *c;
+	const char *p, *nl, *q;
+	uint32_t idx[MAX_POLY];
+	size_t n_verts;
+	double v;
+	int k, n;
+
+	(void)worker;
+
+	c = arg;
+	n_verts = 0;
+	for (p = c->begin; p < c->end; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', c->end - p)))
+			nl = c->end;
+
+		if ((q = obj_command(p, nl, 'v'))) {
+			for (k = 0; k < 3; k++) {
+				while (q < nl && is_blank(*q))
+					q++;
+				if (mesh_float(&q, nl, &v) != 0)
+					goto fail;
+				c->verts[n_verts][k] = v;
+			}
+			n_verts++;
+		} else if ((q = obj_command(p, nl, 'f'))) {
+			for (n = 0;; n++) {
+				while (q < nl && is_blank(*q))
+					q++;
+				if (q == nl)
+					break;
+				if (n == MAX_POLY ||
+				    obj_index(&q, nl, c->base + n_verts,
+					&idx[n]) != 0)
+					goto fail;
+			}
+			if (n < 3)
+				goto fail;
+			if (push_poly(&c->tris, idx, n) != 0) {
+				c->nomem = 1;
+				return;
+			}
+		}
+	}
+	return;
+fail:
+	c->error = p;
+}
+
+static int
+load_obj(mesh *out, const char *path, const char *data, size_t size)
+{
+	struct obj_chunk *chunks;
+	const char *p, *end, *nl;
+	size_t n, i, base, line;
+	int ret;
+
+	n = size / OBJ_CHUNK + 1;
+	if (!(chunks = calloc(n, sizeof(*chunks)))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		return 1;
+	}
+
+	end = data + size;
+	for (i = 0, p = data; p < end; i++) {
+		chunks[i].begin = p;
+		if (end - p <= OBJ_CHUNK ||
+		    !(nl = memchr(p + OBJ_CHUNK, '\n', end - p - OBJ_CHUNK)))
+			p = end;
+		else
+			p = nl + 1;
+		chunks[i].end = p;
+		pool_submit(obj_count_task, &chunks[i]);
+	}
+	n = i;
+	pool_wait();
+
+	for (i = 0, base = 0; i < n; i++) {
+		chunks[i].base = base;
+		base += chunks[i].n_verts;
+	}
+	ret = 1;
+	if (!(out->src.verts = malloc(sizeof(vec3) * (base ? base : 1)))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		goto done;
+	}
+	out->src.n_verts = base;
+
+	for (i = 0; i < n; i++) {
+		chunks[i].verts = out->src.verts + chunks[i].base;
+		pool_submit(obj_parse_task, &chunks[i]);
+	}
+	pool_wait();
+
+	for (i = 0, base = 0; i < n; i++) {
+		if (chunks[i].nomem) {
+			fprintf(stderr, "%s: memory allocation failed\n",
+			    prog_name);
+			goto done;
+		}
+		if (chunks[i].error) {
+			line = 1;
+			for (p = data; (p = memchr(p, '\n', chunks[i].error - p));
+			     p++)
+				line++;
+			fprintf(stderr, "%s: invalid line %zu in %s\n",
+			    prog_name, line, path);
+			goto done;
+		}
+		base += chunks[i].tris.n;
+	}
+
+	if (!(out->src.tris = malloc(sizeof(*out->src.tris) *
+		  (base ? base : 1)))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		goto done;
+	}
+	for (i = 0, base = 0; i < n; i++) {
+		memcpy(out->src.tris + base, chunks[i].tris.tris,
+		    sizeof(*out->src.tris) * chunks[i].tris.n);
+		base += chunks[i].tris.n;
+	}
+	out->src.n_tris = base;
+	ret = 0;
+done:
+	for (i = 0; i < n; i++)
+		free(chunks[i].tris.tris);
+	free(chunks);
+	return ret;
+}
+
+/*
+ * loads a binary or ASCII PLY file, or failing that an OBJ file. only vertex
+ * positions and faces are read, polygons are split into triangles
+ */
+int
+mesh_load(mesh *out, const char *path)
+{
+	const char *data;
+	size_t size, i;
+	int k, ret;
+
+	memset(out, 0, sizeof(*out));
+	if (!(data = map_file(path, &size)))
+		return 1;
+
+	if (size >= 4 && memcmp(data, "ply", 3) == 0 &&
+	    (data[3] == '\n' || data[3] == '\r'))
+		ret = load_ply(out, path, data, size);
+	else
+		ret = load_obj(out, path, data, size);
+	munmap((void *)data, size);
+
+	for (i = 0; ret == 0 && i < out->src.n_tris; i++) {
+		for (k = 0; k < 3; k++) {
+			if (out->src.tris[i][k] >= out->src.n_verts) {
+				fprintf(stderr,
+				    "%s: %s refers to a missing vertex\n",
+				    prog_name, path);
+				ret = 1;
+				break;
+			}
+		}
+	}
+	if (ret != 0)
+		mesh_free(out);
+	return ret;
+}
+
+static void
+mesh_src_free(mesh *m)
+{
+	free(m->src.verts);
+	free(m->src.tris);
+	memset(&m->src, 0, sizeof(m->src));
+}
+
+/*
+ * fixes vertex positions to 16 bits over the bounds of the mesh. an axis the
+ * mesh is flat along gets a scale of 0
+ */
+static void
+quantize(mesh *m, uint16_t (*q)[3])
+{
+	float lo[3], hi[3], inv[3], f;
+	size_t i;
+	int k;
+
+	for (k = 0; k < 3; k++) {
+		lo[k] = INFINITY;
+		hi[k] = -INFINITY;
+	}
+	for (i = 0; i < m->src.n_verts; i++) {
+		for (k = 0; k < 3; k++) {
+			f = m->src.verts[i][k];
+			lo[k] = f < lo[k] ? f : lo[k];
+			hi[k] = f > hi[k] ? f : hi[k];
+		}
+	}
+	for (k = 0; k < 3; k++) {
+		m->geom.origin[k] = lo[k];
+		m->geom.scale[k] = (hi[k] - lo[k]) / UINT16_MAX;
+		inv[k] = hi[k] > lo[k] ? UINT16_MAX / (hi[k] - lo[k]) : 0.0f;
+	}
+
+	for (i = 0; i < m->src.n_verts; i++) {
+		for (k = 0; k < 3; k++) {
+			f = (m->src.verts[i][k] - lo[k]) * inv[k] + 0.5f;
+			q[i][k] = f < UINT16_MAX ? (uint16_t)f : UINT16_MAX;
+		}
+	}
+}
+
+/*
+ * copies vertex v of the source mesh to the next slot, which becomes where
+ * later triangles look for it
+ */
+static int
+place_vertex(mesh *m, uint16_t (*q)[3], uint32_t *slot, size_t *cap,
+    uint32_t v)
+{
+	uint16_t (*grown)[3];
+
+	if (m->geom.n_verts == *cap) {
+		if (!(grown = realloc(m->geom.verts, sizeof(*grown) * *cap * 2)))
+			return 1;
+		m->geom.verts = grown;
+		*cap *= 2;
+	}
+	memcpy(m->geom.verts[m->geom.n_verts], q[v], sizeof(*q));
+	slot[v] = m->geom.n_verts++;
+	return 0;
+}
+
+/*
+ * lays the vertices out in the order the triangles, already in leaf order,
+ * first use them. a triangle whose first vertex is too far back gets a copy
+ * of it, and so do the other two if they are more than TRI_DELTA_MAX slots
+ * from the first, so every triangle fits in a packed_tri. copies only show
+ * up along the seams between distant subtrees
+ */
+static int
+pack_triangles(mesh *m, uint16_t (*q)[3], const uint32_t *order)
+{
+	const uint32_t *tri;
+	uint16_t (*grown)[3];
+	packed_tri *packed;
+	uint32_t *slot, s[3];
+	size_t i, cap;
+	int j;
+
+	cap = m->src.n_verts;
+	slot = malloc(sizeof(*slot) * m->src.n_verts);
+	packed = malloc(sizeof(*packed) * m->src.n_tris);
+	m->geom.verts = malloc(sizeof(*m->geom.verts) * cap);
+	m->geom.n_verts = 0;
+	if (!slot || !packed || !m->geom.verts)
+		goto fail;
+	memset(slot, 0xff, sizeof(*slot) * m->src.n_verts);
+
+	for (i = 0; i < m->src.n_tris; i++) {
+		tri = m->src.tris[order[i]];
+		s[0] = slot[tri[0]];
+		if ((s[0] == UINT32_MAX ||
+			m->geom.n_verts - s[0] > TRI_DELTA_MAX - 2) &&
+		    place_vertex(m, q, slot, &cap, tri[0]) != 0)
+			goto fail;
+		s[0] = slot[tri[0]];
+		for (j = 1; j < 3; j++) {
+			s[j] = slot[tri[j]];
+			if ((s[j] == UINT32_MAX ||
+				s[j] + TRI_DELTA_MAX < s[0]) &&
+			    place_vertex(m, q, slot, &cap, tri[j]) != 0)
+				goto fail;
+			s[j] = slot[tri[j]];
+		}
+		packed[i].v0 = s[0];
+		packed[i].d1 = (int64_t)s[1] - s[0];
+		packed[i].d2 = (int64_t)s[2] - s[0];
+	}
+
+	if ((grown = realloc(m->geom.verts,
+		 sizeof(*grown) * (m->geom.n_verts ? m->geom.n_verts : 1))))
+		m->geom.verts = grown;
+	m->geom.tris = packed;
+	m->geom.n_tris = m->src.n_tris;
+	free(slot);
+	return 0;
+fail:
+	fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+	free(slot);
+	free(packed);
+	free(m->geom.verts);
+	m->geom.verts = NULL;
+	return 1;
+}
+
+/*
+ * the box of a triangle from its decoded positions, padded by a step since
+ * the triangle test decodes relative to the ray origin and may round
+ * differently
+ */
+static void
+tri_box(const tri_list *geom, const uint32_t *idx, aabb *out)
+{
+	float p[3];
+	int j, k;
+
+	aabb_empty(out);
+	for (j = 0; j < 3; j++) {
+		tri_vertex(geom, idx[j], p);
+		for (k = 0; k < 3; k++) {
+			out->min[k] = p[k] < out->min[k] ? p[k] : out->min[k];
+			out->max[k] = p[k] > out->max[k] ? p[k] : out->max[k];
+		}
+	}
+	for (k = 0; k < 3; k++) {
+		out->min[k] -= geom->scale[k];
+		out->max[k] += geom->scale[k];
+	}
+}
+
+static void
+source_boxes(void *ctx, uint32_t begin, uint32_t end, aabb *out)
+{
+	const mesh *m;
+	uint32_t i, idx[3];
+
+	m = ctx;
+	for (i = begin; i < end; i++) {
+		tri_indices(&m->geom, i, idx);
+		tri_box(&m->geom, idx, &out[i - begin]);
+	}
+}
+
+/*
+ * packed triangles don't depend on their position, so a deferred subtree
+ * only has to shuffle them within its range
+ */
+static int
+source_reorder(void *ctx, uint32_t begin, const uint32_t *order, uint32_t n)
+{
+	packed_tri *tmp, *tris;
+	mesh *m;
+	uint32_t i;
+
+	m = ctx;
+	if (!(tmp = malloc(sizeof(*tmp) * n))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		return 1;
+	}
+	tris = m->geom.tris + begin;
+	memcpy(tmp, tris, sizeof(*tmp) * n);
+	for (i = 0; i < n; i++)
+		tris[i] = tmp[order[i]];
+	free(tmp);
+	return 0;
+}
+
+/* where deferred subtrees of a mesh's BVH get their triangles, ctx is it */
+const bvh_source mesh_source = { source_boxes, source_reorder };
+
+/*
+ * compresses the loaded triangles into geom and builds the mesh's BVH over
+ * them, leaving subtrees for first use if lazy is set. the triangles are
+ * packed in the coarse order then. src is freed either way
+ */
+int
+mesh_build(mesh *m, int lazy)
+{
+	uint16_t (*q)[3];
+	uint32_t *order;
+	aabb *boxes;
+	tri_list quantized;
+	size_t i, n;
+	int ret;
+
+	n = m->src.n_tris;
+	if (n == 0) {
+		mesh_src_free(m);
+		return 0;
+	}
+
+	q = malloc(sizeof(*q) * m->src.n_verts);
+	boxes = malloc(sizeof(*boxes) * n);
+	order = malloc(sizeof(*order) * n);
+	ret = 1;
+	if (!q || !boxes || !order) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		goto done;
+	}
+	quantize(m, q);
+
+	quantized = m->geom;
+	quantized.verts = q;
+	for (i = 0; i < n; i++)
+		tri_box(&quantized, m->src.tris[i], &boxes[i]);
+
+	if (bvh_build(&m->bvh, boxes, order, n, lazy) != 0 ||
+	    pack_triangles(m, q, order) != 0)
+		goto done;
+	ret = 0;
+done:
+	free(q);
+	free(boxes);
+	free(order);
+	mesh_src_free(m);
+	return ret;
+}
+
+void
+mesh_free(mesh *m)
+{
+	mesh_src_free(m);
+	free(m->geom.verts);
+	free(m->geom.tris);
+	bvh_free(&m->bvh);
+	memset(m, 0, sizeof(*m));
+}
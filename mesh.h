@@ -0,0 +1,31 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "bvh.h"
+#include "geom.h"
+
+/* a mesh as read from its file, before mesh_build compresses it */
+typedef struct {
+	vec3 *verts;
+	uint32_t (*tris)[3];
+	size_t n_verts, n_tris;
+} mesh_src;
+
+/*
+ * a triangle mesh loaded from a file, with its own BVH whose leaves index
+ * geom.tris. meshes are shared by every instance of the same file, which
+ * sets the material. src only holds data between mesh_load and mesh_build
+ */
+typedef struct {
+	mesh_src src;
+	tri_list geom;
+	bvh bvh;
+} mesh;
+
+extern const bvh_source mesh_source;
+
+int mesh_load(mesh *, const char *);
+int mesh_build(mesh *, int);
+void mesh_free(mesh *);
+
+#endif /* MESH_H */
@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define DEQUE_INIT_SIZE 64
+
+struct task {
+	task_fn fn;
+	void *arg;
+};
+
+/*
+ * each worker owns one deque. the owner takes tasks from the front so work is
+ * done roughly in submission order, idle workers steal from the back
+ */
+struct deque {
+	pthread_mutex_t lock;
+	struct task *buf;
+	size_t head, count, cap;
+};
+
+struct worker {
+	pthread_t thread;
+	struct deque q;
+	unsigned int seed;
+	int id;
+};
+
+extern char *prog_name;
+
+static struct {
+	struct worker *workers;
+	int n;
+	unsigned int next;
+	atomic_long queued, pending;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+} pool;
+
+static _Thread_local int self = -1;
+
+static int
+deque_push(struct deque *q, struct task t)
+{
+	struct task *buf;
+	size_t i, cap;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count == q->cap) {
+		cap = q->cap ? q->cap * 2 : DEQUE_INIT_SIZE;
+		if ((buf = malloc(sizeof(*buf) * cap)) == NULL) {
+			pthread_mutex_unlock(&q->lock);
+			return 1;
+		}
+		for (i = 0; i < q->count; i++)
+			buf[i] = q->buf[(q->head + i) % q->cap];
+		free(q->buf);
+		q->buf = buf;
+		q->head = 0;
+		q->cap = cap;
+	}
+	q->buf[(q->head + q->count) % q->cap] = t;
+	q->count++;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+static int
+deque_pop_front(struct deque *q, struct task *out)
+{
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+	if ((ret = q->count > 0)) {
+		*out = q->buf[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+static int
+deque_steal_back(struct deque *q, struct task *out)
+{
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+	if ((ret = q->count > 0)) {
+		q->count--;
+		*out = q->buf[(q->head + q->count) % q->cap];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+static int
+take_task(struct worker *w, struct task *out)
+{
+	int i, victim;
+
+	if (deque_pop_front(&w->q, out))
+		return 1;
+
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	victim = w->seed % pool.n;
+	for (i = 0; i < pool.n; i++, victim = (victim + 1) % pool.n) {
+		if (victim == w->id)
+			continue;
+		if (deque_steal_back(&pool.workers[victim].q, out))
+			return 1;
+	}
+	return 0;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w;
+	struct task t;
+
+	w = arg;
+	self = w->id;
+
+	for (;;) {
+		if (take_task(w, &t)) {
+			atomic_fetch_sub(&pool.queued, 1);
+			t.fn(t.arg, w->id);
+			if (atomic_fetch_sub(&pool.pending, 1) == 1) {
+				pthread_mutex_lock(&pool.lock);
+				pthread_cond_broadcast(&pool.done);
+				pthread_mutex_unlock(&pool.lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		while (atomic_load(&pool.queued) <= 0 && !pool.stop)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.stop) {
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+}
+
+int
+pool_default_size(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+int
+pool_init(int n)
+{
+	int i;
+
+	pool.n = n;
+	pool.next = 0;
+	pool.stop = 0;
+	atomic_init(&pool.queued, 0);
+	atomic_init(&pool.pending, 0);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	if ((pool.workers = calloc(n, sizeof(*pool.workers))) == NULL) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_init(&pool.workers[i].q.lock, NULL);
+		pool.workers[i].id = i;
+		pool.workers[i].seed = 2463534242u + i;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&pool.workers[i].thread, NULL, worker_main,
+			&pool.workers[i]) != 0) {
+			fprintf(stderr, "%s: failed to start worker thread\n",
+			    prog_name);
+			pool.n = i;
+			pool_destroy();
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+pool_destroy(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.n; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+	for (i = 0; i < pool.n; i++) {
+		pthread_mutex_destroy(&pool.workers[i].q.lock);
+		free(pool.workers[i].q.buf);
+	}
+	free(pool.workers);
+	pool.workers = NULL;
+	pool.n = 0;
+}
+
+int
+pool_size(void)
+{
+	return pool.n;
+}
+
+/*
+ * tasks submitted from outside the pool are dealt out round-robin, tasks
+ * submitted by a worker go onto its own deque. if the pool has no threads
+ * the task is run immediately
+ */
+void
+pool_submit(task_fn fn, void *arg)
+{
+	struct deque *q;
+	int i;
+
+	if (pool.n == 0) {
+		fn(arg, 0);
+		return;
+	}
+
+	i = self >= 0 ? self : (int)(pool.next++ % pool.n);
+	q = &pool.workers[i].q;
+
+	atomic_fetch_add(&pool.pending, 1);
+	if (deque_push(q, (struct task) { fn, arg }) != 0) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		exit(1);
+	}
+	atomic_fetch_add(&pool.queued, 1);
+
+	pthread_mutex_lock(&pool.lock);
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void
+pool_wait(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (atomic_load(&pool.pending) > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,13 @@
+#ifndef POOL_H
+#define POOL_H
+
+typedef void (*task_fn)(void *, int);
+
+int pool_init(int);
+void pool_destroy(void);
+int pool_size(void);
+int pool_default_size(void);
+void pool_submit(task_fn, void *);
+void pool_wait(void);
+
+#endif /* POOL_H */
@@ -0,0 +1,957 @@
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pool.h"
+#include "render.h"
+#include "rng.h"
+#include "scene.h"
+
+#define ADAPTIVE_MIN_SAMPLES 16
+/* camera rays are traced together in square blocks of pixels */
+#define BLOCK_SIZE 4
+/* camera rays start within this fraction of the image plane around the eye */
+#define LENS_SIZE 0.02
+/* paths a wavefront batch keeps in flight, at least a tile's worth */
+#define WAVE_PATHS 1024
+/* wavefront shading queues, one per material type and texture type */
+#define WAVE_QUEUES (3 * 3)
+/* bits per axis of the cell a secondary ray starts in, for sorting */
+#define WAVE_CELL_BITS 9
+
+struct tile {
+	long x0, y0, x1, y1;
+	long row;
+	unsigned int spp;
+	int active;
+};
+
+/*
+ * a batch of paths traced a bounce at a time. path k's ray, random numbers,
+ * weight so far and hit are at index k of each array, and its color goes to
+ * result[k] once it ends. live holds the paths still going, in the order
+ * they're traced next, and queue is scratch for sorting them
+ */
+struct wave {
+	ray rays[WAVE_PATHS];
+	rng rngs[WAVE_PATHS];
+	color weight[WAVE_PATHS], result[WAVE_PATHS];
+	hit_id hits[WAVE_PATHS];
+	hit_info info[WAVE_PATHS];
+	long pixel[WAVE_PATHS];
+	uint32_t live[WAVE_PATHS], queue[WAVE_PATHS], keys[WAVE_PATHS];
+};
+
+static long lmin(long, long);
+static double now(void);
+static float rad_inverse(unsigned int);
+static float rad_inverse_3(unsigned int);
+static color ray_color(ray *, const hit_id *, int, rng *);
+static color background(const ray *);
+static float importance_sample_diffuse(vec, rng *);
+
+extern char *prog_name;
+
+static struct {
+	const render_opts *opts;
+	color *accum;
+	float *lum2;
+	color *out;
+	struct tile *tiles;
+	/* each worker's spheres for the tile it's rasterizing */
+	tile_raster *rasters;
+	/* each worker's wavefront batch */
+	struct wave *waves;
+	int n_workers;
+	/* where secondary rays start, for sorting them by cell */
+	aabb bounds;
+	float cell_scale[3];
+	long tiles_x, tiles_y;
+	long *tiles_left;
+	unsigned int first_sample, pass_samples;
+	pthread_mutex_t lock;
+	pthread_cond_t row_done;
+} r;
+
+/*
+ * the single pass renderer knows the final sample count up front and uses a
+ * Hammersley set. progressive passes don't, so they use the Halton sequence,
+ * any prefix of which is well distributed over the pixel
+ */
+static void
+sample_offset(unsigned int i, float *du, float *dv)
+{
+	if (r.opts->progressive)
+		*du = rad_inverse_3(i + 1);
+	else
+		*du = (float)(i + 1) / (float)(r.opts->samples + 1);
+	*dv = rad_inverse(i + 1);
+}
+
+/*
+ * sets up the camera ray for sample i of a pixel, and its random numbers.
+ * rasterized first hits need every ray to leave from the eye, so the lens is
+ * closed for them
+ */
+static void
+camera_ray(long x, long y, unsigned int i, ray *ray, rng *rng)
+{
+	float u, v, u2, v2, lens;
+
+	sample_offset(i, &u, &v);
+	u += (float)x;
+	v += (float)y;
+
+	u /= (float)r.opts->width;
+	v /= (float)r.opts->height;
+
+	lens = r.opts->raster ? 0.0f : LENS_SIZE;
+	rng_init(rng, y * r.opts->width + x, i);
+	u2 = (rng_float(rng) - 0.5) * lens;
+	v2 = (rng_float(rng) - 0.5) * lens;
+
+	glm_vec4_copy(scene.camera.eye, ray->origin);
+	glm_vec4_muladds(scene.camera.right, u2, ray->origin);
+	glm_vec4_muladds(scene.camera.down, v2, ray->origin);
+
+	glm_vec4_copy(scene.camera.upper_left, ray->d);
+	glm_vec4_muladds(scene.camera.right, u, ray->d);
+	glm_vec4_muladds(scene.camera.down, v, ray->d);
+	glm_vec4_sub(ray->d, ray->origin, ray->d);
+}
+
+/*
+ * sets up the camera rays of sample i over a block of pixels, in rows, and
+ * finds their first hits when those are worth finding. with raster set the
+ * block is a whole tile and the hits come from raster_hits. otherwise the
+ * block is at most PACKET_SIZE pixels and its rays are intersected as one
+ * packet. when the camera rays are the last bounce, ray_color only asks
+ * whether they're blocked, which is cheaper per ray than any closest hit, so
+ * there are no packets. returns whether hits was filled in
+ */
+static int
+camera_hits(const tile_view *view, const tile_raster *raster, long x0,
+    long y0, long x1, long y1, unsigned int i, ray *rays, rng *rngs,
+    hit_id *hits)
+{
+	raster_grid grid;
+	long x, y;
+	size_t n;
+	float du, dv;
+
+	n = 0;
+	for (y = y0; y < y1; y++) {
+		for (x = x0; x < x1; x++, n++)
+			camera_ray(x, y, i, &rays[n], &rngs[n]);
+	}
+
+	if (raster) {
+		sample_offset(i, &du, &dv);
+		grid.u = ((float)x0 + du) / r.opts->width;
+		grid.v = ((float)y0 + dv) / r.opts->height;
+		grid.du = 1.0f / r.opts->width;
+		grid.dv = 1.0f / r.opts->height;
+		grid.w = x1 - x0;
+		grid.h = y1 - y0;
+		raster_hits(raster, &grid, rays, hits);
+		return 1;
+	}
+	if (r.opts->max_bounces > 1 || scene.has_emissive) {
+		intersect_packet(rays, n, view, hits);
+		return 1;
+	}
+	return 0;
+}
+
+/* adds one sample's color to pixel p */
+static void
+add_sample(long p, color c)
+{
+	float l;
+
+	color_add(&r.accum[p], c);
+	if (r.lum2) {
+		l = color_luminance(c);
+		r.lum2[p] += l * l;
+	}
+}
+
+/*
+ * renders the pass's samples for a block of pixels, following each camera
+ * ray's path on its own after its first hit
+ */
+static void
+render_block(const tile_view *view, const tile_raster *raster, long x0,
+    long y0, long x1, long y1)
+{
+	ray rays[TILE_SIZE * TILE_SIZE];
+	rng rngs[TILE_SIZE * TILE_SIZE];
+	hit_id hits[TILE_SIZE * TILE_SIZE];
+	unsigned int i, end;
+	long x, y;
+	size_t k;
+	color c;
+	int packets;
+
+	end = r.first_sample + r.pass_samples;
+	for (i = r.first_sample; i < end; i++) {
+		packets = camera_hits(view, raster, x0, y0, x1, y1, i, rays,
+		    rngs, hits);
+
+		k = 0;
+		for (y = y0; y < y1; y++) {
+			for (x = x0; x < x1; x++, k++) {
+				c = ray_color(&rays[k],
+				    packets ? &hits[k] : NULL,
+				    r.opts->max_bounces, &rngs[k]);
+				add_sample(y * r.opts->width + x, c);
+			}
+		}
+	}
+}
+
+/*
+ * the box secondary rays are sorted over, around everything they can start
+ * on except the planes, which are clamped to its sides
+ */
+static void
+wave_bounds(void)
+{
+	aabb inst;
+	float extent;
+	int i;
+
+	bvh_bounds(&scene.bvh, &r.bounds);
+	bvh_bounds(&scene.instance_bvh, &inst);
+	aabb_grow(&r.bounds, &inst);
+	for (i = 0; i < 3; i++) {
+		extent = r.bounds.max[i] - r.bounds.min[i];
+		if (!(extent > 0.0f)) {
+			r.bounds.min[i] = 0.0f;
+			extent = 1.0f;
+		}
+		r.cell_scale[i] = (1 << WAVE_CELL_BITS) / extent;
+	}
+}
+
+/* spreads the low 10 bits of x out to every third bit */
+static uint32_t
+spread_bits(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | x << 16) & 0x030000ff;
+	x = (x | x << 8) & 0x0300f00f;
+	x = (x | x << 4) & 0x030c30c3;
+	x = (x | x << 2) & 0x09249249;
+	return x;
+}
+
+/*
+ * a sort key that keeps rays going the same way from nearby points together:
+ * the octant of the direction, then the Morton code of the cell of the
+ * scene's bounds the ray starts in
+ */
+static uint32_t
+ray_key(const ray *ray)
+{
+	uint32_t key, cell;
+	float f;
+	int i;
+
+	key = 0;
+	for (i = 0; i < 3; i++) {
+		f = (ray->origin[i] - r.bounds.min[i]) * r.cell_scale[i];
+		f = glm_clamp(f, 0.0f, (1 << WAVE_CELL_BITS) - 1);
+		cell = f;
+		key |= spread_bits(cell) << i;
+		key |= (uint32_t)(ray->d[i] < 0.0f)
+		    << (3 * WAVE_CELL_BITS + i);
+	}
+	return key;
+}
+
+/* radix sorts the first n live paths by their keys, a byte at a time */
+static void
+sort_paths(struct wave *w, size_t n)
+{
+	size_t count[256], k, sum, c;
+	uint32_t *src, *dst, *tmp;
+	int shift;
+
+	src = w->live;
+	dst = w->queue;
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (k = 0; k < n; k++)
+			count[w->keys[src[k]] >> shift & 0xff]++;
+		for (k = 0, sum = 0; k < 256; k++) {
+			c = count[k];
+			count[k] = sum;
+			sum += c;
+		}
+		for (k = 0; k < n; k++)
+			dst[count[w->keys[src[k]] >> shift & 0xff]++] = src[k];
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+}
+
+/*
+ * applies each path's surface color. every path in the queue has a texture
+ * of the same type, so the branch in sample_texture always goes the same way
+ */
+static void
+shade_textures(struct wave *w, const uint32_t *queue, size_t n,
+    texture_type type)
+{
+	const hit_info *info;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		info = &w->info[queue[k]];
+		if (type == SOLID)
+			color_mul(&w->weight[queue[k]],
+			    info->material->texture.solid);
+		else
+			color_mul(&w->weight[queue[k]],
+			    sample_texture(&info->material->texture, info->u,
+				info->v));
+	}
+}
+
+/*
+ * bounces the paths in a queue of one material type off their hits, adding
+ * the ones that go on to live from *n_live. these are the steps of ray_color
+ */
+static void
+shade_material(struct wave *w, const uint32_t *queue, size_t n,
+    material_type type, size_t *n_live)
+{
+	const hit_info *info;
+	float c, n_dot_d, weight;
+	uint32_t j;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		j = queue[k];
+		info = &w->info[j];
+		switch (type) {
+		case DIFFUSE:
+			weight = importance_sample_diffuse(w->rays[j].d,
+			    &w->rngs[j]);
+			n_dot_d = glm_vec4_dot(w->rays[j].d,
+			    (float *)info->normal);
+			if (n_dot_d < 0.0) {
+				w->result[j] = (color) { 0.0, 0.0, 0.0 };
+				continue;
+			}
+			color_muls(&w->weight[j], n_dot_d * weight);
+			break;
+		case SPECULAR:
+			c = 2 * glm_vec4_dot(w->rays[j].d,
+				    (float *)info->normal);
+			glm_vec4_mulsubs((float *)info->normal, c,
+			    w->rays[j].d);
+			break;
+		case EMISSIVE:
+			w->result[j] = w->weight[j];
+			continue;
+		}
+
+		glm_vec4_copy((float *)info->p, w->rays[j].origin);
+		w->live[(*n_live)++] = j;
+	}
+}
+
+/*
+ * follows the n paths of a wave to the end, a bounce at a time. each bounce
+ * sorts the rays by where they start and which way they go and intersects
+ * them all, then sorts the hits into queues by material and texture type and
+ * shades each queue in turn. the camera rays' hits are already in w->hits if
+ * primary is set. every path gets the same random numbers and arithmetic as
+ * in ray_color, so the colors are the same
+ */
+static void
+trace_wave(struct wave *w, size_t n, int primary)
+{
+	size_t count[WAVE_QUEUES], k, n_live, n_hits, sum, c;
+	const material *mat;
+	uint32_t j, q;
+	int depth, bounces, last, hit;
+
+	for (k = 0; k < n; k++) {
+		w->weight[k] = (color) { 1.0, 1.0, 1.0 };
+		w->live[k] = k;
+	}
+	n_live = n;
+
+	depth = 1;
+	for (bounces = r.opts->max_bounces; bounces > 0 && n_live > 0;
+	     bounces--, depth++) {
+		/* as in ray_color, the last bounce only needs the background */
+		last = bounces == 1 && !scene.has_emissive;
+		if (depth > 1 || !primary) {
+			for (k = 0; k < n_live; k++)
+				w->keys[w->live[k]] = ray_key(&w->rays[w->live[k]]);
+			sort_paths(w, n_live);
+		}
+
+		memset(count, 0, sizeof(count));
+		n_hits = 0;
+		for (k = 0; k < n_live; k++) {
+			j = w->live[k];
+			rng_set_bounce(&w->rngs[j], depth);
+			if (depth == 1 && primary)
+				hit = w->hits[j].t != INFINITY;
+			else if (last)
+				hit = occluded_scene(&w->rays[j], INFINITY);
+			else
+				hit = intersect_scene(&w->rays[j], &w->hits[j]);
+
+			if (!hit) {
+				w->result[j] = w->weight[j];
+				color_mul(&w->result[j],
+				    background(&w->rays[j]));
+				continue;
+			}
+			if (last) {
+				w->result[j] = (color) { 0.0, 0.0, 0.0 };
+				continue;
+			}
+
+			finalize_hit(&w->rays[j], &w->hits[j], &w->info[j]);
+			mat = w->info[j].material;
+			w->keys[j] = mat->type * 3 + mat->texture.type;
+			count[w->keys[j]]++;
+			w->live[n_hits++] = j;
+		}
+
+		for (q = 0, sum = 0; q < WAVE_QUEUES; q++) {
+			c = count[q];
+			count[q] = sum;
+			sum += c;
+		}
+		for (k = 0; k < n_hits; k++)
+			w->queue[count[w->keys[w->live[k]]]++] = w->live[k];
+
+		n_live = 0;
+		for (q = 0, k = 0; q < WAVE_QUEUES; k = count[q++]) {
+			shade_textures(w, &w->queue[k], count[q] - k, q % 3);
+			shade_material(w, &w->queue[k], count[q] - k, q / 3,
+			    &n_live);
+		}
+	}
+
+	/* paths that run out of bounces carry no light */
+	for (k = 0; k < n_live; k++)
+		w->result[w->live[k]] = (color) { 0.0, 0.0, 0.0 };
+}
+
+/*
+ * renders the pass's samples for a tile as wavefronts of as many samples as
+ * fit in w at once. colors are added in sample order, as render_block does
+ */
+static void
+render_wave(const tile_view *view, const tile_raster *raster,
+    const struct tile *tile, struct wave *w)
+{
+	unsigned int i, s, end, per;
+	long x, y, x0, y0, x1, y1, bw, bh;
+	size_t k, n;
+	int primary;
+
+	bw = raster ? TILE_SIZE : BLOCK_SIZE;
+	bh = raster ? TILE_SIZE : BLOCK_SIZE;
+	per = WAVE_PATHS / ((tile->x1 - tile->x0) * (tile->y1 - tile->y0));
+	end = r.first_sample + r.pass_samples;
+	primary = 0;
+	for (i = r.first_sample; i < end; i += per) {
+		n = 0;
+		for (s = i; s < end && s < i + per; s++) {
+			for (y0 = tile->y0; y0 < tile->y1; y0 += bh) {
+				y1 = lmin(y0 + bh, tile->y1);
+				for (x0 = tile->x0; x0 < tile->x1; x0 += bw) {
+					x1 = lmin(x0 + bw, tile->x1);
+					primary = camera_hits(view, raster, x0,
+					    y0, x1, y1, s, &w->rays[n],
+					    &w->rngs[n], &w->hits[n]);
+					for (y = y0; y < y1; y++) {
+						for (x = x0; x < x1; x++)
+							w->pixel[n++] = y *
+							    r.opts->width + x;
+					}
+				}
+			}
+		}
+
+		trace_wave(w, n, primary);
+		for (k = 0; k < n; k++)
+			add_sample(w->pixel[k], w->result[k]);
+	}
+}
+
+/*
+ * estimates the noise left in a tile as the average standard error of its
+ * pixels' mean luminance. the error is measured after the square root used
+ * when writing pixels, so the threshold is roughly in output units
+ */
+static float
+tile_error(const struct tile *tile)
+{
+	long x, y, i;
+	float n, mean, var, total;
+
+	n = tile->spp;
+	total = 0.0;
+	for (y = tile->y0; y < tile->y1; y++) {
+		for (x = tile->x0; x < tile->x1; x++) {
+			i = y * r.opts->width + x;
+			mean = color_luminance(r.accum[i]) / n;
+			var = glm_max(r.lum2[i] / n - mean * mean, 0.0);
+			total += sqrtf(var / n) /
+			    (2 * sqrtf(glm_max(mean, 1e-3)));
+		}
+	}
+
+	return total / ((tile->x1 - tile->x0) * (tile->y1 - tile->y0));
+}
+
+static void
+render_tile(void *arg, int worker)
+{
+	struct tile *tile;
+	tile_view view;
+	unsigned int end;
+	long x, y;
+
+	tile = arg;
+	end = r.first_sample + r.pass_samples;
+
+	/*
+	 * half a pixel of slack keeps rays on the tile's edges inside it. when
+	 * the camera rays are the last bounce, the occlusion tests beat any
+	 * closest hit, and a tile whose spheres can't be listed is traced too
+	 */
+	if (r.opts->raster &&
+	    (r.opts->max_bounces > 1 || scene.has_emissive) &&
+	    raster_view((tile->x0 - 0.5f) / r.opts->width,
+		(tile->y0 - 0.5f) / r.opts->height,
+		(tile->x1 + 0.5f) / r.opts->width,
+		(tile->y1 + 0.5f) / r.opts->height,
+		&r.rasters[worker]) == 0) {
+		if (r.opts->wavefront)
+			render_wave(NULL, &r.rasters[worker], tile,
+			    &r.waves[worker]);
+		else
+			render_block(NULL, &r.rasters[worker], tile->x0,
+			    tile->y0, tile->x1, tile->y1);
+	} else {
+		cull_view((tile->x0 - 0.5f) / r.opts->width,
+		    (tile->y0 - 0.5f) / r.opts->height,
+		    (tile->x1 + 0.5f) / r.opts->width,
+		    (tile->y1 + 0.5f) / r.opts->height, LENS_SIZE / 2, &view);
+
+		if (r.opts->wavefront) {
+			render_wave(&view, NULL, tile, &r.waves[worker]);
+		} else {
+			for (y = tile->y0; y < tile->y1; y += BLOCK_SIZE) {
+				for (x = tile->x0; x < tile->x1;
+				     x += BLOCK_SIZE)
+					render_block(&view, NULL, x, y,
+					    lmin(x + BLOCK_SIZE, tile->x1),
+					    lmin(y + BLOCK_SIZE, tile->y1));
+			}
+		}
+	}
+
+	tile->spp = end;
+	if (r.lum2 && end >= ADAPTIVE_MIN_SAMPLES)
+		tile->active = tile_error(tile) > r.opts->noise_threshold;
+
+	pthread_mutex_lock(&r.lock);
+	if (--r.tiles_left[tile->row] == 0)
+		pthread_cond_broadcast(&r.row_done);
+	pthread_mutex_unlock(&r.lock);
+}
+
+static void
+resolve_rows(long y0, long y1)
+{
+	long x, y, i;
+	unsigned int spp;
+
+	for (y = y0; y < y1; y++) {
+		for (x = 0; x < r.opts->width; x++) {
+			i = y * r.opts->width + x;
+			spp = r.tiles[y / TILE_SIZE * r.tiles_x + x / TILE_SIZE]
+				  .spp;
+			glm_vec4_divs((float *)&r.accum[i], (float)spp,
+			    (float *)&r.out[i]);
+		}
+	}
+}
+
+/*
+ * sets up the frame buffers and tiles for opts, which must outlive them. this
+ * is the only step that can fail, so it's done before any output is started
+ */
+int
+render_init(const render_opts *opts)
+{
+	struct tile *tile;
+	long tx, ty;
+
+	r.opts = opts;
+	r.tiles_x = (opts->width + TILE_SIZE - 1) / TILE_SIZE;
+	r.tiles_y = (opts->height + TILE_SIZE - 1) / TILE_SIZE;
+
+	r.accum = calloc(opts->width * opts->height, sizeof(*r.accum));
+	r.lum2 = NULL;
+	if (opts->noise_threshold > 0)
+		r.lum2 = calloc(opts->width * opts->height, sizeof(*r.lum2));
+	r.out = malloc(sizeof(*r.out) * opts->width * opts->height);
+	r.tiles_left = malloc(sizeof(*r.tiles_left) * r.tiles_y);
+	r.tiles = malloc(sizeof(*r.tiles) * r.tiles_x * r.tiles_y);
+	r.n_workers = pool_size() > 0 ? pool_size() : 1;
+	r.rasters = NULL;
+	if (opts->raster)
+		r.rasters = calloc(r.n_workers, sizeof(*r.rasters));
+	r.waves = NULL;
+	if (opts->wavefront)
+		r.waves = malloc(sizeof(*r.waves) * r.n_workers);
+	if (!r.accum || (opts->noise_threshold > 0 && !r.lum2) || !r.out ||
+	    !r.tiles_left || !r.tiles || (opts->raster && !r.rasters) ||
+	    (opts->wavefront && !r.waves)) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		free(r.accum);
+		free(r.lum2);
+		free(r.out);
+		free(r.tiles_left);
+		free(r.tiles);
+		free(r.rasters);
+		free(r.waves);
+		return 1;
+	}
+
+	if (opts->wavefront)
+		wave_bounds();
+
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.row_done, NULL);
+
+	for (ty = 0; ty < r.tiles_y; ty++) {
+		for (tx = 0; tx < r.tiles_x; tx++) {
+			tile = &r.tiles[ty * r.tiles_x + tx];
+			tile->x0 = tx * TILE_SIZE;
+			tile->y0 = ty * TILE_SIZE;
+			tile->x1 = lmin(tile->x0 + TILE_SIZE, opts->width);
+			tile->y1 = lmin(tile->y0 + TILE_SIZE, opts->height);
+			tile->row = ty;
+			tile->spp = 0;
+			tile->active = 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+render_free(void)
+{
+	int i;
+
+	for (i = 0; r.rasters && i < r.n_workers; i++) {
+		free(r.rasters[i].spheres);
+		free(r.rasters[i].extent);
+	}
+	free(r.rasters);
+	free(r.waves);
+	pthread_cond_destroy(&r.row_done);
+	pthread_mutex_destroy(&r.lock);
+	free(r.tiles);
+	free(r.tiles_left);
+	free(r.out);
+	free(r.lum2);
+	free(r.accum);
+}
+
+/*
+ * renders samples [first, first + n) of every pixel in the active tiles and
+ * returns how many tiles that was. if emit is given, rows are resolved and
+ * passed to it in order as soon as every tile covering them is finished
+ */
+static long
+render_pass(unsigned int first, unsigned int n, row_fn emit)
+{
+	long i, ty, y, y1, active;
+
+	r.first_sample = first;
+	r.pass_samples = n;
+
+	for (ty = 0; ty < r.tiles_y; ty++)
+		r.tiles_left[ty] = 0;
+
+	active = 0;
+	for (i = 0; i < r.tiles_x * r.tiles_y; i++) {
+		if (!r.tiles[i].active)
+			continue;
+		r.tiles_left[r.tiles[i].row]++;
+		active++;
+	}
+
+	for (i = 0; i < r.tiles_x * r.tiles_y; i++) {
+		if (r.tiles[i].active)
+			pool_submit(render_tile, &r.tiles[i]);
+	}
+
+	for (ty = 0; emit && ty < r.tiles_y; ty++) {
+		pthread_mutex_lock(&r.lock);
+		while (r.tiles_left[ty] > 0)
+			pthread_cond_wait(&r.row_done, &r.lock);
+		pthread_mutex_unlock(&r.lock);
+
+		y1 = lmin((ty + 1) * TILE_SIZE, r.opts->height);
+		resolve_rows(ty * TILE_SIZE, y1);
+		for (y = ty * TILE_SIZE; y < y1; y++)
+			emit(r.out + y * r.opts->width, y);
+	}
+
+	pool_wait();
+	return active;
+}
+
+/*
+ * splits the frame into tiles and hands them to the thread pool, streaming
+ * finished rows to emit
+ */
+void
+render(row_fn emit)
+{
+	render_pass(0, r.opts->samples, emit);
+}
+
+/*
+ * renders the whole frame in passes, doubling the sample count each time,
+ * until opts->samples is reached or opts->time_limit runs out. the pass size
+ * is cut down when the previous passes suggest it wouldn't fit in the time
+ * that is left. every snapshot_passes passes or snapshot_secs seconds the
+ * current estimate is passed to snapshot.
+ *
+ * with a noise threshold, tiles drop out of later passes once their error
+ * estimate falls below it, and the remaining passes only go to the tiles that
+ * haven't converged yet
+ */
+void
+render_progressive(row_fn emit, frame_fn snapshot)
+{
+	const render_opts *opts;
+	unsigned int done, n, pass, last_pass;
+	double start, elapsed, last_snap, per_sample, work;
+	long i, y, active;
+
+	opts = r.opts;
+	start = now();
+	last_snap = start;
+	done = 0;
+	pass = 0;
+	last_pass = 0;
+	work = 0.0;
+	active = r.tiles_x * r.tiles_y;
+
+	while (done < (unsigned int)opts->samples && active > 0) {
+		n = done ? done : 1;
+		if (n > (unsigned int)opts->samples - done)
+			n = opts->samples - done;
+
+		if (opts->time_limit > 0 && done > 0) {
+			elapsed = now() - start;
+			if (elapsed >= opts->time_limit)
+				break;
+			per_sample = elapsed / work * active;
+			if (per_sample * n > opts->time_limit - elapsed) {
+				n = (opts->time_limit - elapsed) / per_sample;
+				if (n == 0)
+					n = 1;
+			}
+		}
+
+		work += (double)render_pass(done, n, NULL) * n;
+		done += n;
+		pass++;
+
+		for (i = 0, active = 0; i < r.tiles_x * r.tiles_y; i++)
+			active += r.tiles[i].active;
+
+		if (!snapshot || done == (unsigned int)opts->samples ||
+		    active == 0)
+			continue;
+		if ((opts->snapshot_passes &&
+			pass - last_pass >= (unsigned int)opts->snapshot_passes) ||
+		    (opts->snapshot_secs > 0 &&
+			now() - last_snap >= opts->snapshot_secs)) {
+			resolve_rows(0, opts->height);
+			snapshot(r.out, done);
+			last_pass = pass;
+			last_snap = now();
+		}
+	}
+
+	resolve_rows(0, opts->height);
+	for (y = 0; y < opts->height; y++)
+		emit(r.out + y * opts->width, y);
+}
+
+static long
+lmin(long a, long b)
+{
+	return a < b ? a : b;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static float
+rad_inverse(unsigned int n)
+{
+	unsigned int rev;
+	n = (((n & 0xaaaaaaaa) >> 1) | ((n & 0x55555555) << 1));
+	n = (((n & 0xcccccccc) >> 2) | ((n & 0x33333333) << 2));
+	n = (((n & 0xf0f0f0f0) >> 4) | ((n & 0x0f0f0f0f) << 4));
+	n = (((n & 0xff00ff00) >> 8) | ((n & 0x00ff00ff) << 8));
+	rev = (n >> 16) | (n << 16);
+
+	return (float)rev / (float)UINT_MAX;
+}
+
+static float
+rad_inverse_3(unsigned int n)
+{
+	float f, ret;
+
+	ret = 0.0;
+	f = 1.0 / 3.0;
+	for (; n > 0; n /= 3) {
+		ret += (n % 3) * f;
+		f /= 3.0;
+	}
+
+	return ret;
+}
+
+static float
+importance_sample_diffuse(vec d, rng *rng)
+{
+	float u, v, phi, theta, pdf;
+	long x, y, w, h;
+
+	w = scene.bg.map.w;
+	h = scene.bg.map.h;
+
+	u = rng_float(rng);
+	v = rng_float(rng);
+
+	y = alias_sample(scene.bg.map.marginal, h, v, &pdf);
+	x = alias_sample(scene.bg.map.rows + y * w, w, u, &pdf);
+
+	phi = (x + rng_float(rng)) / w * 2 * GLM_PI;
+	theta = -(y + rng_float(rng)) / h * GLM_PI;
+
+	d[0] = sinf(theta) * cosf(phi);
+	d[2] = sinf(theta) * sinf(phi);
+	d[1] = cosf(theta);
+
+	return pdf;
+}
+
+/* the color of the background in the direction of ray */
+static color
+background(const ray *ray)
+{
+	float u, v;
+
+	u = atan2f(ray->d[0], ray->d[2]) / (2 * GLM_PI);
+	v = acosf(ray->d[1] / glm_vec4_norm((float *)ray->d)) / GLM_PI;
+	u += 0.5;
+
+	return sample_texture(&scene.bg.tex, u, v);
+}
+
+/*
+ * follows a path from ray. primary, if given, is the ray's closest hit,
+ * already found with the rest of its packet
+ */
+static color
+ray_color(ray *ray, const hit_id *primary, int bounces, rng *rng)
+{
+	hit_info best;
+	color ret;
+	material *mat;
+	float c, n_dot_d, weight;
+	uint32_t depth;
+	int hit;
+
+	ret = (color) { 1.0, 1.0, 1.0 };
+	for (depth = 1; bounces > 0; bounces--, depth++) {
+		rng_set_bounce(rng, depth);
+
+		/*
+		 * on the last bounce a hit can only contribute by emitting
+		 * light, without emitters all that matters is whether the
+		 * background is visible
+		 */
+		if (depth == 1 && primary) {
+			hit = primary->t != INFINITY;
+			if (hit && bounces == 1 && !scene.has_emissive)
+				return (color) { 0.0, 0.0, 0.0 };
+			if (hit)
+				finalize_hit(ray, primary, &best);
+		} else if (bounces == 1 && !scene.has_emissive) {
+			if (occluded_scene(ray, INFINITY))
+				return (color) { 0.0, 0.0, 0.0 };
+			hit = 0;
+		} else {
+			hit = hit_scene(ray, &best);
+		}
+
+		if (!hit) {
+			color_mul(&ret, background(ray));
+			return ret;
+		}
+
+		mat = best.material;
+
+		color_mul(&ret, sample_texture(&mat->texture, best.u, best.v));
+
+		switch (mat->type) {
+		case DIFFUSE:
+			weight = importance_sample_diffuse(ray->d, rng);
+			n_dot_d = glm_vec4_dot(ray->d, best.normal);
+			if (n_dot_d < 0.0) {
+				return (color) { 0.0, 0.0, 0.0 };
+			}
+			color_muls(&ret, n_dot_d * weight);
+			break;
+		case SPECULAR:
+			c = 2 * glm_vec4_dot(ray->d, best.normal);
+			glm_vec4_mulsubs(best.normal, c, ray->d);
+			break;
+		case EMISSIVE:
+			return ret;
+		}
+
+		glm_vec4_copy(best.p, ray->origin);
+	}
+
+	return (color) { 0.0, 0.0, 0.0 };
+}
@@ -0,0 +1,27 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "color.h"
+
+#define TILE_SIZE 16
+
+typedef struct {
+	long width, height;
+	int samples, max_bounces;
+	int progressive;
+	double time_limit;
+	int snapshot_passes;
+	double snapshot_secs;
+	float noise_threshold;
+	int raster, wavefront;
+} render_opts;
+
+typedef void (*row_fn)(color *, long);
+typedef void (*frame_fn)(color *, unsigned int);
+
+int render_init(const render_opts *);
+void render(row_fn);
+void render_progressive(row_fn, frame_fn);
+void render_free(void);
+
+#endif /* RENDER_H */
@@ -0,0 +1,89 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+#define RNG_KEY_0 0x6d2b79f5u
+#define RNG_KEY_1 0x85ebca6bu
+
+/*
+ * counter-based random numbers. every draw is a pure function of (pixel,
+ * sample, bounce, dimension), so results don't depend on which thread renders
+ * a pixel or in which order. the counter is run through Philox4x32-10, which
+ * yields four dimensions at a time
+ */
+typedef struct {
+	uint32_t pixel, sample, bounce, dim;
+	uint32_t block[4];
+} rng;
+
+static inline void
+philox4x32(const uint32_t in[4], uint32_t out[4])
+{
+	uint32_t c0, c1, c2, c3, k0, k1;
+	uint64_t p0, p1;
+	int i;
+
+	c0 = in[0];
+	c1 = in[1];
+	c2 = in[2];
+	c3 = in[3];
+	k0 = RNG_KEY_0;
+	k1 = RNG_KEY_1;
+
+	for (i = 0; i < 10; i++) {
+		p0 = (uint64_t)0xd2511f53u * c0;
+		p1 = (uint64_t)0xcd9e8d57u * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c1 = (uint32_t)p1;
+		c3 = (uint32_t)p0;
+		k0 += 0x9e3779b9u;
+		k1 += 0xbb67ae85u;
+	}
+
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+static inline void
+rng_init(rng *r, uint32_t pixel, uint32_t sample)
+{
+	r->pixel = pixel;
+	r->sample = sample;
+	r->bounce = 0;
+	r->dim = 0;
+}
+
+static inline void
+rng_set_bounce(rng *r, uint32_t bounce)
+{
+	r->bounce = bounce;
+	r->dim = 0;
+}
+
+static inline uint32_t
+rng_next(rng *r)
+{
+	uint32_t ctr[4];
+
+	if ((r->dim & 3) == 0) {
+		ctr[0] = r->pixel;
+		ctr[1] = r->sample;
+		ctr[2] = r->bounce;
+		ctr[3] = r->dim >> 2;
+		philox4x32(ctr, r->block);
+	}
+	return r->block[r->dim++ & 3];
+}
+
+/* uniform in [0, 1) */
+static inline float
+rng_float(rng *r)
+{
+	return (float)(rng_next(r) >> 8) * 0x1p-24f;
+}
+
+#endif /* RNG_H */
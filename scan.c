@@ -0,0 +1,118 @@
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+
+/* every power of ten up to here is exact in a double */
+static const double exact_pow10[] = {
+	1e0,
+	1e1,
+	1e2,
+	1e3,
+	1e4,
+	1e5,
+	1e6,
+	1e7,
+	1e8,
+	1e9,
+	1e10,
+	1e11,
+	1e12,
+	1e13,
+	1e14,
+	1e15,
+	1e16,
+	1e17,
+	1e18,
+	1e19,
+	1e20,
+	1e21,
+	1e22,
+};
+
+#define MAX_EXACT_POW10 22
+#define MAX_EXACT_INT	(UINT64_C(1) << 53)
+#define MAX_DIGITS	19
+
+/*
+ * parses the decimal number in [s, s + len) the way strtof would in the C
+ * locale, returning 1 when it can't be sure of the result so the caller can
+ * fall back on strtof.
+ *
+ * with a mantissa under 2^53 and a power of ten under 10^23 both operands are
+ * exact doubles, so one multiply or divide gives the correctly rounded double
+ * (Clinger's fast path). rounding that to float is only ambiguous when the
+ * double lands exactly halfway between two floats, since every such midpoint
+ * is itself a double. that covers the short decimals scenes are written in
+ */
+int
+parse_float(const char *s, size_t len, float *out)
+{
+	const char *p, *end, *digits;
+	uint64_t w, bits;
+	int neg, n, exp, e, e_neg;
+	double d;
+
+	p = s;
+	end = s + len;
+	neg = p < end && *p == '-';
+	p += neg;
+
+	w = 0;
+	n = 0;
+	exp = 0;
+	digits = p;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		if (w == 0 && *p == '0')
+			continue;
+		if (++n > MAX_DIGITS)
+			return 1;
+		w = w * 10 + (*p - '0');
+	}
+	if (p < end && *p == '.') {
+		digits++;
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			exp--;
+			if (w == 0 && *p == '0')
+				continue;
+			if (++n > MAX_DIGITS)
+				return 1;
+			w = w * 10 + (*p - '0');
+		}
+	}
+	if (p == digits)
+		return 1;
+
+	if (p < end && *p == 'e') {
+		p++;
+		e_neg = p < end && *p == '-';
+		p += p < end && (*p == '-' || *p == '+');
+		if (p == end || *p < '0' || *p > '9')
+			return 1;
+		for (e = 0; p < end && *p >= '0' && *p <= '9'; p++)
+			if ((e = e * 10 + (*p - '0')) > 1000)
+				return 1;
+		exp += e_neg ? -e : e;
+	}
+	if (p != end)
+		return 1;
+
+	if (w == 0) {
+		*out = neg ? -0.0f : 0.0f;
+		return 0;
+	}
+	if (w > MAX_EXACT_INT || exp < -MAX_EXACT_POW10 ||
+	    exp > MAX_EXACT_POW10)
+		return 1;
+
+	d = exp < 0 ? w / exact_pow10[-exp] : w * exact_pow10[exp];
+	if (d < FLT_MIN || d > FLT_MAX)
+		return 1;
+	memcpy(&bits, &d, sizeof(bits));
+	if ((bits & ((UINT64_C(1) << 29) - 1)) == UINT64_C(1) << 28)
+		return 1;
+
+	*out = neg ? -(float)d : (float)d;
+	return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * helpers for the scene lexer. the scanners look at 16 bytes at a time where
+ * they can, but never read at or past lim, which may be the end of a mapping
+ */
+
+int parse_float(const char *, size_t, float *);
+
+static inline int
+is_number_char(char c)
+{
+	return (c >= '0' && c <= '9') || c == '.' || c == ',' || c == 'e' ||
+	    c == '-' || c == '+';
+}
+
+/* returns the first byte in [p, lim) that can't be part of a number */
+static inline const char *
+scan_number(const char *p, const char *lim)
+{
+#ifdef __SSE2__
+	__m128i c, m;
+	unsigned mask;
+
+	for (; lim - p >= 16; p += 16) {
+		c = _mm_loadu_si128((const __m128i *)p);
+		m = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+		    _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8('.')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8(',')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8('e')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8('-')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8('+')));
+		if ((mask = ~_mm_movemask_epi8(m) & 0xffff))
+			return p + __builtin_ctz(mask);
+	}
+#endif
+	while (p < lim && is_number_char(*p))
+		p++;
+	return p;
+}
+
+/* skips spaces, tabs and newlines, adding the newlines to *line */
+static inline const char *
+skip_blank(const char *p, const char *lim, size_t *line)
+{
+#ifdef __SSE2__
+	__m128i c, nl, m;
+	unsigned mask, nls;
+
+	for (; lim - p >= 16; p += 16) {
+		c = _mm_loadu_si128((const __m128i *)p);
+		nl = _mm_cmpeq_epi8(c, _mm_set1_epi8('\n'));
+		m = _mm_or_si128(nl, _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(c, _mm_set1_epi8('\t')));
+		mask = ~_mm_movemask_epi8(m) & 0xffff;
+		nls = _mm_movemask_epi8(nl);
+		if (mask) {
+			/* only count the newlines before the first other byte */
+			nls &= (mask & -mask) - 1;
+			*line += __builtin_popcount(nls);
+			return p + __builtin_ctz(mask);
+		}
+		*line += __builtin_popcount(nls);
+	}
+#endif
+	for (; p < lim; p++) {
+		if (*p == '\n')
+			++*line;
+		else if (*p != ' ' && *p != '\t')
+			break;
+	}
+	return p;
+}
+
+#endif /* SCAN_H */
@@ -1,26 +1,55 @@
 #include <ctype.h>
 #include <errno.h>
+#include <float.h>
 #include <stb_image.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
+#include "rng.h"
+#include "scan.h"
 #include "scene.h"
+#include "simd.h"
 #include "token.h"
 
-static void compute_bg_cdf(void);
+static int add_material(const material *);
+static int add_instance(const char *, size_t, mat4, uint16_t);
+static int add_plane(const plane *, uint16_t);
+static int add_sphere(const vec, float, uint16_t);
+static int reserve_spheres(size_t);
+static int build_accel(void);
+static int end_loop(void);
+static int parse_scene(float);
+static int skip_loop(void);
 
-static int parse_camera(camera *, float);
+static int parse_camera(camera_params *);
 static int parse_color(color *);
+static int parse_count(size_t *);
+static int parse_loop(int);
 static int parse_material(material *);
+static int parse_instance(uint16_t);
 static int parse_plane(plane *);
+static int parse_spheres(uint16_t);
 static int parse_texture(texture *);
+static int parse_transform(mat4);
 static int parse_vec(vec);
 
 #define TODO()                      \
 	fprintf(stderr, "todo!\n"); \
 	return 1;
 
-#define BUF_SIZE 4096
+/* initial size of the buffer input that can't be mapped is read into */
+#define BUF_SIZE 65536
+/* longest number token accepted */
+#define NUM_MAX 63
+/* spheres read from a binary file per fread */
+#define BULK_ROWS 4096
+/* deepest nesting of repeat and grid blocks */
+#define LOOP_MAX 16
+/* most variables a grid can run over */
+#define LOOP_DIMS 3
 
 static material default_material = {
 	.type = DIFFUSE,
@@ -42,73 +71,355 @@ static const char *token_types[] = {
 	"a material type",
 	"a number",
 	"a string",
+	"a name",
 	"EOF",
 	"ERROR",
 };
 
 extern char *prog_name;
 
-static char buf[BUF_SIZE], *tok, *cur, *lim;
-static int eof;
+static const char *tok, *cur, *lim;
+static char *input;
+static size_t input_size;
+static int input_mapped;
 static size_t line;
-static FILE *input;
 static token t, prev_token;
 
+/* a loop variable, which reads as a number while its loop runs */
+struct var {
+	const char *name;
+	size_t len;
+	float value;
+};
+
+/*
+ * an open repeat or grid block. the input is all in memory, so each pass
+ * just rewinds the lexer to the start of the body
+ */
+struct loop {
+	const char *body;
+	size_t body_line, line;
+	int dims;
+	size_t var[LOOP_DIMS], i[LOOP_DIMS], n[LOOP_DIMS];
+};
+
+/* the file each of scene.meshes was loaded from, while parsing */
+static char **mesh_paths;
+
+static struct var vars[LOOP_MAX * LOOP_DIMS];
+static size_t n_vars;
+static struct loop loops[LOOP_MAX];
+static size_t n_loops;
+/* set while an empty loop is skipped, expressions aren't evaluated */
+static int skipping;
+/* draws for rand() in expressions, the same on every load */
+static rng scene_rng;
+
+int scene_stats;
+int scene_lazy;
+
 struct scene scene;
 
+/*
+ * makes the whole input available at once. regular files are mapped and
+ * tokenized in place, anything else is read into a buffer that doubles as
+ * needed
+ */
 static int
-fill(void)
+read_input(FILE *in)
 {
-	size_t free, n;
+	struct stat st;
+	char *grown;
+	size_t cap, n;
+	void *p;
 
-	memmove(buf, tok, cur - tok);
-	cur -= tok - buf;
-	tok = buf;
-	free = sizeof(buf) - (cur - tok);
-	if (free <= 0) {
-		fprintf(stderr,
-		    "%s: token '%s' on line %zu exceeded max length (%u)\n",
-		    prog_name, cur, line, BUF_SIZE);
-		return 1;
+	input_mapped = 0;
+	if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > 0) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in),
+		    0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			input = p;
+			input_size = st.st_size;
+			input_mapped = 1;
+			return 0;
+		}
 	}
 
-	n = fread(cur, sizeof(char), free, input);
-	if (n < free && ferror(input)) {
+	cap = BUF_SIZE;
+	input_size = 0;
+	if (!(input = malloc(cap)))
+		goto nomem;
+	while ((n = fread(input + input_size, 1, cap - input_size, in)) > 0) {
+		input_size += n;
+		if (input_size < cap)
+			continue;
+		if (!(grown = realloc(input, cap * 2)))
+			goto nomem;
+		input = grown;
+		cap *= 2;
+	}
+	if (ferror(in)) {
 		fprintf(stderr, "%s: error reading input file\n", prog_name);
+		free(input);
 		return 1;
 	}
+	return 0;
+nomem:
+	fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+	free(input);
+	return 1;
+}
+
+static void
+release_input(void)
+{
+	if (input_mapped)
+		munmap(input, input_size);
+	else
+		free(input);
+	input = NULL;
+	input_size = 0;
+}
+
+/*
+ * tokens aren't terminated in the input, so numbers parse_float isn't sure of
+ * are copied out for strtof
+ */
+static token
+number_token(void)
+{
+	char num[NUM_MAX + 1], *end;
+	size_t len;
+	token ret;
+
+	len = cur - tok;
+	ret = (token) { NUMBER };
+	if (parse_float(tok, len, &ret.f) == 0)
+		return ret;
+
+	if (len > NUM_MAX) {
+		fprintf(stderr, "%s: invalid number '%.*s' on line %zu\n",
+		    prog_name, (int)len, tok, line);
+		return (token) { ERROR };
+	}
+	memcpy(num, tok, len);
+	num[len] = 0;
+
+	errno = 0;
+	ret.f = strtof(num, &end);
+	if (errno) {
+		fprintf(stderr, "%s: error on line %zu: %s\n", prog_name, line,
+		    strerror(errno));
+		return (token) { ERROR };
+	} else if (end != num + len) {
+		fprintf(stderr, "%s: invalid number '%s' on line %zu\n",
+		    prog_name, num, line);
+		return (token) { ERROR };
+	}
+	return ret;
+}
+
+static const struct var *
+find_var(const char *name, size_t len)
+{
+	size_t i;
 
-	lim = cur + n;
+	for (i = n_vars; i-- > 0;)
+		if (vars[i].len == len && memcmp(vars[i].name, name, len) == 0)
+			return &vars[i];
+	return NULL;
+}
+
+static const struct {
+	const char *name;
+	float (*fn)(float);
+} functions[] = {
+	{ "abs", fabsf },
+	{ "cos", cosf },
+	{ "floor", floorf },
+	{ "sin", sinf },
+	{ "sqrt", sqrtf },
+};
+
+static int expr_sum(float *);
 
-	eof = feof(input);
+static int
+expr_error(const char *what)
+{
+	fprintf(stderr, "%s: %s in expression on line %zu\n", prog_name, what,
+	    line);
+	return 1;
+}
 
+static int
+expr_expect(char c)
+{
+	cur = skip_blank(cur, lim, &line);
+	if (cur == lim || *cur != c) {
+		fprintf(stderr, "%s: expected '%c' in expression on line %zu\n",
+		    prog_name, c, line);
+		return 1;
+	}
+	cur++;
 	return 0;
 }
 
+/* a number, variable, function call, parenthesized or negated expression */
+static int
+expr_primary(float *out)
+{
+	const char *name, *saved;
+	const struct var *v;
+	token num;
+	size_t len, i;
+
+	cur = skip_blank(cur, lim, &line);
+	if (cur == lim)
+		return expr_error("unexpected end of input");
+
+	switch (*cur) {
+	case '(':
+		cur++;
+		if (expr_sum(out) != 0)
+			return 1;
+		return expr_expect(')');
+	case '-':
+		cur++;
+		if (expr_primary(out) != 0)
+			return 1;
+		*out = -*out;
+		return 0;
+	case '.':
+	case '0' ... '9':
+		/* signs only follow an exponent here, others are operators */
+		saved = tok;
+		tok = cur;
+		while (cur < lim && (isdigit(*cur) || *cur == '.'))
+			cur++;
+		if (cur < lim && *cur == 'e') {
+			cur++;
+			if (cur < lim && (*cur == '-' || *cur == '+'))
+				cur++;
+			while (cur < lim && isdigit(*cur))
+				cur++;
+		}
+		num = number_token();
+		tok = saved;
+		if (num.type == ERROR)
+			return 1;
+		*out = num.f;
+		return 0;
+	case 'a' ... 'z':
+	case 'A' ... 'Z':
+		name = cur;
+		while (cur < lim && isalpha(*cur))
+			cur++;
+		len = cur - name;
+		if ((v = find_var(name, len))) {
+			*out = v->value;
+			return 0;
+		}
+		if (len == 4 && memcmp(name, "rand", 4) == 0) {
+			*out = rng_float(&scene_rng);
+			return expr_expect('(') || expr_expect(')');
+		}
+		for (i = 0; i < sizeof(functions) / sizeof(*functions); i++) {
+			if (strlen(functions[i].name) != len ||
+			    memcmp(functions[i].name, name, len) != 0)
+				continue;
+			if (expr_expect('(') != 0 || expr_sum(out) != 0 ||
+			    expr_expect(')') != 0)
+				return 1;
+			*out = functions[i].fn(*out);
+			return 0;
+		}
+		fprintf(stderr,
+		    "%s: unknown name '%.*s' in expression on line %zu\n",
+		    prog_name, (int)len, name, line);
+		return 1;
+	}
+	return expr_error("expected a value");
+}
+
+static int
+expr_product(float *out)
+{
+	float rhs;
+	char op;
+
+	if (expr_primary(out) != 0)
+		return 1;
+	for (;;) {
+		cur = skip_blank(cur, lim, &line);
+		if (cur == lim || (*cur != '*' && *cur != '/' && *cur != '%'))
+			return 0;
+		op = *cur++;
+		if (expr_primary(&rhs) != 0)
+			return 1;
+		if (op == '*')
+			*out *= rhs;
+		else if (op == '/')
+			*out /= rhs;
+		else
+			*out = fmodf(*out, rhs);
+	}
+}
+
 static int
-isnumeric(char c)
+expr_sum(float *out)
 {
-	return isdigit(c) || c == '.' || c == ',' || c == 'e' || c == '-' ||
-	    c == '+';
+	float rhs;
+	char op;
+
+	if (expr_product(out) != 0)
+		return 1;
+	for (;;) {
+		cur = skip_blank(cur, lim, &line);
+		if (cur == lim || (*cur != '+' && *cur != '-'))
+			return 0;
+		op = *cur++;
+		if (expr_product(&rhs) != 0)
+			return 1;
+		*out = op == '+' ? *out + rhs : *out - rhs;
+	}
 }
 
-#define CONSUME_WHILE(p)                                  \
-	while (p) {                                       \
-		if (cur == lim) {                         \
-			if (eof)                          \
-				break;                    \
-			if (fill() != 0)                  \
-				return (token) { ERROR }; \
-		}                                         \
-		cur++;                                    \
+/*
+ * evaluates an expression in square brackets, which can stand in for any
+ * number. cur is just past the '['
+ */
+static token
+expr_token(void)
+{
+	const char *start;
+	token ret;
+
+	start = cur - 1;
+	ret = (token) { NUMBER, .f = 0.0f };
+	if (skipping) {
+		while (cur < lim && *cur != ']')
+			line += *cur++ == '\n';
+		if (cur == lim) {
+			fprintf(stderr, "%s: unclosed '[' on line %zu\n",
+			    prog_name, line);
+			return (token) { ERROR };
+		}
+		cur++;
+	} else if (expr_sum(&ret.f) != 0 || expr_expect(']') != 0) {
+		return (token) { ERROR };
 	}
+	tok = start;
+	return ret;
+}
 
 static token
 next_token()
 {
-	char *end;
 	token ret;
 	struct keyword_set *kw;
+	const struct var *v;
 
 	if (prev_token.type != ERROR) {
 		ret = prev_token;
@@ -117,66 +428,49 @@ next_token()
 	}
 
 loop:
-	if (cur == lim) {
-		if (eof) {
-			return (token) { END };
-		}
-		if (fill() != 0) {
-			return (token) { ERROR };
-		}
-	}
+	cur = skip_blank(cur, lim, &line);
+	tok = cur;
+	if (cur == lim)
+		return (token) { END };
 
 	switch (*cur++) {
 	case '#':
-		CONSUME_WHILE(*cur != '\n');
-		cur++;
-	case '\n':
-		line++;
-	case ' ':
-	case '\t':
+		if (!(cur = memchr(cur, '\n', lim - cur)))
+			cur = lim;
 		goto loop;
 	case '(':
 		return (token) { LPAREN };
 	case ')':
 		return (token) { RPAREN };
+	case '[':
+		return expr_token();
 	case '"':
 		tok = cur;
-		CONSUME_WHILE(*cur != '"' && *cur != '\n');
-		if (*cur == '\n') {
+		while (cur < lim && *cur != '"' && *cur != '\n')
+			cur++;
+		if (cur == lim || *cur == '\n') {
 			fprintf(stderr, "%s: unclosed string on line %zu\n",
 			    prog_name, line);
 			return (token) { ERROR };
 		}
-		*cur = 0;
+		ret = (token) { STRING, .str = tok, .len = cur - tok };
 		cur++;
-		return (token) { STRING, .str = tok };
+		return ret;
 	case '-':
 	case '0' ... '9':
 		tok = cur - 1;
-		CONSUME_WHILE(isnumeric(*cur));
-		ret = (token) { NUMBER };
-		errno = 0;
-		ret.f = strtof(tok, &end);
-		if (errno) {
-			fprintf(stderr, "%s: error on line %zu: %s\n",
-			    prog_name, line, strerror(errno));
-			return (token) { ERROR };
-		} else if (end != cur) {
-			*cur = 0;
-			fprintf(stderr, "%s: invalid number '%s' on line %zu\n",
-			    prog_name, tok, line);
-			return (token) { ERROR };
-		}
-		return ret;
+		cur = scan_number(cur, lim);
+		return number_token();
 	case 'a' ... 'z':
 	case 'A' ... 'Z':
 		tok = cur - 1;
-		CONSUME_WHILE(isalpha(*cur));
+		while (cur < lim && isalpha(*cur))
+			cur++;
 		if ((kw = get_keyword(tok, cur - tok)))
 			return kw->token;
-		*cur = 0;
-		fprintf(stderr, "%s: unknown token '%s' on line %zu\n",
-		    prog_name, tok, line);
+		if ((v = find_var(tok, cur - tok)))
+			return (token) { NUMBER, .f = v->value };
+		return (token) { IDENT, .str = tok, .len = cur - tok };
 	}
 
 	fprintf(stderr, "%s: unexpected character %c on line %zu\n", prog_name,
@@ -189,9 +483,10 @@ loop:
 	if ((t = next_token()).type != (ty)) {                             \
 		if (t.type == ERROR)                                       \
 			return 1;                                          \
-		*cur = 0;                                                  \
-		fprintf(stderr, "%s: expected %s on line %zu, got '%s'\n", \
-		    prog_name, token_types[ty], line, tok);                \
+		fprintf(stderr,                                            \
+		    "%s: expected %s on line %zu, got '%.*s'\n",           \
+		    prog_name, token_types[ty], line, (int)(cur - tok),    \
+		    tok);                                                  \
 		return 1;                                                  \
 	}
 
@@ -208,16 +503,15 @@ loop:
 		return 1;                  \
 	}
 
-#define CONSUME_FLOAT()                                              \
-	(t = next_token()).f;                                        \
-	if (t.type != NUMBER) {                                      \
-		if (t.type == ERROR)                                 \
-			return 1;                                    \
-		*cur = 0;                                            \
-		fprintf(stderr,                                      \
-		    "%s: on line %zu expected a number, got '%s'\n", \
-		    prog_name, line, tok);                           \
-		return 1;                                            \
+#define CONSUME_FLOAT()                                                \
+	(t = next_token()).f;                                          \
+	if (t.type != NUMBER) {                                        \
+		if (t.type == ERROR)                                   \
+			return 1;                                      \
+		fprintf(stderr,                                        \
+		    "%s: on line %zu expected a number, got '%.*s'\n", \
+		    prog_name, line, (int)(cur - tok), tok);           \
+		return 1;                                              \
 	}
 
 #define CONSUME_FLOAT_OPTIONAL()     \
@@ -228,31 +522,122 @@ loop:
 		prev_token = t;      \
 		return 0;            \
 	}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * parses the scene and builds its acceleration structures. with scene_lazy
+ * set only their top levels are built here. with scene_stats set, the time
+ * spent on each is reported
+ */
 int
 load_scene(FILE *in, float aspect_ratio)
 {
-	int bg_done;
-	material *cur_material;
+	double start, parsed, built;
+	size_t size, i, n_tris, n_nodes, n_lazy, mesh_bytes;
+	int ret;
 
-	tok = cur = lim = buf;
-	eof = 0;
+	start = now();
+	if (read_input(in) != 0)
+		return 1;
+	tok = cur = input;
+	lim = input + input_size;
+	size = input_size;
 	line = 1;
+	prev_token.type = ERROR;
+	n_vars = 0;
+	n_loops = 0;
+	skipping = 0;
+	rng_init(&scene_rng, 0, 0);
 
-	input = in;
+	ret = parse_scene(aspect_ratio);
+	release_input();
+	for (i = 0; i < scene.n_meshes; i++)
+		free(mesh_paths[i]);
+	free(mesh_paths);
+	mesh_paths = NULL;
+	if (ret != 0)
+		return 1;
 
-	prev_token.type = ERROR;
+	parsed = now();
+	if (build_accel() != 0)
+		return 1;
+	built = now();
+
+	if (scene_stats) {
+		n_tris = 0;
+		n_nodes = scene.bvh.n_nodes + scene.instance_bvh.n_nodes;
+		n_lazy = scene.bvh.n_lazy;
+		mesh_bytes = 0;
+		for (i = 0; i < scene.n_meshes; i++) {
+			n_tris += scene.meshes[i].geom.n_tris;
+			n_nodes += scene.meshes[i].bvh.n_nodes;
+			n_lazy += scene.meshes[i].bvh.n_lazy;
+			mesh_bytes += scene.meshes[i].geom.n_tris *
+			        sizeof(packed_tri) +
+			    scene.meshes[i].geom.n_verts *
+			        sizeof(*scene.meshes[i].geom.verts);
+		}
+		fprintf(stderr,
+		    "%s: parsed %zu bytes in %.3fs (%.1f MB/s), %zu spheres,"
+		    " %zu planes, %zu triangles, %zu materials\n",
+		    prog_name, size, parsed - start,
+		    size / (parsed - start) * 1e-6, scene.spheres.n,
+		    scene.planes.n, n_tris, scene.n_materials);
+		fprintf(stderr,
+		    "%s: built BVHs with %zu nodes (%.1f MB) in %.3fs\n",
+		    prog_name, n_nodes, n_nodes * sizeof(bvh_node) * 1e-6,
+		    built - parsed);
+		if (n_lazy > 0)
+			fprintf(stderr,
+			    "%s: %zu subtrees left until a ray reaches them\n",
+			    prog_name, n_lazy);
+		if (n_tris > 0)
+			fprintf(stderr,
+			    "%s: mesh geometry takes %.1f MB, %.1f bytes per"
+			    " triangle, shared by %zu instances\n",
+			    prog_name, mesh_bytes * 1e-6,
+			    (double)mesh_bytes / n_tris, scene.n_instances);
+	}
+	return 0;
+}
+
+static int
+parse_scene(float aspect_ratio)
+{
+	int bg_done;
+	uint16_t cur_material;
+	material mat;
+	plane plane;
+	vec center;
+	float r;
 
 	bg_done = 0;
-	scene.cur_shape = 0;
+	scene.spheres.n = 0;
+	scene.planes.n = 0;
+	scene.n_materials = 0;
+	scene.n_meshes = 0;
+	scene.n_instances = 0;
+	scene.has_emissive = 0;
 
-	cur_material = &default_material;
-	scene.materials = &default_material;
+	if (add_material(&default_material) != 0)
+		return 1;
+	cur_material = 0;
 loop:
 	switch ((t = next_token()).type) {
 	case KEYWORD:
 		switch (t.k) {
 		case CAMERA:
-			PARSE(camera, &scene.camera, aspect_ratio);
+			PARSE(camera, &scene.camera_params);
+			camera_setup(&scene.camera, &scene.camera_params,
+			    aspect_ratio);
 			break;
 		case BACKGROUND:
 			if (bg_done) {
@@ -262,277 +647,1978 @@ loop:
 				return 1;
 			}
 			PARSE(texture, &scene.bg.tex);
-			compute_bg_cdf();
+			if (envmap_build(&scene.bg.map, &scene.bg.tex) != 0)
+				return 1;
 			bg_done = 1;
 			break;
 		case MATERIAL:
-			cur_material->next = malloc(sizeof(material));
-			if (!cur_material->next) {
-				fprintf(stderr,
-				    "%s: memory allocation failed\n",
-				    prog_name);
+			PARSE(material, &mat);
+			if (add_material(&mat) != 0)
+				return 1;
+			cur_material = scene.n_materials - 1;
+			break;
+		case SPHERES:
+			PARSE(spheres, cur_material);
+			break;
+		case MESH:
+		case INSTANCE:
+			PARSE(instance, cur_material);
+			break;
+		case REPEAT:
+			PARSE(loop, 1);
+			break;
+		case GRID:
+			PARSE(loop, LOOP_DIMS);
+			break;
+		case KW_END:
+			if (end_loop() != 0)
 				return 1;
-			}
-			cur_material = cur_material->next;
-			cur_material->next = NULL;
-			PARSE(material, cur_material);
 			break;
 		default:
 			goto fail;
 		}
 		break;
 	case SHAPE_TYPE:
-		scene.shapes[scene.cur_shape].type = t.s;
-		scene.shapes[scene.cur_shape].material = cur_material;
 		switch (t.s) {
 		case PLANE:
-			PARSE(plane, &scene.shapes[scene.cur_shape].p);
+			PARSE(plane, &plane);
+			if (add_plane(&plane, cur_material) != 0)
+				return 1;
 			break;
 		case SPHERE:
-			PARSE(vec, scene.shapes[scene.cur_shape].s.center);
-			scene.shapes[scene.cur_shape].s.r = CONSUME_FLOAT();
+			PARSE(vec, center);
+			r = CONSUME_FLOAT();
+			if (add_sphere(center, r, cur_material) != 0)
+				return 1;
 			break;
+		case TRIANGLE:
+			/* triangles only come from meshes */
+			goto fail;
 		}
-		scene.cur_shape++;
 		break;
 	default:
 	fail:
-		*cur = 0;
 		fprintf(stderr,
 		    "%s: on line %zu expected a material, camera, shape or"
-		    " background definition, got '%s'\n",
-		    prog_name, line, tok);
+		    " background definition, got '%.*s'\n",
+		    prog_name, line, (int)(cur - tok), tok);
 	case ERROR:
 		return 1;
 	case END:
+		if (n_loops > 0) {
+			fprintf(stderr,
+			    "%s: loop on line %zu is missing its 'end'\n",
+			    prog_name, loops[n_loops - 1].line);
+			return 1;
+		}
 		return 0;
 	}
 
 	goto loop;
 }
 
+/*
+ * a repeat block runs its body once for each value of one variable, a grid
+ * for each combination of up to LOOP_DIMS, the last varying fastest:
+ *
+ *	grid i 10 j 10
+ *		sphere ([i * 0.5] 0 j) [0.2 + 0.1 * rand()]
+ *	end
+ */
 static int
-parse_camera(camera *out, float aspect_ratio)
+parse_loop(int max_dims)
 {
-	vec look, look_at, up;
-	float fov, vw, vh;
-
-	PARSE(vec, out->eye);
-	PARSE(vec, look_at);
-	PARSE(vec, up);
-	fov = CONSUME_FLOAT();
-	fov *= GLM_PI / 180.0;
-
-	glm_vec4_sub(look_at, out->eye, look);
-
-	vh = fabsf(atanf(fov / 2.0)) * glm_vec4_norm(look) * 2.0;
-	vw = vh * aspect_ratio;
-
-	glm_vec3_proj(up, look, out->down);
-	glm_vec4_sub(out->down, up, out->down);
-	glm_vec4_scale_as(out->down, vh, out->down);
+	struct loop *l;
+	size_t n;
+	int empty;
 
-	glm_vec3_cross(look, out->down, out->right);
-	glm_vec4_scale_as(out->right, vw, out->right);
-
-	glm_vec4_copy(look_at, out->upper_left);
-	glm_vec4_mulsubs(out->down, 0.5, out->upper_left);
-	glm_vec4_mulsubs(out->right, 0.5, out->upper_left);
+	if (n_loops == LOOP_MAX) {
+		fprintf(stderr,
+		    "%s: loops nested too deeply on line %zu (max %d)\n",
+		    prog_name, line, LOOP_MAX);
+		return 1;
+	}
+	l = &loops[n_loops];
+	l->line = line;
+	l->dims = 0;
+	empty = 0;
+	while (l->dims < max_dims) {
+		if ((t = next_token()).type != IDENT) {
+			if (t.type == ERROR)
+				return 1;
+			if (l->dims > 0) {
+				/* the body starts here, lex it again */
+				cur = tok;
+				break;
+			}
+			fprintf(stderr,
+			    "%s: expected a loop variable on line %zu, got"
+			    " '%.*s'\n",
+			    prog_name, line, (int)(cur - tok), tok);
+			return 1;
+		}
+		vars[n_vars] = (struct var) { t.str, t.len, 0.0f };
+		PARSE(count, &n);
+		l->var[l->dims] = n_vars++;
+		l->i[l->dims] = 0;
+		l->n[l->dims] = n;
+		l->dims++;
+		empty |= n == 0;
+	}
+	n_loops++;
 
+	if (empty)
+		return skip_loop();
+	l->body = cur;
+	l->body_line = line;
 	return 0;
 }
 
+/* steps the innermost loop, rewinding to its body until it's done */
 static int
-parse_material(material *out)
+end_loop(void)
 {
-	CONSUME(MATERIAL_TYPE);
-	out->type = t.m;
-	PARSE(texture, &out->texture);
+	struct loop *l;
+	int d;
+
+	if (n_loops == 0) {
+		fprintf(stderr, "%s: 'end' without a loop on line %zu\n",
+		    prog_name, line);
+		return 1;
+	}
+	l = &loops[n_loops - 1];
+	for (d = l->dims - 1; d >= 0; d--) {
+		if (++l->i[d] < l->n[d]) {
+			vars[l->var[d]].value = l->i[d];
+			cur = l->body;
+			line = l->body_line;
+			return 0;
+		}
+		l->i[d] = 0;
+		vars[l->var[d]].value = 0.0f;
+	}
+	n_vars -= l->dims;
+	n_loops--;
 	return 0;
 }
 
+/* passes over the body of a loop that runs no times */
 static int
-parse_texture(texture *out)
+skip_loop(void)
 {
-	switch ((t = next_token()).type) {
-	case KEYWORD:
-		if (t.k == BLACKBODY) {
-			goto solid;
-		} else if (t.k != KW_CHECKS)
-			goto fail;
-		out->type = CHECKS;
-		out->checks.scale = CONSUME_FLOAT();
-		PARSE(color, &out->checks.c1);
-		PARSE(color, &out->checks.c2);
-		break;
-	case NUMBER:
-	solid:
-		prev_token = t;
-		out->type = SOLID;
-		PARSE(color, &out->solid);
-		break;
-	case STRING:
-		out->type = IMAGE;
-		out->image.data = stbi_loadf(t.str, &out->image.width,
-		    &out->image.height, &out->image.n_channels, 0);
-		if (out->image.data == NULL) {
+	size_t depth;
+
+	skipping = 1;
+	for (depth = 1; depth > 0;) {
+		t = next_token();
+		if (t.type == END || t.type == ERROR)
+			break;
+		if (t.type != KEYWORD)
+			continue;
+		if (t.k == REPEAT || t.k == GRID)
+			depth++;
+		else if (t.k == KW_END)
+			depth--;
+	}
+	skipping = 0;
+
+	if (depth > 0) {
+		if (t.type == END)
 			fprintf(stderr,
-			    "%s: image file '%s' is corrupt or missing\n",
-			    prog_name, t.str);
-			return 1;
-		}
-		break;
-	default:
-	fail:
-		*cur = 0;
-		fprintf(stderr,
-		    "%s: expected a texture on line %zu, got '%s'\n", prog_name,
-		    line, tok);
-	case ERROR:
+			    "%s: loop on line %zu is missing its 'end'\n",
+			    prog_name, loops[n_loops - 1].line);
 		return 1;
 	}
+	n_vars -= loops[n_loops - 1].dims;
+	n_loops--;
 	return 0;
 }
 
+/*
+ * grows arr from old to cap elements plus the VWIDTH - 1 slack entries the
+ * intersection kernels may read, zeroing the new entries
+ */
+static void *
+grow(void *arr, size_t size, size_t old, size_t cap)
+{
+	char *grown;
+	size_t used;
+
+	used = old ? old + VWIDTH - 1 : 0;
+	grown = realloc(arr, size * (cap + VWIDTH - 1));
+	if (!grown) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		return NULL;
+	}
+	memset(grown + size * used, 0, size * (cap + VWIDTH - 1 - used));
+	return grown;
+}
+
+#define GROW(arr, old, cap) \
+	((grown = grow(arr, sizeof(*(arr)), old, cap)) && ((arr) = grown))
+
 static int
-parse_color(color *out)
+add_material(const material *mat)
 {
-	t = next_token();
-	switch (t.type) {
-	case KEYWORD:
-		if (t.k != BLACKBODY)
-			goto fail;
-		TODO();
-		break;
-	case NUMBER:
-		out->r = t.f;
-		out->g = CONSUME_FLOAT();
-		out->b = CONSUME_FLOAT();
-		break;
-	default:
-	fail:
-		*cur = 0;
-		fprintf(stderr, "%s: expected a color on line %zu, got '%s'\n",
-		    prog_name, line, tok);
-	case ERROR:
+	void *grown;
+	size_t cap;
+
+	if (scene.n_materials > UINT16_MAX) {
+		fprintf(stderr, "%s: too many materials on line %zu (max %u)\n",
+		    prog_name, line, UINT16_MAX + 1);
 		return 1;
 	}
+	if (scene.n_materials == scene.cap_materials) {
+		cap = scene.cap_materials ? scene.cap_materials * 2 : 16;
+		if (!GROW(scene.materials, scene.cap_materials, cap))
+			return 1;
+		scene.cap_materials = cap;
+	}
+	if (mat->type == EMISSIVE)
+		scene.has_emissive = 1;
+	scene.materials[scene.n_materials++] = *mat;
 	return 0;
 }
 
+/* planes are unbounded and go in their own list, spheres are put in the BVH */
 static int
-parse_plane(plane *out)
+add_plane(const plane *plane, uint16_t material)
 {
+	plane_list *p;
+	void *grown;
+	size_t cap;
 
-	PARSE(vec, out->normal);
-	glm_vec4_normalize(out->normal);
-	out->d = CONSUME_FLOAT();
-	glm_vec4_scale(out->normal, out->d, out->center);
-	glm_vec3_cross(out->normal, vec_i, out->u);
-	if (glm_vec4_norm2(out->u) < epsilon) {
-		glm_vec3_cross(out->normal, vec_j, out->u);
+	p = &scene.planes;
+	if (p->n == p->cap) {
+		cap = p->cap ? p->cap * 2 : 16;
+		if (!GROW(p->x, p->cap, cap) ||
+		    !GROW(p->y, p->cap, cap) ||
+		    !GROW(p->z, p->cap, cap) ||
+		    !GROW(p->d, p->cap, cap) ||
+		    !GROW(p->u, p->cap, cap) ||
+		    !GROW(p->v, p->cap, cap) ||
+		    !GROW(p->material, p->cap, cap))
+			return 1;
+		p->cap = cap;
 	}
-	glm_vec4_normalize(out->u);
-	glm_vec3_cross(out->normal, out->u, out->v);
 
+	p->x[p->n] = plane->normal[0];
+	p->y[p->n] = plane->normal[1];
+	p->z[p->n] = plane->normal[2];
+	p->d[p->n] = plane->d;
+	glm_vec4_copy((float *)plane->u, p->u[p->n]);
+	glm_vec4_copy((float *)plane->v, p->v[p->n]);
+	p->material[p->n] = material;
+	p->n++;
 	return 0;
 }
 
+/*
+ * places the mesh loaded from path with the given transform. each file is
+ * only loaded once, later instances share its geometry
+ */
 static int
-parse_vec(vec out)
+add_instance(const char *path, size_t len, mat4 to_world, uint16_t material)
 {
-	CONSUME(LPAREN);
-	out[0] = CONSUME_FLOAT();
-	out[1] = CONSUME_FLOAT();
-	out[2] = CONSUME_FLOAT();
-	CONSUME(RPAREN);
-	return 0;
-}
+	instance *inst;
+	mat4 to_object;
+	void *grown;
+	size_t i, cap;
 
-static void
-compute_bg_cdf()
-{
-	size_t x, y, width, height;
-	float u, v, total, row_total, sample;
+	for (i = 0; i < scene.n_meshes; i++)
+		if (strlen(mesh_paths[i]) == len &&
+		    memcmp(mesh_paths[i], path, len) == 0)
+			break;
 
-	switch (scene.bg.tex.type) {
-	case CHECKS:
-		width = scene.bg.tex.checks.scale;
-		height = scene.bg.tex.checks.scale;
+	if (i == scene.n_meshes) {
+		if (scene.n_meshes == UINT32_MAX) {
+			fprintf(stderr, "%s: too many meshes on line %zu\n",
+			    prog_name, line);
+			return 1;
+		}
+		if (scene.n_meshes == scene.cap_meshes) {
+			cap = scene.cap_meshes ? scene.cap_meshes * 2 : 4;
+			if (!GROW(scene.meshes, scene.cap_meshes, cap) ||
+			    !GROW(mesh_paths, scene.cap_meshes, cap))
+				return 1;
+			scene.cap_meshes = cap;
+		}
+		if (!(mesh_paths[i] = strndup(path, len))) {
+			fprintf(stderr, "%s: memory allocation failed\n",
+			    prog_name);
+			return 1;
+		}
+		if (mesh_load(&scene.meshes[i], mesh_paths[i]) != 0) {
+			free(mesh_paths[i]);
+			return 1;
+		}
+		scene.n_meshes++;
+	}
+
+	if (scene.n_instances == scene.cap_instances) {
+		cap = scene.cap_instances ? scene.cap_instances * 2 : 16;
+		if (!GROW(scene.instances, scene.cap_instances, cap))
+			return 1;
+		scene.cap_instances = cap;
+	}
+	glm_mat4_inv(to_world, to_object);
+	inst = &scene.instances[scene.n_instances++];
+	glm_mat4_ucopy(to_world, inst->to_world);
+	glm_mat4_ucopy(to_object, inst->to_object);
+	inst->mesh = i;
+	inst->material = material;
+	return 0;
+}
+
+/* makes room for at least cap spheres */
+static int
+reserve_spheres(size_t cap)
+{
+	sphere_list *s;
+	void *grown;
+
+	s = &scene.spheres;
+	if (cap <= s->cap)
+		return 0;
+	if (!GROW(s->x, s->cap, cap) ||
+	    !GROW(s->y, s->cap, cap) ||
+	    !GROW(s->z, s->cap, cap) ||
+	    !GROW(s->r, s->cap, cap) ||
+	    !GROW(s->material, s->cap, cap))
+		return 1;
+	s->cap = cap;
+	return 0;
+}
+
+static int
+add_sphere(const vec center, float r, uint16_t material)
+{
+	sphere_list *s;
+
+	s = &scene.spheres;
+	if (s->n == s->cap && reserve_spheres(s->cap ? s->cap * 2 : 16) != 0)
+		return 1;
+
+	s->x[s->n] = center[0];
+	s->y[s->n] = center[1];
+	s->z[s->n] = center[2];
+	s->r[s->n] = r;
+	s->material[s->n] = material;
+	s->n++;
+	return 0;
+}
+
+/* returns a copy of arr with its elements in the given order, frees arr */
+static void *
+permute(void *arr, size_t size, const uint32_t *order, size_t n)
+{
+	char *src, *dst;
+	size_t i;
+
+	if (!(dst = calloc(n + VWIDTH - 1, size))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		return NULL;
+	}
+	src = arr;
+	for (i = 0; i < n; i++)
+		memcpy(dst + i * size, src + order[i] * size, size);
+	free(arr);
+	return dst;
+}
+
+#define PERMUTE(arr, order, n) \
+	((grown = permute(arr, sizeof(*(arr)), order, n)) && ((arr) = grown))
+
+static void
+sphere_boxes(void *ctx, uint32_t begin, uint32_t end, aabb *out)
+{
+	sphere_list *s;
+	uint32_t i;
+	float r;
+
+	(void)ctx;
+
+	s = &scene.spheres;
+	for (i = begin; i < end; i++, out++) {
+		r = fabsf(s->r[i]);
+		out->min[0] = s->x[i] - r;
+		out->min[1] = s->y[i] - r;
+		out->min[2] = s->z[i] - r;
+		out->max[0] = s->x[i] + r;
+		out->max[1] = s->y[i] + r;
+		out->max[2] = s->z[i] + r;
+	}
+}
+
+/* puts n elements of arr from begin in order, through tmp */
+static void
+permute_range(void *arr, size_t size, uint32_t begin, const uint32_t *order,
+    uint32_t n, void *tmp)
+{
+	char *base;
+	uint32_t i;
+
+	base = (char *)arr + begin * size;
+	memcpy(tmp, base, n * size);
+	for (i = 0; i < n; i++)
+		memcpy(base + i * size, (char *)tmp + order[i] * size, size);
+}
+
+static int
+sphere_reorder(void *ctx, uint32_t begin, const uint32_t *order, uint32_t n)
+{
+	sphere_list *s;
+	float *tmp;
+
+	(void)ctx;
+
+	if (!(tmp = malloc(sizeof(*tmp) * n))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		return 1;
+	}
+	s = &scene.spheres;
+	permute_range(s->x, sizeof(*s->x), begin, order, n, tmp);
+	permute_range(s->y, sizeof(*s->y), begin, order, n, tmp);
+	permute_range(s->z, sizeof(*s->z), begin, order, n, tmp);
+	permute_range(s->r, sizeof(*s->r), begin, order, n, tmp);
+	permute_range(s->material, sizeof(*s->material), begin, order, n,
+	    tmp);
+	free(tmp);
+	return 0;
+}
+
+/* where deferred subtrees of the sphere BVH get their spheres */
+static const bvh_source sphere_source = { sphere_boxes, sphere_reorder };
+
+/*
+ * builds the top level BVH over the world bounds of the instances, taken
+ * from the corners of each mesh's root box. instances of empty meshes are
+ * dropped
+ */
+static int
+build_instances(void)
+{
+	instance *inst;
+	aabb *boxes, root;
+	uint32_t *order;
+	void *grown;
+	vec corner, p;
+	size_t i, n;
+	int c, k, ret;
+
+	for (i = 0, n = 0; i < scene.n_instances; i++)
+		if (scene.meshes[scene.instances[i].mesh].bvh.n_nodes > 0)
+			scene.instances[n++] = scene.instances[i];
+	scene.n_instances = n;
+	if (n == 0) {
+		scene.instance_bvh.nodes = NULL;
+		scene.instance_bvh.n_nodes = 0;
+		return 0;
+	}
+
+	boxes = malloc(sizeof(*boxes) * n);
+	order = malloc(sizeof(*order) * n);
+	if (!boxes || !order) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		free(boxes);
+		free(order);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		inst = &scene.instances[i];
+		bvh_bounds(&scene.meshes[inst->mesh].bvh, &root);
+		aabb_empty(&boxes[i]);
+		for (c = 0; c < 8; c++) {
+			for (k = 0; k < 3; k++)
+				corner[k] = c & (1 << k) ? root.max[k] :
+							   root.min[k];
+			corner[3] = 1.0f;
+			glm_mat4_mulv(inst->to_world, corner, p);
+			for (k = 0; k < 3; k++) {
+				boxes[i].min[k] = glm_min(boxes[i].min[k], p[k]);
+				boxes[i].max[k] = glm_max(boxes[i].max[k], p[k]);
+			}
+		}
+	}
+
+	ret = bvh_build(&scene.instance_bvh, boxes, order, n, 0) != 0 ||
+	    !PERMUTE(scene.instances, order, n);
+	scene.cap_instances = n;
+
+	free(boxes);
+	free(order);
+	return ret;
+}
+
+/*
+ * builds each mesh and the instance BVH over them, then the sphere BVH, and
+ * puts the spheres in the order its leaves refer to
+ */
+static int
+build_accel(void)
+{
+	sphere_list *s;
+	aabb *boxes;
+	uint32_t *order;
+	void *grown;
+	size_t i, n;
+	int ret;
+
+	for (i = 0; i < scene.n_meshes; i++)
+		if (mesh_build(&scene.meshes[i], scene_lazy) != 0)
+			return 1;
+	if (build_instances() != 0)
+		return 1;
+
+	s = &scene.spheres;
+	n = s->n;
+	if (n == 0) {
+		scene.bvh.nodes = NULL;
+		scene.bvh.n_nodes = 0;
+		return 0;
+	}
+
+	boxes = malloc(sizeof(*boxes) * n);
+	order = malloc(sizeof(*order) * n);
+	if (!boxes || !order) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		free(boxes);
+		free(order);
+		return 1;
+	}
+
+	sphere_boxes(NULL, 0, n, boxes);
+
+	ret = bvh_build(&scene.bvh, boxes, order, n, scene_lazy) != 0 ||
+	    !PERMUTE(s->x, order, n) || !PERMUTE(s->y, order, n) ||
+	    !PERMUTE(s->z, order, n) || !PERMUTE(s->r, order, n) ||
+	    !PERMUTE(s->material, order, n);
+	s->cap = n;
+
+	free(boxes);
+	free(order);
+	return ret;
+}
+
+void
+free_scene(void)
+{
+	sphere_list *s;
+	plane_list *p;
+	size_t i;
+
+	s = &scene.spheres;
+	p = &scene.planes;
+	if (scene.mapping) {
+		/* everything but the material and mesh tables is in the image */
+		munmap(scene.mapping, scene.mapping_size);
+		scene.mapping = NULL;
+		scene.mapping_size = 0;
+		memset(&scene.bvh, 0, sizeof(scene.bvh));
+		memset(&scene.instance_bvh, 0, sizeof(scene.instance_bvh));
+		memset(&scene.bg.map, 0, sizeof(scene.bg.map));
+		scene.instances = NULL;
+	} else {
+		bvh_free(&scene.bvh);
+		bvh_free(&scene.instance_bvh);
+		free(scene.instances);
+		free(s->x);
+		free(s->y);
+		free(s->z);
+		free(s->r);
+		free(s->material);
+		free(p->x);
+		free(p->y);
+		free(p->z);
+		free(p->d);
+		free(p->u);
+		free(p->v);
+		free(p->material);
+		for (i = 0; i < scene.n_meshes; i++)
+			mesh_free(&scene.meshes[i]);
+		envmap_free(&scene.bg.map);
+	}
+	free(scene.materials);
+	free(scene.meshes);
+	memset(s, 0, sizeof(*s));
+	memset(p, 0, sizeof(*p));
+	scene.materials = NULL;
+	scene.n_materials = scene.cap_materials = 0;
+	scene.meshes = NULL;
+	scene.n_meshes = scene.cap_meshes = 0;
+	scene.instances = NULL;
+	scene.n_instances = scene.cap_instances = 0;
+}
+
+/* derives the image plane from the camera as written in the scene */
+void
+camera_setup(camera *out, const camera_params *in, float aspect_ratio)
+{
+	vec look;
+	float fov, vw, vh;
+
+	fov = in->fov;
+	fov *= GLM_PI / 180.0;
+
+	glm_vec4_copy((float *)in->eye, out->eye);
+	glm_vec4_sub((float *)in->look_at, out->eye, look);
+
+	vh = fabsf(atanf(fov / 2.0)) * glm_vec4_norm(look) * 2.0;
+	vw = vh * aspect_ratio;
+
+	glm_vec3_proj((float *)in->up, look, out->down);
+	glm_vec4_sub(out->down, (float *)in->up, out->down);
+	glm_vec4_scale_as(out->down, vh, out->down);
+
+	glm_vec3_cross(look, out->down, out->right);
+	glm_vec4_scale_as(out->right, vw, out->right);
+
+	glm_vec4_copy((float *)in->look_at, out->upper_left);
+	glm_vec4_mulsubs(out->down, 0.5, out->upper_left);
+	glm_vec4_mulsubs(out->right, 0.5, out->upper_left);
+}
+
+static int
+parse_camera(camera_params *out)
+{
+	PARSE(vec, out->eye);
+	PARSE(vec, out->look_at);
+	PARSE(vec, out->up);
+	out->fov = CONSUME_FLOAT();
+	return 0;
+}
+
+static int
+parse_material(material *out)
+{
+	CONSUME(MATERIAL_TYPE);
+	out->type = t.m;
+	PARSE(texture, &out->texture);
+	return 0;
+}
+
+static int
+parse_texture(texture *out)
+{
+	char *path;
+
+	switch ((t = next_token()).type) {
+	case KEYWORD:
+		if (t.k == BLACKBODY) {
+			goto solid;
+		} else if (t.k != KW_CHECKS)
+			goto fail;
+		out->type = CHECKS;
+		out->checks.scale = CONSUME_FLOAT();
+		PARSE(color, &out->checks.c1);
+		PARSE(color, &out->checks.c2);
 		break;
-	case SOLID:
-		width = 1;
-		height = 1;
+	case NUMBER:
+	solid:
+		prev_token = t;
+		out->type = SOLID;
+		PARSE(color, &out->solid);
 		break;
-	case IMAGE:
-		width = scene.bg.tex.image.width;
-		height = scene.bg.tex.image.height;
+	case STRING:
+		if (!(path = strndup(t.str, t.len))) {
+			fprintf(stderr, "%s: memory allocation failed\n",
+			    prog_name);
+			return 1;
+		}
+		out->type = IMAGE;
+		out->image.data = stbi_loadf(path, &out->image.width,
+		    &out->image.height, &out->image.n_channels, 0);
+		if (out->image.data == NULL) {
+			fprintf(stderr,
+			    "%s: image file '%s' is corrupt or missing\n",
+			    prog_name, path);
+			free(path);
+			return 1;
+		}
+		free(path);
 		break;
+	default:
+	fail:
+		fprintf(stderr,
+		    "%s: expected a texture on line %zu, got '%.*s'\n",
+		    prog_name, line, (int)(cur - tok), tok);
+	case ERROR:
+		return 1;
+	}
+	return 0;
+}
+
+static int
+parse_color(color *out)
+{
+	t = next_token();
+	switch (t.type) {
+	case KEYWORD:
+		if (t.k != BLACKBODY)
+			goto fail;
+		TODO();
+		break;
+	case NUMBER:
+		out->r = t.f;
+		out->g = CONSUME_FLOAT();
+		out->b = CONSUME_FLOAT();
+		break;
+	default:
+	fail:
+		fprintf(stderr,
+		    "%s: expected a color on line %zu, got '%.*s'\n",
+		    prog_name, line, (int)(cur - tok), tok);
+	case ERROR:
+		return 1;
+	}
+	return 0;
+}
+
+static int
+parse_plane(plane *out)
+{
+	memset(out, 0, sizeof(*out));
+	PARSE(vec, out->normal);
+	glm_vec4_normalize(out->normal);
+	out->d = CONSUME_FLOAT();
+	glm_vec4_scale(out->normal, out->d, out->center);
+	glm_vec3_cross(out->normal, vec_i, out->u);
+	if (glm_vec4_norm2(out->u) < epsilon) {
+		glm_vec3_cross(out->normal, vec_j, out->u);
+	}
+	glm_vec4_normalize(out->u);
+	glm_vec3_cross(out->normal, out->u, out->v);
+
+	return 0;
+}
+
+/*
+ * reads a whole number of elements. literals are read as integers, which a
+ * float can't always hold exactly, anything else must evaluate to one
+ */
+static int
+parse_count(size_t *out)
+{
+	const char *p;
+	size_t n;
+
+	CONSUME(NUMBER);
+	if (isdigit(*tok)) {
+		n = 0;
+		for (p = tok; p < cur; p++) {
+			if (!isdigit(*p) || n > (SIZE_MAX - 9) / 10)
+				goto fail;
+			n = n * 10 + (*p - '0');
+		}
+	} else if (t.f >= 0.0f && t.f < 0x1p53f && t.f == floorf(t.f)) {
+		n = t.f;
+	} else {
+		goto fail;
+	}
+	*out = n;
+	return 0;
+fail:
+	fprintf(stderr, "%s: invalid count '%.*s' on line %zu\n", prog_name,
+	    (int)(cur - tok), tok, line);
+	return 1;
+}
+
+/*
+ * CONSUME_FLOAT for long runs of numbers, which skips the token dispatch when
+ * the next token is plainly a number. anything else goes through next_token
+ * so comments and errors are handled as usual
+ */
+static int
+bulk_float(float *out)
+{
+	if (prev_token.type == ERROR) {
+		cur = skip_blank(cur, lim, &line);
+		tok = cur;
+		if (cur < lim && (*cur == '-' || (*cur >= '0' && *cur <= '9'))) {
+			cur = scan_number(cur + 1, lim);
+			if (parse_float(tok, cur - tok, out) == 0)
+				return 0;
+			cur = tok;
+		}
+	}
+	*out = CONSUME_FLOAT();
+	return 0;
+}
+
+/* assembles a little-endian float whatever the host byte order */
+static float
+le_float(const unsigned char *b)
+{
+	uint32_t u;
+	float f;
+
+	u = b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 |
+	    (uint32_t)b[3] << 24;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+/* reads n rows of little-endian float32 x, y, z and radius from path */
+static int
+load_spheres(const char *path, size_t n, uint16_t material)
+{
+	unsigned char (*rows)[4][4];
+	sphere_list *s;
+	size_t i, k, got;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb"))) {
+		fprintf(stderr, "%s: couldn't open %s: %s\n", prog_name, path,
+		    strerror(errno));
+		return 1;
+	}
+	if (!(rows = malloc(sizeof(*rows) * BULK_ROWS))) {
+		fprintf(stderr, "%s: memory allocation failed\n", prog_name);
+		fclose(f);
+		return 1;
+	}
+
+	s = &scene.spheres;
+	for (i = 0; i < n; i += got) {
+		k = n - i < BULK_ROWS ? n - i : BULK_ROWS;
+		if ((got = fread(rows, sizeof(*rows), k, f)) == 0)
+			break;
+		for (k = 0; k < got; k++) {
+			s->x[s->n] = le_float(rows[k][0]);
+			s->y[s->n] = le_float(rows[k][1]);
+			s->z[s->n] = le_float(rows[k][2]);
+			s->r[s->n] = le_float(rows[k][3]);
+			s->material[s->n] = material;
+			s->n++;
+		}
+	}
+	free(rows);
+
+	if (i < n || fgetc(f) != EOF) {
+		fprintf(stderr,
+		    "%s: %s doesn't hold exactly %zu spheres, as given on line"
+		    " %zu\n",
+		    prog_name, path, n, line);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * a block of n spheres, given either as n rows of x y z radius or as the path
+ * of a binary file of them. they go straight into the sphere arrays
+ */
+static int
+parse_spheres(uint16_t material)
+{
+	sphere_list *s;
+	char *path;
+	size_t n, end;
+	int ret;
+
+	PARSE(count, &n);
+	s = &scene.spheres;
+	if (n > SIZE_MAX / sizeof(float) - s->n - VWIDTH) {
+		fprintf(stderr, "%s: too many spheres on line %zu\n",
+		    prog_name, line);
+		return 1;
+	}
+	if (reserve_spheres(s->n + n) != 0)
+		return 1;
+
+	if ((t = next_token()).type == STRING) {
+		if (!(path = strndup(t.str, t.len))) {
+			fprintf(stderr, "%s: memory allocation failed\n",
+			    prog_name);
+			return 1;
+		}
+		ret = load_spheres(path, n, material);
+		free(path);
+		return ret;
+	} else if (t.type == ERROR) {
+		return 1;
+	}
+	prev_token = t;
+
+	for (end = s->n + n; s->n < end; s->n++) {
+		if (bulk_float(&s->x[s->n]) != 0 ||
+		    bulk_float(&s->y[s->n]) != 0 ||
+		    bulk_float(&s->z[s->n]) != 0 ||
+		    bulk_float(&s->r[s->n]) != 0)
+			return 1;
+		s->material[s->n] = material;
+	}
+	return 0;
+}
+
+/*
+ * places a mesh file, optionally moved by a list of transforms that apply in
+ * the order written:
+ *
+ *	instance "tree.ply" scale 0.5 rotate (0 1 0) 30 translate (4 0 -2)
+ *
+ * the path points into the input, which stays in memory while parsing
+ */
+static int
+parse_instance(uint16_t material)
+{
+	const char *path;
+	size_t len;
+	mat4 m;
+
+	CONSUME(STRING);
+	path = t.str;
+	len = t.len;
+	PARSE(transform, m);
+	return add_instance(path, len, m, material);
+}
+
+static int
+parse_transform(mat4 out)
+{
+	mat4 step;
+	vec v;
+	float angle;
+
+	glm_mat4_identity(out);
+	for (;;) {
+		if ((t = next_token()).type == ERROR)
+			return 1;
+		if (t.type != KEYWORD ||
+		    (t.k != TRANSLATE && t.k != ROTATE && t.k != SCALE)) {
+			prev_token = t;
+			break;
+		}
+
+		switch (t.k) {
+		case TRANSLATE:
+			PARSE(vec, v);
+			glm_translate_make(step, v);
+			break;
+		case ROTATE:
+			PARSE(vec, v);
+			angle = CONSUME_FLOAT();
+			if (glm_vec3_norm(v) == 0.0f) {
+				fprintf(stderr,
+				    "%s: rotation axis on line %zu is zero\n",
+				    prog_name, line);
+				return 1;
+			}
+			glm_rotate_make(step, glm_rad(angle), v);
+			break;
+		default:
+			/* a single number scales uniformly */
+			if ((t = next_token()).type == NUMBER) {
+				v[0] = v[1] = v[2] = t.f;
+			} else {
+				if (t.type == ERROR)
+					return 1;
+				prev_token = t;
+				PARSE(vec, v);
+			}
+			glm_scale_make(step, v);
+			break;
+		}
+		glm_mat4_mul(step, out, out);
+	}
+
+	if (glm_mat4_det(out) == 0.0f) {
+		fprintf(stderr, "%s: transform on line %zu can't be inverted\n",
+		    prog_name, line);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+parse_vec(vec out)
+{
+	CONSUME(LPAREN);
+	out[0] = CONSUME_FLOAT();
+	out[1] = CONSUME_FLOAT();
+	out[2] = CONSUME_FLOAT();
+	out[3] = 0.0f;
+	CONSUME(RPAREN);
+	return 0;
+}
+
+/* takes a world space ray into the object space of an instance */
+static void
+object_ray(const instance *inst, const ray *in, ray *out)
+{
+	vec o = { in->origin[0], in->origin[1], in->origin[2], 1.0f };
+	vec d = { in->d[0], in->d[1], in->d[2], 0.0f };
+
+	glm_mat4_mulv((vec4 *)inst->to_object, o, out->origin);
+	glm_mat4_mulv((vec4 *)inst->to_object, d, out->d);
+	out->origin[3] = 0.0f;
+}
+
+/*
+ * finds the closest triangle of m under b, in object space. deferred
+ * subtrees are built as they're reached and walked the same way
+ */
+static void
+intersect_mesh_bvh(const bvh *b, mesh *m, uint32_t index, const ray *ray,
+    const ray_shear *sh, const bvh_ray *r, hit_id *out)
+{
+	const bvh_node *node;
+	bvh_entry stack[BVH_STACK_SIZE], e;
+	float t_near[BVH_WIDTH];
+	size_t sp, i;
+
+	sp = 0;
+	stack[sp++] = (bvh_entry) { 0, 0, 0.0f };
+	while (sp > 0) {
+		e = stack[--sp];
+		if (e.t >= out->t)
+			continue;
+
+		if (e.count == 0) {
+			node = &b->nodes[e.index];
+			bvh_push_children(node,
+			    bvh_hit_children(node, r, out->t, t_near), t_near,
+			    stack, &sp);
+			continue;
+		}
+
+		if (e.count == BVH_DEFERRED) {
+			intersect_mesh_bvh(bvh_subtree(&b->lazy[e.index],
+					       &mesh_source, m),
+			    m, index, ray, sh, r, out);
+			continue;
+		}
+
+		if (hit_triangles(&m->geom, e.index, e.index + e.count, ray,
+			sh, &out->t, &i)) {
+			out->type = TRIANGLE;
+			out->index = i;
+			out->instance = index;
+		}
+	}
+}
+
+/* intersects the mesh under instances[index], in its object space */
+static void
+intersect_instance(uint32_t index, const ray *world, hit_id *out)
+{
+	const instance *inst;
+	mesh *m;
+	ray_shear sh;
+	ray ray;
+	bvh_ray r;
+
+	inst = &scene.instances[index];
+	m = &scene.meshes[inst->mesh];
+	object_ray(inst, world, &ray);
+	ray_shear_init(&ray, &sh);
+	bvh_ray_init(&r, ray.origin, ray.d);
+	intersect_mesh_bvh(&m->bvh, m, index, &ray, &sh, &r, out);
+}
+
+/*
+ * the same as intersect_mesh_bvh, for the spheres under b. the walk starts
+ * from root, which is the root node unless a packet hands over part of the
+ * tree
+ */
+static void
+intersect_sphere_bvh(const bvh *b, bvh_entry root, const ray *ray,
+    const bvh_ray *r, hit_id *out)
+{
+	const bvh_node *node;
+	bvh_entry stack[BVH_STACK_SIZE], e;
+	float t_near[BVH_WIDTH];
+	size_t sp, i;
+
+	sp = 0;
+	if (b->n_nodes > 0)
+		stack[sp++] = root;
+	while (sp > 0) {
+		e = stack[--sp];
+		if (e.t >= out->t)
+			continue;
+
+		if (e.count == 0) {
+			node = &b->nodes[e.index];
+			bvh_push_children(node,
+			    bvh_hit_children(node, r, out->t, t_near), t_near,
+			    stack, &sp);
+			continue;
+		}
+
+		if (e.count == BVH_DEFERRED) {
+			intersect_sphere_bvh(bvh_subtree(&b->lazy[e.index],
+						 &sphere_source, NULL),
+			    (bvh_entry) { 0, 0, 0.0f }, ray, r, out);
+			continue;
+		}
+
+		if (hit_spheres(&scene.spheres, e.index, e.index + e.count, ray,
+			&out->t, &i)) {
+			out->type = SPHERE;
+			out->index = i;
+		}
+	}
+}
+
+/* the top level of the instances, each leaf enters its meshes */
+static void
+intersect_instances(const ray *ray, const bvh_ray *r, hit_id *out)
+{
+	const bvh_node *node;
+	bvh_entry stack[BVH_STACK_SIZE], e;
+	float t_near[BVH_WIDTH];
+	size_t sp, j;
+
+	sp = 0;
+	if (scene.instance_bvh.n_nodes > 0)
+		stack[sp++] = (bvh_entry) { 0, 0, 0.0f };
+	while (sp > 0) {
+		e = stack[--sp];
+		if (e.t >= out->t)
+			continue;
+
+		if (e.count == 0) {
+			node = &scene.instance_bvh.nodes[e.index];
+			bvh_push_children(node,
+			    bvh_hit_children(node, r, out->t, t_near), t_near,
+			    stack, &sp);
+			continue;
+		}
+
+		for (j = e.index; j < e.index + e.count; j++)
+			intersect_instance(j, ray, out);
+	}
+}
+
+/*
+ * finds the closest primitive along the ray. only the distance and which
+ * primitive was hit are tracked, finalize_hit fills in the rest. the BVHs are
+ * walked nearest child first, and anything starting past the closest hit so
+ * far is skipped when it's popped
+ */
+int
+intersect_scene(const ray *ray, hit_id *out)
+{
+	bvh_ray r;
+	size_t i;
+
+	out->t = INFINITY;
+
+	if (hit_planes(&scene.planes, ray, &out->t, &i)) {
+		out->type = PLANE;
+		out->index = i;
+	}
+
+	bvh_ray_init(&r, ray->origin, ray->d);
+	intersect_sphere_bvh(&scene.bvh, (bvh_entry) { 0, 0, 0.0f }, ray, &r,
+	    out);
+	intersect_instances(ray, &r, out);
+
+	return out->t != INFINITY;
+}
+
+/* fewest rays a packet keeps going with, below that they split up */
+#define PACKET_MIN_RAYS 4
+
+/* a node or leaf reached by some of the rays in a packet */
+struct packet_entry {
+	uint32_t index, count;
+	float t;
+	int rays;
+};
+
+/* the rays of a packet as bvh_ray, in structures of arrays */
+struct packet_rays {
+	float origin[3][PACKET_SIZE], inv_d[3][PACKET_SIZE];
+};
+
+/*
+ * bvh_hit_children for the rays in a packet. a wide node already fills the
+ * vectors with its children, so each ray tests them on its own. returns a
+ * mask of the children any of them hit, and for each of those the rays that
+ * hit it and the nearest entry distance
+ */
+static int
+packet_children(const bvh_node *node, const struct packet_rays *pr,
+    int rays, const float *t, float *near, int *child_rays)
+{
+	bvh_ray r;
+	float t_near[BVH_WIDTH];
+	int c, i, k, hit, mask;
+
+	mask = 0;
+	for (c = 0; c < BVH_WIDTH; c++) {
+		near[c] = INFINITY;
+		child_rays[c] = 0;
+	}
+	for (; rays; rays &= rays - 1) {
+		k = __builtin_ctz(rays);
+		for (i = 0; i < 3; i++) {
+			r.origin[i] = pr->origin[i][k];
+			r.inv_d[i] = pr->inv_d[i][k];
+		}
+		hit = bvh_hit_children(node, &r, t[k], t_near);
+		mask |= hit;
+		for (; hit; hit &= hit - 1) {
+			c = __builtin_ctz(hit);
+			child_rays[c] |= 1 << k;
+			near[c] = t_near[c] < near[c] ? t_near[c] : near[c];
+		}
 	}
 
-	scene.bg.w = width;
-	scene.bg.h = height;
+	return mask;
+}
+
+/* the rays that could still hit something at t or further */
+static int
+packet_live(const float *t, int rays, float near)
+{
+	int live, k;
 
-	scene.bg.pdf = malloc(sizeof(float) * width * height);
-	scene.bg.cdf_c = malloc(sizeof(float) * width * height);
-	scene.bg.cdf_m = malloc(sizeof(float) * width);
-	if (!scene.bg.cdf_c || !scene.bg.cdf_m || !scene.bg.pdf) {
-		fprintf(stderr, "%s: malloc failed\n", prog_name);
-		exit(1);
+	for (live = rays; rays; rays &= rays - 1) {
+		k = __builtin_ctz(rays);
+		if (t[k] <= near)
+			live &= ~(1 << k);
 	}
+	return live;
+}
 
-	total = 0.0;
+/*
+ * finishes the subtree under e with each of its rays on its own, once too few
+ * of them are left for sharing the walk to pay off
+ */
+static int
+packet_split(const bvh *b, const struct packet_entry *e, const ray_packet *p,
+    const struct packet_rays *pr, float *t, uint32_t *index)
+{
+	ray ray;
+	bvh_ray r;
+	hit_id id;
+	int rays, found, i, k;
 
-	for (y = 0; y < height; y++) {
-		v = ((float)y + 0.5) / height;
-		row_total = 0.0;
-		for (x = 0; x < width; x++) {
-			u = ((float)x + 0.5) / width;
-			sample = sample_intensity(&scene.bg.tex, u, v) *
-			    sinf(GLM_PI * v);
-			scene.bg.pdf[y * width + x] = sample;
-			row_total += sample;
-			scene.bg.cdf_c[y * width + x] = row_total;
+	found = 0;
+	for (rays = e->rays; rays; rays &= rays - 1) {
+		k = __builtin_ctz(rays);
+		ray.origin[0] = p->ox[k];
+		ray.origin[1] = p->oy[k];
+		ray.origin[2] = p->oz[k];
+		ray.d[0] = p->dx[k];
+		ray.d[1] = p->dy[k];
+		ray.d[2] = p->dz[k];
+		for (i = 0; i < 3; i++) {
+			r.origin[i] = pr->origin[i][k];
+			r.inv_d[i] = pr->inv_d[i][k];
 		}
-		for (x = 0; x < width; x++) {
-			scene.bg.cdf_c[y * width + x] /= row_total;
+
+		id.t = t[k];
+		intersect_sphere_bvh(b,
+		    (bvh_entry) { e->index, e->count, e->t }, &ray, &r, &id);
+		if (id.t < t[k]) {
+			t[k] = id.t;
+			index[k] = id.index;
+			found |= 1 << k;
 		}
-		total += row_total;
-		scene.bg.cdf_m[y] = total;
 	}
-	for (y = 0; y < height; y++) {
-		scene.bg.cdf_m[y] /= total;
+	return found;
+}
+
+/*
+ * intersect_sphere_bvh for a packet, starting from roots, which are sorted
+ * nearest first. each entry carries the rays that reached it, a node's
+ * children are tested against those rays, and a child is entered once if any
+ * of them hits it, from the nearest of their entry points. rays drop out of
+ * an entry once their closest hit is in front of it, and the whole packet
+ * moves on when none are left
+ */
+static int
+intersect_sphere_packet(const bvh *b, const bvh_entry *roots, size_t n_roots,
+    const ray_packet *p, const struct packet_rays *pr, int rays, float *t,
+    uint32_t *index)
+{
+	const bvh_entry root = { 0, 0, 0.0f };
+	const bvh_node *node;
+	struct packet_entry stack[BVH_STACK_SIZE], e;
+	float near[BVH_WIDTH];
+	int child_rays[BVH_WIDTH];
+	size_t sp, base, j;
+	int found, mask, c;
+
+	found = 0;
+	sp = 0;
+	while (b->n_nodes > 0 && n_roots > 0) {
+		n_roots--;
+		stack[sp++] = (struct packet_entry) { roots[n_roots].index,
+			roots[n_roots].count, roots[n_roots].t, rays };
 	}
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			scene.bg.pdf[y * width + x] /= total;
+	while (sp > 0) {
+		e = stack[--sp];
+		if (!(e.rays = packet_live(t, e.rays, e.t)))
+			continue;
+
+		if (__builtin_popcount(e.rays) < PACKET_MIN_RAYS) {
+			found |= packet_split(b, &e, p, pr, t, index);
+			continue;
+		}
+
+		if (e.count == BVH_DEFERRED) {
+			found |= intersect_sphere_packet(
+			    bvh_subtree(&b->lazy[e.index], &sphere_source,
+				NULL),
+			    &root, 1, p, pr, e.rays, t, index);
+			continue;
+		}
+
+		if (e.count > 0) {
+			found |= hit_spheres_packet(&scene.spheres, e.index,
+			    e.index + e.count, p, e.rays, t, index);
+			continue;
+		}
+
+		node = &b->nodes[e.index];
+		mask = packet_children(node, pr, e.rays, t, near, child_rays);
+
+		/* nearest child on top, as in bvh_push_children */
+		for (base = sp; mask; mask &= mask - 1) {
+			c = __builtin_ctz(mask);
+			e = (struct packet_entry) { node->child[c],
+				node->count[c], near[c], child_rays[c] };
+			for (j = sp++; j > base && stack[j - 1].t < e.t; j--)
+				stack[j] = stack[j - 1];
+			stack[j] = e;
 		}
 	}
+
+	return found;
 }
 
+/*
+ * intersect_scene for up to PACKET_SIZE coherent rays, such as the camera
+ * rays of a block of pixels. planes and the sphere BVH are traced with the
+ * whole packet at once, instances are still walked one ray at a time. if
+ * view is given, all the rays are within its tile and the spheres outside it
+ * are skipped. returns a mask of the rays that hit anything
+ */
 int
-hit_scene(const ray *ray, hit_info *out)
+intersect_packet(const ray *rays, size_t n, const tile_view *view,
+    hit_id *out)
+{
+	const bvh_entry root = { 0, 0, 0.0f };
+	ray_packet p;
+	struct packet_rays pr;
+	bvh_ray r;
+	float t[PACKET_SIZE];
+	uint32_t index[PACKET_SIZE];
+	size_t i, k;
+	int planes, spheres, mask;
+
+	ray_packet_init(&p, rays, n);
+	for (k = 0; k < PACKET_SIZE; k++) {
+		for (i = 0; i < 3; i++) {
+			pr.origin[i][k] = rays[k < n ? k : n - 1].origin[i];
+			pr.inv_d[i][k] = 1.0f / rays[k < n ? k : n - 1].d[i];
+		}
+		t[k] = INFINITY;
+	}
+
+	planes = hit_planes_packet(&scene.planes, &p, t, index);
+	if (view)
+		spheres = intersect_sphere_packet(&scene.bvh, view->entries,
+		    view->n, &p, &pr, (1 << n) - 1, t, index);
+	else
+		spheres = intersect_sphere_packet(&scene.bvh, &root, 1, &p,
+		    &pr, (1 << n) - 1, t, index);
+
+	mask = 0;
+	for (k = 0; k < n; k++) {
+		out[k].t = t[k];
+		out[k].index = index[k];
+		if (spheres & 1 << k)
+			out[k].type = SPHERE;
+		else if (planes & 1 << k)
+			out[k].type = PLANE;
+		bvh_ray_init(&r, rays[k].origin, rays[k].d);
+		intersect_instances(&rays[k], &r, &out[k]);
+		mask |= (out[k].t != INFINITY) << k;
+	}
+
+	return mask;
+}
+
+/*
+ * the part of the world the camera rays through a rectangle of the image
+ * plane can reach. the side planes go through the eye and are unit length.
+ * ray origins are moved off the eye by up to lens across the image plane,
+ * which puts a ray at depth z at most lens * (1 + z / focal) from the pinhole
+ * ray through the same point, so that's how far outside the planes a box can
+ * be and still be hit
+ */
+struct frustum {
+	vec eye, forward;
+	float side[4][3];
+	float focal, lens;
+};
+
+/* the furthest corner of a child box in the direction of n */
+static float
+child_extent(const bvh_node *node, int c, const float *n, const float *p)
+{
+	float d, lo, hi;
+	int i;
+
+	for (d = 0.0f, i = 0; i < 3; i++) {
+		lo = node->origin[i] + node->qmin[i][c] * node->scale[i];
+		hi = node->origin[i] + node->qmax[i][c] * node->scale[i];
+		d += n[i] * ((n[i] >= 0.0f ? hi : lo) - p[i]);
+	}
+	return d;
+}
+
+/*
+ * returns a mask of the children of node that can be inside f, and the
+ * nearest t at which any of its rays could reach each of them
+ */
+static int
+frustum_children(const bvh_node *node, const struct frustum *f, float *t)
+{
+	float back[3], far, slack;
+	int c, i, mask;
+
+	for (i = 0; i < 3; i++)
+		back[i] = -f->forward[i];
+
+	mask = 0;
+	for (c = 0; c < node->n_children; c++) {
+		far = child_extent(node, c, f->forward, f->eye);
+		if (far <= 0.0f)
+			continue;
+		slack = f->lens * (1.0f + far / f->focal);
+		for (i = 0; i < 4; i++) {
+			if (child_extent(node, c, f->side[i], f->eye) < -slack)
+				break;
+		}
+		if (i < 4)
+			continue;
+
+		t[c] = glm_max(-child_extent(node, c, back, f->eye), 0.0f) /
+		    f->focal;
+		mask |= 1 << c;
+	}
+	return mask;
+}
+
+/*
+ * the frustum of camera rays through [u0, u1] x [v0, v1] of the image plane,
+ * for rays whose origins are up to lens times right and down off the eye
+ */
+static void
+frustum_init(struct frustum *f, float u0, float v0, float u1, float v1,
+    float lens)
 {
+	const camera *cam;
+	vec corner[4], mid;
+	int i;
+
+	cam = &scene.camera;
+	glm_vec4_copy((float *)cam->eye, f->eye);
+	glm_vec4_copy((float *)cam->upper_left, mid);
+	glm_vec4_muladds((float *)cam->right, 0.5f * (u0 + u1), mid);
+	glm_vec4_muladds((float *)cam->down, 0.5f * (v0 + v1), mid);
+	glm_vec3_cross((float *)cam->right, (float *)cam->down, f->forward);
+	glm_vec3_normalize(f->forward);
+	f->focal = glm_vec3_dot(f->forward, mid) -
+	    glm_vec3_dot(f->forward, f->eye);
+	if (f->focal < 0.0f) {
+		glm_vec3_negate(f->forward);
+		f->focal = -f->focal;
+	}
+	f->lens = lens * (glm_vec3_norm((float *)cam->right) +
+			     glm_vec3_norm((float *)cam->down));
+
+	for (i = 0; i < 4; i++) {
+		glm_vec4_copy((float *)cam->upper_left, corner[i]);
+		glm_vec4_muladds((float *)cam->right,
+		    i == 1 || i == 2 ? u1 : u0, corner[i]);
+		glm_vec4_muladds((float *)cam->down, i >= 2 ? v1 : v0,
+		    corner[i]);
+		glm_vec3_sub(corner[i], f->eye, corner[i]);
+	}
+	glm_vec3_sub(mid, f->eye, mid);
+	for (i = 0; i < 4; i++) {
+		glm_vec3_cross(corner[i], corner[(i + 1) % 4], f->side[i]);
+		glm_vec3_normalize(f->side[i]);
+		if (glm_vec3_dot(f->side[i], mid) < 0.0f)
+			glm_vec3_negate(f->side[i]);
+	}
+}
+
+/*
+ * cuts the sphere BVH into the subtrees f can see. with all set every node in
+ * view is opened, and this fails once the cut doesn't fit in out. otherwise
+ * only nodes with at most one child in view are, which can't cost a ray more
+ * box tests than starting from the root
+ */
+static int
+cut_view(const struct frustum *f, int all, tile_view *out)
+{
+	const bvh_node *node;
+	float t[BVH_WIDTH];
+	bvh_entry e;
 	size_t i;
-	int res;
-	hit_info cur;
+	int mask, n, c;
 
-	out->t = INFINITY;
+	out->n = 0;
+	if (scene.bvh.n_nodes > 0)
+		out->entries[out->n++] = (bvh_entry) { 0, 0, 0.0f };
+	for (i = 0; i < out->n;) {
+		e = out->entries[i];
+		if (e.count != 0) {
+			i++;
+			continue;
+		}
 
-	for (i = 0; i < scene.cur_shape; i++) {
-		switch (scene.shapes[i].type) {
-		case SPHERE:
-			res = hit_sphere(&scene.shapes[i].s, ray, &cur);
-			break;
-		case PLANE:
-			res = hit_plane(&scene.shapes[i].p, ray, &cur);
-			break;
+		node = &scene.bvh.nodes[e.index];
+		mask = frustum_children(node, f, t);
+		n = __builtin_popcount(mask);
+		if (!all && n > 1) {
+			i++;
+			continue;
+		}
+		if (out->n - 1 + n > VIEW_ENTRIES)
+			return 1;
+
+		/* entries past i are still to be looked at */
+		out->entries[i] = out->entries[--out->n];
+		for (; mask; mask &= mask - 1) {
+			c = __builtin_ctz(mask);
+			out->entries[out->n++] = (bvh_entry) { node->child[c],
+				node->count[c], t[c] };
+		}
+	}
+	return 0;
+}
+
+/*
+ * finds the subtrees of the sphere BVH the camera rays through
+ * [u0, u1] x [v0, v1] of the image plane can reach, for rays whose origins
+ * are up to lens times right and down off the eye. when few enough leaves
+ * are in view they're all listed, and the tile's rays test only those.
+ * otherwise the tree is only cut past the nodes every ray would have to go
+ * through. deferred subtrees are left whole
+ */
+void
+cull_view(float u0, float v0, float u1, float v1, float lens, tile_view *out)
+{
+	struct frustum f;
+	bvh_entry e;
+	size_t i, j;
+
+	frustum_init(&f, u0, v0, u1, v1, lens);
+	if (cut_view(&f, 1, out))
+		cut_view(&f, 0, out);
+
+	for (i = 1; i < out->n; i++) {
+		e = out->entries[i];
+		for (j = i; j > 0 && out->entries[j - 1].t > e.t; j--)
+			out->entries[j] = out->entries[j - 1];
+		out->entries[j] = e;
+	}
+}
+
+/* ulps of |w|^2 a sphere's silhouette is widened by, see raster_collect */
+#define RASTER_SLACK 8
+
+/*
+ * the range of image plane coordinates over which the sphere at w from the
+ * eye, of radius squared r2, can be hit. the camera rays with coordinate x lie in a
+ * plane through the eye with normal p + x * q, which meets the sphere when
+ * (n . w)^2 <= r2 |n|^2, a quadratic in x. returns 0 if no x does
+ */
+static int
+sphere_range(const double *p, const double *q, const double *w, double r2,
+    double *lo, double *hi)
+{
+	double pw, qw, a, b, c, disc;
+
+	pw = p[0] * w[0] + p[1] * w[1] + p[2] * w[2];
+	qw = q[0] * w[0] + q[1] * w[1] + q[2] * w[2];
+	a = qw * qw - r2 * (q[0] * q[0] + q[1] * q[1] + q[2] * q[2]);
+	b = 2.0 * (pw * qw - r2 * (p[0] * q[0] + p[1] * q[1] + p[2] * q[2]));
+	c = pw * pw - r2 * (p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+
+	/* the sphere reaches around the eye, so no bound along x */
+	if (a <= 0.0) {
+		*lo = -INFINITY;
+		*hi = INFINITY;
+		return 1;
+	}
+
+	disc = b * b - 4.0 * a * c;
+	if (disc < 0.0)
+		return 0;
+	*lo = (-b - sqrt(disc)) / (2.0 * a);
+	*hi = (-b + sqrt(disc)) / (2.0 * a);
+	return 1;
+}
+
+static void
+cross3d(const float *a, const float *b, double *out)
+{
+	out[0] = (double)a[1] * b[2] - (double)a[2] * b[1];
+	out[1] = (double)a[2] * b[0] - (double)a[0] * b[2];
+	out[2] = (double)a[0] * b[1] - (double)a[1] * b[0];
+}
+
+/* adds the spheres under b in view of f, and in [u0, u1] x [v0, v1] */
+static int
+raster_collect(const bvh *b, const struct frustum *f, const float *window,
+    tile_raster *out)
+{
+	const camera *cam;
+	const bvh_node *node;
+	bvh_entry stack[BVH_STACK_SIZE], e;
+	float t[BVH_WIDTH], a[3], (*extent)[4];
+	double pu[3], pv[3], q[3], w[3], r2, u0, u1, v0, v1;
+	uint32_t *spheres;
+	size_t sp, i, cap;
+	int mask, c;
+
+	cam = &scene.camera;
+	for (i = 0; i < 3; i++)
+		a[i] = cam->upper_left[i] - cam->eye[i];
+	cross3d(a, cam->down, pu);
+	cross3d(cam->right, a, pv);
+	cross3d(cam->right, cam->down, q);
+
+	sp = 0;
+	if (b->n_nodes > 0)
+		stack[sp++] = (bvh_entry) { 0, 0, 0.0f };
+	while (sp > 0) {
+		e = stack[--sp];
+		if (e.count == 0) {
+			node = &b->nodes[e.index];
+			mask = frustum_children(node, f, t);
+			for (; mask; mask &= mask - 1) {
+				c = __builtin_ctz(mask);
+				stack[sp++] = (bvh_entry) { node->child[c],
+					node->count[c], t[c] };
+			}
+			continue;
+		}
+
+		if (e.count == BVH_DEFERRED) {
+			if (raster_collect(bvh_subtree(&b->lazy[e.index],
+					       &sphere_source, NULL),
+				f, window, out) != 0)
+				return 1;
+			continue;
 		}
-		if (res && cur.t < out->t && cur.t > epsilon) {
-			*out = cur;
-			out->material = scene.shapes[i].material;
+
+		for (i = e.index; i < e.index + e.count; i++) {
+			w[0] = (double)scene.spheres.x[i] - cam->eye[0];
+			w[1] = (double)scene.spheres.y[i] - cam->eye[1];
+			w[2] = (double)scene.spheres.z[i] - cam->eye[2];
+			/*
+			 * the float ray test loses r^2 against a few ulps of
+			 * |w|^2, so a distant sphere is widened to take in
+			 * every ray it could count as a hit
+			 */
+			r2 = (double)scene.spheres.r[i] * scene.spheres.r[i] +
+			    RASTER_SLACK * FLT_EPSILON *
+				(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+			if (!sphere_range(pu, q, w, r2, &u0, &u1) ||
+			    !sphere_range(pv, q, w, r2, &v0, &v1))
+				continue;
+			if (u1 < window[0] || v1 < window[1] ||
+			    u0 > window[2] || v0 > window[3])
+				continue;
+
+			if (out->n == out->cap) {
+				cap = out->cap ? out->cap * 2 : 256;
+				spheres = realloc(out->spheres,
+				    sizeof(*spheres) * cap);
+				if (spheres)
+					out->spheres = spheres;
+				extent = realloc(out->extent,
+				    sizeof(*extent) * cap);
+				if (extent)
+					out->extent = extent;
+				if (!spheres || !extent)
+					return 1;
+				out->cap = cap;
+			}
+			out->spheres[out->n] = i;
+			out->extent[out->n][0] = glm_max(u0, window[0]);
+			out->extent[out->n][1] = glm_max(v0, window[1]);
+			out->extent[out->n][2] = glm_min(u1, window[2]);
+			out->extent[out->n][3] = glm_min(v1, window[3]);
+			out->n++;
 		}
 	}
 
-	return out->t != INFINITY;
+	return 0;
+}
+
+/*
+ * finds the spheres the camera rays through [u0, u1] x [v0, v1] of the image
+ * plane can hit, and the part of that rectangle each of them covers. the
+ * camera is taken to be a pinhole. returns nonzero if out couldn't be grown,
+ * and then the tile has to be traced instead
+ */
+int
+raster_view(float u0, float v0, float u1, float v1, tile_raster *out)
+{
+	struct frustum f;
+	float window[4] = { u0, v0, u1, v1 };
+
+	frustum_init(&f, u0, v0, u1, v1, 0.0f);
+	out->n = 0;
+	return raster_collect(&scene.bvh, &f, window, out);
+}
+
+/*
+ * finds the first hits of the camera rays of one sample over a tile, in rows
+ * of g->w. planes are tested at every pixel, and each sphere only at the
+ * pixels inside its silhouette's rectangle, with the nearest hit kept per
+ * pixel as in a depth buffer. each sphere goes through hit_spheres as in
+ * tracing, so the hits are the ones tracing finds, except that for a tiny
+ * sphere far away the float test can report a hit just outside the sphere's
+ * box, which tracing culls with the box and this keeps. instances are still
+ * traced
+ */
+void
+raster_hits(const tile_raster *tr, const raster_grid *g, const ray *rays,
+    hit_id *out)
+{
+	const float *ext;
+	bvh_ray r;
+	long x, y, x0, y0, x1, y1, k;
+	size_t i, j, hit;
+
+	for (k = 0; k < g->w * g->h; k++) {
+		out[k].t = INFINITY;
+		if (hit_planes(&scene.planes, &rays[k], &out[k].t, &i)) {
+			out[k].type = PLANE;
+			out[k].index = i;
+		}
+	}
+
+	for (j = 0; j < tr->n; j++) {
+		/* a hundredth of a pixel covers rounding in the rays */
+		ext = tr->extent[j];
+		x0 = glm_max(ceilf((ext[0] - g->u) / g->du - 0.01f), 0.0f);
+		y0 = glm_max(ceilf((ext[1] - g->v) / g->dv - 0.01f), 0.0f);
+		x1 = glm_min(floorf((ext[2] - g->u) / g->du + 0.01f),
+		    g->w - 1);
+		y1 = glm_min(floorf((ext[3] - g->v) / g->dv + 0.01f),
+		    g->h - 1);
+
+		i = tr->spheres[j];
+		for (y = y0; y <= y1; y++) {
+			for (x = x0; x <= x1; x++) {
+				k = y * g->w + x;
+				if (hit_spheres(&scene.spheres, i, i + 1,
+					&rays[k], &out[k].t, &hit)) {
+					out[k].type = SPHERE;
+					out[k].index = hit;
+				}
+			}
+		}
+	}
+
+	for (k = 0; scene.n_instances > 0 && k < g->w * g->h; k++) {
+		bvh_ray_init(&r, rays[k].origin, rays[k].d);
+		intersect_instances(&rays[k], &r, &out[k]);
+	}
+}
+
+/*
+ * triangle hits are computed in object space and brought back, with the
+ * normal going through the inverse transpose
+ */
+static void
+instance_hit_info(const ray *world, const hit_id *id, hit_info *out)
+{
+	const instance *inst;
+	ray ray;
+	mat4 normal_to_world;
+
+	inst = &scene.instances[id->instance];
+	object_ray(inst, world, &ray);
+	triangle_hit_info(&scene.meshes[inst->mesh].geom, id->index, &ray,
+	    id->t, out);
+
+	glm_mat4_transpose_to((vec4 *)inst->to_object, normal_to_world);
+	glm_mat4_mulv(normal_to_world, out->normal, out->normal);
+	out->normal[3] = 0.0f;
+	glm_vec4_normalize(out->normal);
+	if (glm_vec4_dot(out->normal, (float *)world->d) > 0.0f)
+		glm_vec4_negate(out->normal);
+
+	glm_vec4_copy((float *)world->origin, out->p);
+	glm_vec4_muladds((float *)world->d, id->t, out->p);
+}
+
+/* computes the shading data for a hit found by intersect_scene */
+void
+finalize_hit(const ray *ray, const hit_id *id, hit_info *out)
+{
+	uint16_t material;
+
+	switch (id->type) {
+	case PLANE:
+		plane_hit_info(&scene.planes, id->index, ray, id->t, out);
+		material = scene.planes.material[id->index];
+		break;
+	case SPHERE:
+		sphere_hit_info(&scene.spheres, id->index, ray, id->t, out);
+		material = scene.spheres.material[id->index];
+		break;
+	case TRIANGLE:
+		instance_hit_info(ray, id, out);
+		material = scene.instances[id->instance].material;
+		break;
+	}
+	out->material = &scene.materials[material];
+}
+
+int
+hit_scene(const ray *ray, hit_info *out)
+{
+	hit_id id;
+
+	if (!intersect_scene(ray, &id))
+		return 0;
+	finalize_hit(ray, &id, out);
+	return 1;
+}
+
+static int
+occluded_mesh_bvh(const bvh *b, mesh *m, const ray *ray,
+    const ray_shear *sh, const bvh_ray *r, float t_max)
+{
+	const bvh_node *node;
+	bvh_entry stack[BVH_STACK_SIZE], e;
+	float t_near[BVH_WIDTH];
+	size_t sp;
+
+	sp = 0;
+	stack[sp++] = (bvh_entry) { 0, 0, 0.0f };
+	while (sp > 0) {
+		e = stack[--sp];
+		if (e.count == 0) {
+			node = &b->nodes[e.index];
+			bvh_push_children(node,
+			    bvh_hit_children(node, r, t_max, t_near), t_near,
+			    stack, &sp);
+			continue;
+		}
+
+		if (e.count == BVH_DEFERRED) {
+			if (occluded_mesh_bvh(bvh_subtree(&b->lazy[e.index],
+						  &mesh_source, m),
+				m, ray, sh, r, t_max))
+				return 1;
+			continue;
+		}
+
+		if (occluded_triangles(&m->geom, e.index, e.index + e.count,
+			ray, sh, t_max))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+occluded_instance(const instance *inst, const ray *world, float t_max)
+{
+	mesh *m;
+	ray_shear sh;
+	ray ray;
+	bvh_ray r;
+
+	m = &scene.meshes[inst->mesh];
+	object_ray(inst, world, &ray);
+	ray_shear_init(&ray, &sh);
+	bvh_ray_init(&r, ray.origin, ray.d);
+	return occluded_mesh_bvh(&m->bvh, m, &ray, &sh, &r, t_max);
+}
+
+static int
+occluded_sphere_bvh(const bvh *b, const ray *ray, const bvh_ray *r,
+    float t_max)
+{
+	const bvh_node *node;
+	bvh_entry stack[BVH_STACK_SIZE], e;
+	float t_near[BVH_WIDTH];
+	size_t sp;
+
+	sp = 0;
+	if (b->n_nodes > 0)
+		stack[sp++] = (bvh_entry) { 0, 0, 0.0f };
+	while (sp > 0) {
+		e = stack[--sp];
+		if (e.count == 0) {
+			node = &b->nodes[e.index];
+			bvh_push_children(node,
+			    bvh_hit_children(node, r, t_max, t_near), t_near,
+			    stack, &sp);
+			continue;
+		}
+
+		if (e.count == BVH_DEFERRED) {
+			if (occluded_sphere_bvh(bvh_subtree(&b->lazy[e.index],
+						    &sphere_source, NULL),
+				ray, r, t_max))
+				return 1;
+			continue;
+		}
+
+		if (occluded_spheres(&scene.spheres, e.index,
+			e.index + e.count, ray, t_max))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * returns whether anything is hit in (epsilon, t_max) along the ray, stopping
+ * at the first primitive found. no shading data is computed
+ */
+int
+occluded_scene(const ray *ray, float t_max)
+{
+	const bvh_node *node;
+	bvh_ray r;
+	bvh_entry stack[BVH_STACK_SIZE], e;
+	float t_near[BVH_WIDTH];
+	size_t sp, j;
+
+	if (occluded_planes(&scene.planes, ray, t_max))
+		return 1;
+
+	bvh_ray_init(&r, ray->origin, ray->d);
+
+	sp = 0;
+	if (scene.instance_bvh.n_nodes > 0)
+		stack[sp++] = (bvh_entry) { 0, 0, 0.0f };
+	while (sp > 0) {
+		e = stack[--sp];
+		if (e.count == 0) {
+			node = &scene.instance_bvh.nodes[e.index];
+			bvh_push_children(node,
+			    bvh_hit_children(node, &r, t_max, t_near), t_near,
+			    stack, &sp);
+			continue;
+		}
+
+		for (j = e.index; j < e.index + e.count; j++)
+			if (occluded_instance(&scene.instances[j], ray, t_max))
+				return 1;
+	}
+
+	return occluded_sphere_bvh(&scene.bvh, ray, &r, t_max);
 }
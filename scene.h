@@ -4,9 +4,12 @@
 #include <cglm/cglm.h>
 #include <stdio.h>
 
+#include "bvh.h"
 #include "color.h"
+#include "envmap.h"
 #include "geom.h"
 #include "material.h"
+#include "mesh.h"
 #include "texture.h"
 
 #define PRINT_VEC(s, v) fprintf(stderr, s "(%f %f %f)\n", v[0], v[1], v[2])
@@ -15,23 +18,108 @@ typedef struct {
 	vec eye, down, right, upper_left;
 } camera;
 
+/* the camera as given in the scene, before the aspect ratio is applied */
+typedef struct {
+	vec eye, look_at, up;
+	float fov;
+} camera_params;
+
+/*
+ * a placement of shared mesh geometry. rays are taken into object space with
+ * to_object, which keeps their parameter t the same. the matrices are held
+ * as vec4 columns instead of mat4, which AVX builds align to 32 bytes, so
+ * instance arrays only need what malloc gives
+ */
+typedef struct {
+	vec4 to_world[4], to_object[4];
+	uint32_t mesh;
+	uint16_t material;
+} instance;
+
 struct scene {
 	camera camera;
+	camera_params camera_params;
 	struct {
 		texture tex;
-		float *cdf_m;
-		float *cdf_c;
-		float *pdf;
-		long w, h;
+		envmap map;
 	} bg;
-	shape shapes[4];
+	sphere_list spheres;
+	plane_list planes;
+	bvh bvh;
+	mesh *meshes;
+	size_t n_meshes, cap_meshes;
+	/* instances of the meshes, with a BVH over their world bounds */
+	instance *instances;
+	size_t n_instances, cap_instances;
+	bvh instance_bvh;
 	material *materials;
-	size_t cur_shape;
+	size_t n_materials, cap_materials;
+	int has_emissive;
+	/* set when the scene is used in place from a compiled image */
+	void *mapping;
+	size_t mapping_size;
 };
 
+/*
+ * the closest hit found by intersect_scene, before any shading data.
+ * instance is only set for triangles
+ */
+typedef struct {
+	float t;
+	shape_type type;
+	uint32_t index, instance;
+} hit_id;
+
+/* most subtrees a tile_view is cut into */
+#define VIEW_ENTRIES 32
+
+/*
+ * the subtrees of the sphere BVH that the camera rays of a screen tile can
+ * reach, nearest first, with each t no further than any of those rays can
+ * enter it
+ */
+typedef struct {
+	bvh_entry entries[VIEW_ENTRIES];
+	size_t n;
+} tile_view;
+
+/*
+ * the spheres the camera rays of a screen tile can hit, each with the
+ * rectangle of the image plane (u0, v0, u1, v1) its silhouette covers
+ */
+typedef struct {
+	uint32_t *spheres;
+	float (*extent)[4];
+	size_t n, cap;
+} tile_raster;
+
+/*
+ * where one sample's camera rays through a tile meet the image plane: the
+ * top left ray at (u, v), and a grid w by h with steps du and dv
+ */
+typedef struct {
+	float u, v, du, dv;
+	long w, h;
+} raster_grid;
+
 extern struct scene scene;
+extern int scene_stats;
+extern int scene_lazy;
 
 int load_scene(FILE *, float);
+void camera_setup(camera *, const camera_params *, float);
+int compile_scene(const char *);
+int scene_is_compiled(FILE *);
+int load_compiled(const char *, float);
+void free_scene(void);
+int intersect_scene(const ray *, hit_id *);
+void cull_view(float, float, float, float, float, tile_view *);
+int intersect_packet(const ray *, size_t, const tile_view *, hit_id *);
+int raster_view(float, float, float, float, tile_raster *);
+void raster_hits(const tile_raster *, const raster_grid *, const ray *,
+    hit_id *);
+void finalize_hit(const ray *, const hit_id *, hit_info *);
 int hit_scene(const ray *, hit_info *);
+int occluded_scene(const ray *, float);
 
 #endif /* SCENE_H */
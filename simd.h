@@ -0,0 +1,126 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/*
+ * thin wrappers over the widest float vectors the target supports, so the
+ * batch kernels can be written once. VWIDTH is 1 when neither SSE nor AVX is
+ * available and callers fall back to scalar loops
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+
+#define VWIDTH 8
+
+typedef __m256 vfloat;
+
+#define vload(p)	  _mm256_loadu_ps(p)
+#define vstore(p, a)	  _mm256_storeu_ps(p, a)
+#define vset1(f)	  _mm256_set1_ps(f)
+#define vadd(a, b)	  _mm256_add_ps(a, b)
+#define vsub(a, b)	  _mm256_sub_ps(a, b)
+#define vmul(a, b)	  _mm256_mul_ps(a, b)
+#define vdiv(a, b)	  _mm256_div_ps(a, b)
+#define vsqrt(a)	  _mm256_sqrt_ps(a)
+#define vmin(a, b)	  _mm256_min_ps(a, b)
+#define vmax(a, b)	  _mm256_max_ps(a, b)
+#define vand(a, b)	  _mm256_and_ps(a, b)
+#define vor(a, b)	  _mm256_or_ps(a, b)
+#define vlt(a, b)	  _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define vle(a, b)	  _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define vgt(a, b)	  _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define vge(a, b)	  _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define vselect(m, a, b)  _mm256_blendv_ps(b, a, m)
+#define vmask(a)	  _mm256_movemask_ps(a)
+#define vlanes()	  _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)
+#define vabs(a)		  _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a)
+
+/* converts VWIDTH bytes at p to floats */
+static inline vfloat
+vload_u8(const uint8_t *p)
+{
+	__m128i b;
+
+	b = _mm_loadl_epi64((const __m128i *)p);
+#if defined(__AVX2__)
+	return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b));
+#else
+	return _mm256_insertf128_ps(
+	    _mm256_castps128_ps256(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(b))),
+	    _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(b, 4))), 1);
+#endif
+}
+
+/* loads the first n floats at p, zeroing the lanes past them unread */
+static inline vfloat
+vload_n(const float *p, size_t n)
+{
+	if (n >= VWIDTH)
+		return vload(p);
+	return _mm256_maskload_ps(p,
+	    _mm256_castps_si256(vlt(vlanes(), vset1(n))));
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define VWIDTH 4
+
+typedef __m128 vfloat;
+
+#define vload(p)	  _mm_loadu_ps(p)
+#define vstore(p, a)	  _mm_storeu_ps(p, a)
+#define vset1(f)	  _mm_set1_ps(f)
+#define vadd(a, b)	  _mm_add_ps(a, b)
+#define vsub(a, b)	  _mm_sub_ps(a, b)
+#define vmul(a, b)	  _mm_mul_ps(a, b)
+#define vdiv(a, b)	  _mm_div_ps(a, b)
+#define vsqrt(a)	  _mm_sqrt_ps(a)
+#define vmin(a, b)	  _mm_min_ps(a, b)
+#define vmax(a, b)	  _mm_max_ps(a, b)
+#define vand(a, b)	  _mm_and_ps(a, b)
+#define vor(a, b)	  _mm_or_ps(a, b)
+#define vlt(a, b)	  _mm_cmplt_ps(a, b)
+#define vle(a, b)	  _mm_cmple_ps(a, b)
+#define vgt(a, b)	  _mm_cmpgt_ps(a, b)
+#define vge(a, b)	  _mm_cmpge_ps(a, b)
+#define vselect(m, a, b)  _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define vmask(a)	  _mm_movemask_ps(a)
+#define vlanes()	  _mm_setr_ps(0, 1, 2, 3)
+#define vabs(a)		  _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+
+/* converts VWIDTH bytes at p to floats, reading 8 */
+static inline vfloat
+vload_u8(const uint8_t *p)
+{
+	__m128i b, zero;
+
+	zero = _mm_setzero_si128();
+	b = _mm_loadl_epi64((const __m128i *)p);
+	b = _mm_unpacklo_epi16(_mm_unpacklo_epi8(b, zero), zero);
+	return _mm_cvtepi32_ps(b);
+}
+
+/* loads the first n floats at p, zeroing the lanes past them unread */
+static inline vfloat
+vload_n(const float *p, size_t n)
+{
+	float tmp[VWIDTH] = { 0 };
+	size_t i;
+
+	if (n >= VWIDTH)
+		return vload(p);
+	for (i = 0; i < n; i++)
+		tmp[i] = p[i];
+	return vload(tmp);
+}
+
+#else
+
+#define VWIDTH 1
+
+#endif
+
+#endif /* SIMD_H */
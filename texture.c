@@ -76,8 +76,6 @@ sample_pixel_intensity(texture *tex, int x, int y)
 	offset = (y * tex->image.width + x) * n;
 	img = tex->image.data;
 
-	glm_vec3_clamp(img + offset, 0.0, 1.0);
-
 	if (n < 3) {
 		return 3 * img[offset];
 	}
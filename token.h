@@ -9,6 +9,15 @@ typedef enum {
 	MATERIAL,
 	BLACKBODY,
 	KW_CHECKS,
+	SPHERES,
+	MESH,
+	INSTANCE,
+	TRANSLATE,
+	ROTATE,
+	SCALE,
+	REPEAT,
+	GRID,
+	KW_END,
 } keyword;
 
 typedef struct {
@@ -20,6 +29,7 @@ typedef struct {
 		MATERIAL_TYPE,
 		NUMBER,
 		STRING,
+		IDENT,
 		END,
 		ERROR,
 	} type;
@@ -28,7 +38,11 @@ typedef struct {
 		keyword k;
 		shape_type s;
 		material_type m;
-		char *str;
+		/* strings point into the input and aren't terminated */
+		struct {
+			const char *str;
+			size_t len;
+		};
 	};
 } token;
 